@@ -0,0 +1,1170 @@
+// scripted scenarios for sim -t, built into sim.cpp to reach the
+// firmware statics
+//  * each scenario runs in its own process from a fresh setup() and
+//    stops at the first unmet check
+//  * the scenario plays the MCU: it writes AT commands and payloads
+//    to the UART and reads everything the ESP writes in esp_out
+//  * HTTP clients are sockets pushed into a server backlog
+#include <functional>
+#include <map>
+#include <sys/wait.h>
+#include <zlib.h>
+
+#define SC_TIMEOUT 2000  // default wait for expected output, ms
+
+static const char *sc_name;
+
+#define SC_CHECK(cond) \
+    do { if (!(cond)) sc_fail(__LINE__, #cond); } while (0)
+
+
+// report failed check with the output which was not consumed
+static void sc_fail(int line, const char *what)
+{
+    printf("FAIL %s: scenario.cpp:%d: %s\n", sc_name, line, what);
+    if (!esp_out.empty())
+        printf("  unread ESP output: \"%s\"\n", esp_out.substr(0, 256).c_str());
+    fflush(stdout);
+    exit(1);
+}
+
+
+// run the simulation for ms of virtual time
+static void sc_run(uint32_t ms)
+{
+    uint64_t until = sim_now + ms * 1000ULL;
+
+    while (sim_now < until) {
+        uint64_t before = sim_now;
+
+        sim_pass();
+        sim_advance(before);
+    }
+}
+
+
+// run until cond holds, false after ms
+static bool sc_wait(const std::function<bool()> &cond, uint32_t ms = SC_TIMEOUT)
+{
+    uint64_t until = sim_now + ms * 1000ULL;
+
+    while (!cond()) {
+        uint64_t before = sim_now;
+
+        if (sim_now >= until)
+            return false;
+        sim_pass();
+        sim_advance(before);
+    }
+
+    return true;
+}
+
+
+// wait for the first of several strings in ESP output, returns
+// output up to and including it and removes that from esp_out
+static std::string sc_expect_any(const std::vector<std::string> &any, uint32_t ms = SC_TIMEOUT)
+{
+    size_t n = std::string::npos;
+    std::string r;
+
+    sc_wait([&] {
+        for (const std::string &s : any) {
+            size_t at = esp_out.find(s);
+
+            if (at != std::string::npos && (n == std::string::npos || at + s.size() < n))
+                n = at + s.size();
+        }
+        return n != std::string::npos;
+    }, ms);
+
+    if (n == std::string::npos) {
+        printf("FAIL %s: no \"%s\" from ESP\n", sc_name, any[0].c_str());
+        sc_fail(__LINE__, "sc_expect()");
+    }
+
+    r = esp_out.substr(0, n);
+    esp_out.erase(0, n);
+    return r;
+}
+
+
+static std::string sc_expect(const std::string &s, uint32_t ms = SC_TIMEOUT)
+{
+    return sc_expect_any({ s }, ms);
+}
+
+
+// send AT command, returns reply up to OK or ERROR
+static std::string sc_at(const std::string &cmd)
+{
+    mcu_write(cmd + "\r\n");
+    return sc_expect_any({ "\r\nOK\r\n", "\r\nERROR\r\n" });
+}
+
+
+// reply ends in OK
+static bool sc_ok(const std::string &reply)
+{
+    return reply.size() >= 4 && !reply.compare(reply.size() - 4, 4, "OK\r\n");
+}
+
+
+// send command with payload, true on SEND OK
+static bool sc_send_cmd(const std::string &cmd, const std::string &data)
+{
+    std::string r;
+
+    mcu_write(cmd + "," + std::to_string(data.size()) + "\r\n");
+    r = sc_expect_any({ "> ", "link is not\r\n", "too long\r\n", "\r\nERROR\r\n" });
+    if (r.compare(r.size() - 2, 2, "> "))
+        return false;
+
+    mcu_write(data);
+    r = sc_expect_any({ "SEND OK\r\n", "SEND FAIL\r\n" });
+    return r.find("SEND OK") != std::string::npos;
+}
+
+
+// AT+CIPSEND of data on link
+static bool sc_send(int link, const std::string &data)
+{
+    return sc_send_cmd("AT+CIPSEND=" + std::to_string(link), data);
+}
+
+
+// wait for <link>,CONNECT, returns the link
+static int sc_connect(uint32_t ms = SC_TIMEOUT)
+{
+    std::string r = sc_expect(",CONNECT\r\n", ms);
+    size_t start = r.find_last_of('\n', r.size() - 11);
+
+    return atoi(r.c_str() + (start == std::string::npos ? 0 : start + 1));
+}
+
+
+// wait for +IPD on link, returns its payload
+static std::string sc_ipd(int link, uint32_t ms = SC_TIMEOUT)
+{
+    std::string hdr = "+IPD," + std::to_string(link) + ",";
+    std::string data;
+    size_t len;
+
+    sc_expect(hdr, ms);
+    len = atoi(sc_expect(":").c_str());
+    SC_CHECK(sc_wait([&] { return esp_out.size() >= len; }, ms));
+    data = esp_out.substr(0, len);
+    esp_out.erase(0, len);
+    return data;
+}
+
+
+// connect a client to port, data is what it sends first
+static std::shared_ptr<sim_socket> sc_client(uint16_t port, const std::string &data)
+{
+    auto s = std::make_shared<sim_socket>();
+
+    s->port = port;
+    s->rx = data;
+    for (WiFiServer *server : sim_servers)
+        if (server->port == port && server->listening)
+            server->backlog.push_back(s);
+
+    sim_activity();
+    return s;
+}
+
+
+// wait for a complete HTTP response with Content-Length in socket
+// output, returns and removes it
+static std::string sc_response(const std::shared_ptr<sim_socket> &s, uint32_t ms = SC_TIMEOUT)
+{
+    std::string r;
+    size_t need = 0;
+
+    sc_wait([&] {
+        size_t end = s->tx.find("\r\n\r\n");
+        const char *cl;
+
+        if (end == std::string::npos)
+            return false;
+        cl = strcasestr(s->tx.c_str(), "Content-Length: ");
+        need = end + 4 + (cl != nullptr && cl < s->tx.c_str() + end ? atoi(cl + 16) : 0);
+        return s->tx.size() >= need;
+    }, ms);
+
+    if (need == 0 || s->tx.size() < need)
+        return "";
+
+    r = s->tx.substr(0, need);
+    s->tx.erase(0, need);
+    return r;
+}
+
+
+// wait for a complete chunked response in socket output, returns
+// headers and the decoded body, removes it from the output
+static std::string sc_response_chunked(const std::shared_ptr<sim_socket> &s, uint32_t ms = SC_TIMEOUT)
+{
+    std::string r, body;
+    size_t end, p;
+
+    if (!sc_wait([&] { return s->tx.find("\r\n0\r\n\r\n") != std::string::npos; }, ms))
+        return "";
+
+    end = s->tx.find("\r\n\r\n");
+    for (p = end + 4; ; ) {
+        char *next;
+        size_t len = strtoul(s->tx.c_str() + p, &next, 16);
+
+        p = next - s->tx.c_str() + 2;
+        if (len == 0)
+            break;
+        body.append(s->tx, p, len);
+        p += len + 2;
+    }
+
+    r = s->tx.substr(0, end + 4) + body;
+    s->tx.erase(0, p + 2);
+    return r;
+}
+
+
+// AT link and HTTP port 80 as the MCU sets them up
+static void sc_http_setup()
+{
+    SC_CHECK(sc_ok(sc_at("AT+CIPMUX=1")));
+    SC_CHECK(sc_ok(sc_at("AT+CIPSERVER=1,80,\"HTTP\"")));
+}
+
+
+// response the MCU writes with AT+CIPSEND
+static std::string sc_http_reply(const std::string &body, const std::string &headers = "")
+{
+    return "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\n" + headers +
+        "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body;
+}
+
+
+// request on port 80 is answered by the MCU and the link is closed
+static void scenario_http()
+{
+    sc_http_setup();
+
+    auto c = sc_client(80, "GET /item/1 HTTP/1.1\r\nHost: esp\r\nConnection: close\r\n\r\n");
+
+    sc_expect("0,CONNECT\r\n");
+    SC_CHECK(sc_ipd(0).find("GET /item/1 HTTP/1.1\r\n") == 0);
+    SC_CHECK(sc_send(0, sc_http_reply("hello")));
+    SC_CHECK(sc_ok(sc_at("AT+CIPCLOSE=0")));
+
+    std::string r = sc_response(c);
+    SC_CHECK(r.find("HTTP/1.1 200 OK\r\n") == 0);
+    SC_CHECK(r.compare(r.size() - 5, 5, "hello") == 0);
+    SC_CHECK(sc_wait([&] { return c->stopped; }));
+}
+
+
+// AT+CIPSENDM reaches the links in its mask only, the mask is decimal
+// or 0x hex, empty masks and links beyond the profile are refused
+static void scenario_sendm()
+{
+    std::shared_ptr<sim_socket> c[4];
+    uint32_t all = 0, mask;
+    int link[4];
+    char hex[16];
+
+    SC_CHECK(sc_ok(sc_at("AT+CIPMUX=1")));
+    SC_CHECK(sc_ok(sc_at("AT+CIPSERVER=1,81,\"TCP\"")));
+
+    for (int i = 0; i < 4; i++) {
+        c[i] = sc_client(81, "");
+        link[i] = sc_connect();
+        all |= 1U << link[i];
+    }
+
+    // first and last link, 9 on a fresh link table, with a leading
+    // zero which would make it octal
+    mask = 1U << link[0] | 1U << link[3];
+    SC_CHECK(sc_send_cmd("AT+CIPSENDM=0" + std::to_string(mask), "fan"));
+    snprintf(hex, sizeof(hex), "0x%X", mask);
+    SC_CHECK(sc_send_cmd(std::string("AT+CIPSENDM=") + hex, "out"));
+    sc_run(10);
+    SC_CHECK(c[0]->tx == "fanout");
+    SC_CHECK(c[1]->tx.empty() && c[2]->tx.empty());
+    SC_CHECK(c[3]->tx == "fanout");
+
+    // one link of the mask is not connected
+    SC_CHECK(!sc_send_cmd("AT+CIPSENDM=" + std::to_string(mask | (~all & (all + 1))), "x"));
+
+    SC_CHECK(!sc_ok(sc_at("AT+CIPSENDM=0,1")));
+    SC_CHECK(!sc_ok(sc_at("AT+CIPSENDM=0x,1")));
+    SC_CHECK(!sc_ok(sc_at("AT+CIPSENDM=-1,1")));
+    SC_CHECK(!sc_ok(sc_at("AT+CIPSENDM=" + std::to_string(1ULL << config::links) + ",1")));
+    sc_run(10);
+    SC_CHECK(c[0]->tx == "fanout");
+}
+
+
+// GET on port 80 with keep-alive
+static std::shared_ptr<sim_socket> sc_get(const std::string &path, const std::string &headers = "")
+{
+    return sc_client(80, "GET " + path + " HTTP/1.1\r\nHost: esp\r\n" + headers + "\r\n");
+}
+
+
+// a request the MCU never answers opens the breaker once, after the
+// cooldown a probe goes through and closes it while that request is
+// still pending
+static void scenario_breaker()
+{
+    sc_http_setup();
+    SC_CHECK(sc_ok(sc_at("AT+CIPBREAKER=500,8,1000")));
+
+    auto stalled = sc_get("/stalled");
+    int a = sc_connect();
+    sc_ipd(a);
+
+    // over breaker_latency, the next request is answered with 503
+    sc_run(600);
+    auto rejected = sc_get("/rejected");
+    SC_CHECK(sc_response(rejected).find("HTTP/1.1 503 ") == 0);
+
+    // requests during the cooldown keep getting 503 but don't
+    // restart it
+    for (int i = 0; i < 4; i++) {
+        sc_run(200);
+        auto c = sc_get("/cooldown");
+        SC_CHECK(sc_response(c).find("HTTP/1.1 503 ") == 0);
+    }
+
+    // cooldown is over, probe reaches the MCU and closes the breaker
+    sc_run(300);
+    auto probe = sc_get("/probe");
+    int b = sc_connect();
+    SC_CHECK(sc_ipd(b).find("GET /probe ") == 0);
+    SC_CHECK(sc_send(b, sc_http_reply("probe")));
+    SC_CHECK(sc_response(probe).find("HTTP/1.1 200 ") == 0);
+
+    // closed, stalled request does not trip it again
+    auto next = sc_get("/next");
+    int c = sc_connect();
+    SC_CHECK(sc_ipd(c).find("GET /next ") == 0);
+    SC_CHECK(sc_send(c, sc_http_reply("next")));
+    SC_CHECK(sc_response(next).find("HTTP/1.1 200 ") == 0);
+    SC_CHECK(breaker == BREAKER_CLOSED && breaker_trips == 1);
+    SC_CHECK(stalled->tx.empty() && !stalled->stopped);
+}
+
+
+// header value in response, empty if missing
+static std::string sc_header(const std::string &r, const std::string &name)
+{
+    size_t at = r.find("\r\n" + name + ": ");
+    size_t end = r.find("\r\n\r\n");
+
+    if (at == std::string::npos || at >= end)
+        return "";
+
+    at += name.size() + 4;
+    return r.substr(at, r.find("\r\n", at) - at);
+}
+
+
+// body of response
+static std::string sc_body(const std::string &r)
+{
+    size_t end = r.find("\r\n\r\n");
+
+    return end == std::string::npos ? "" : r.substr(end + 4);
+}
+
+
+// MCU late past cache_deadline gets the last copy served with Age,
+// its late answer only refreshes the copy
+static void scenario_stale()
+{
+    sc_http_setup();
+    SC_CHECK(sc_ok(sc_at("AT+CIPCACHE=300")));
+
+    auto fresh = sc_get("/value");
+    int a = sc_connect();
+    sc_ipd(a);
+    SC_CHECK(sc_send(a, sc_http_reply("v1")));
+    SC_CHECK(sc_ok(sc_at("AT+CIPCLOSE=" + std::to_string(a))));
+    std::string r = sc_response(fresh);
+    SC_CHECK(sc_body(r) == "v1" && sc_header(r, "Age").empty());
+
+    // MCU stalls, copy is 3 s old
+    sc_run(3000);
+    auto stale = sc_get("/value", "Connection: close\r\n");
+    int b = sc_connect();
+    sc_ipd(b);
+    r = sc_response(stale, 1000);
+    SC_CHECK(sc_body(r) == "v1");
+    SC_CHECK(sc_header(r, "Age") == "3");
+    SC_CHECK(sc_wait([&] { return stale->stopped; }));
+
+    // late answer goes to the cache, not to the closed client
+    SC_CHECK(sc_send(b, sc_http_reply("v2")));
+    SC_CHECK(sc_ok(sc_at("AT+CIPCLOSE=" + std::to_string(b))));
+    SC_CHECK(stale->tx.empty());
+
+    auto again = sc_get("/value");
+    int c = sc_connect();
+    sc_ipd(c);
+    r = sc_response(again, 1000);
+    SC_CHECK(sc_body(r) == "v2" && sc_header(r, "Age") == "0");
+
+    // other path has no copy, client waits for the MCU
+    auto other = sc_get("/other");
+    int d = sc_connect();
+    sc_ipd(d);
+    sc_run(1000);
+    SC_CHECK(other->tx.empty());
+    SC_CHECK(sc_send(d, sc_http_reply("o")));
+    SC_CHECK(sc_body(sc_response(other)) == "o");
+}
+
+
+// gunzip data with zlib, empty on error
+static std::string sc_gunzip(const std::string &data)
+{
+    std::string out;
+    char buf[4096];
+    z_stream z = {};
+    int r;
+
+    if (inflateInit2(&z, 16 + MAX_WBITS) != Z_OK)
+        return "";
+
+    z.next_in = (Bytef *)data.data();
+    z.avail_in = data.size();
+    do {
+        z.next_out = (Bytef *)buf;
+        z.avail_out = sizeof(buf);
+        r = inflate(&z, Z_NO_FLUSH);
+        out.append(buf, sizeof(buf) - z.avail_out);
+    } while (r == Z_OK);
+
+    inflateEnd(&z);
+    return r == Z_STREAM_END && z.avail_in == 0 ? out : "";
+}
+
+
+// answer request on link with body split over several AT+CIPSEND
+static void sc_send_split(int link, const std::string &reply, size_t part)
+{
+    for (size_t off = 0; off < reply.size(); off += part)
+        SC_CHECK(sc_send(link, reply.substr(off, part)));
+}
+
+
+// gzip output decodes with zlib to the MCU body, chunked on a
+// keep-alive socket and ended by close otherwise
+static void scenario_gzip()
+{
+    std::string body;
+
+    for (int i = 0; body.size() < 6000; i++)
+        body += "{\"sensor\":" + std::to_string(i % 7) + ",\"value\":" + std::to_string(i * 37 % 1000) + "}\n";
+
+    sc_http_setup();
+    SC_CHECK(sc_ok(sc_at("AT+CIPGZIP=1")));
+
+    auto c = sc_get("/data", "Accept-Encoding: deflate, gzip\r\n");
+    int a = sc_connect();
+    sc_ipd(a);
+    sc_send_split(a, sc_http_reply(body), 1000);
+    SC_CHECK(sc_ok(sc_at("AT+CIPCLOSE=" + std::to_string(a))));
+    std::string r = sc_response_chunked(c);
+    SC_CHECK(sc_header(r, "Content-Encoding") == "gzip");
+    SC_CHECK(sc_header(r, "Content-Length").empty());
+    SC_CHECK(sc_body(r).size() < body.size() / 2);
+    SC_CHECK(sc_gunzip(sc_body(r)) == body);
+    SC_CHECK(!c->stopped);
+
+    auto d = sc_get("/data", "Accept-Encoding: gzip\r\nConnection: close\r\n");
+    a = sc_connect();
+    sc_ipd(a);
+    sc_send_split(a, sc_http_reply(body), 700);
+    SC_CHECK(sc_ok(sc_at("AT+CIPCLOSE=" + std::to_string(a))));
+    SC_CHECK(sc_wait([&] { return d->stopped; }));
+    SC_CHECK(sc_header(d->tx, "Transfer-Encoding").empty());
+    SC_CHECK(sc_gunzip(sc_body(d->tx)) == body);
+
+    // client without gzip gets the body as is
+    auto e = sc_get("/data");
+    a = sc_connect();
+    sc_ipd(a);
+    sc_send_split(a, sc_http_reply(body), 1000);
+    r = sc_response(e);
+    SC_CHECK(sc_header(r, "Content-Encoding").empty() && sc_body(r) == body);
+}
+
+
+// client frame, masked as RFC 6455 requires
+static std::string sc_ws_frame(uint8_t op, const std::string &data)
+{
+    const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+    std::string f(1, (char)(0x80 | op));
+
+    if (data.size() < 126) {
+        f += (char)(0x80 | data.size());
+    } else {
+        f += (char)(0x80 | 126);
+        f += (char)(data.size() >> 8);
+        f += (char)data.size();
+    }
+
+    f.append((const char *)mask, 4);
+    for (size_t i = 0; i < data.size(); i++)
+        f += (char)(data[i] ^ mask[i & 3]);
+    return f;
+}
+
+
+// take one unmasked server frame from socket output, op is 0 when
+// the frame is not complete
+static std::string sc_ws_read(const std::shared_ptr<sim_socket> &s, uint8_t *op)
+{
+    const std::string &t = s->tx;
+    size_t hl = 2, len;
+    std::string data;
+
+    *op = 0;
+    if (t.size() < 2 || (t[1] & 0x80))
+        return "";
+
+    len = t[1] & 0x7F;
+    if (len == 126) {
+        if (t.size() < 4)
+            return "";
+        len = (uint8_t)t[2] << 8 | (uint8_t)t[3];
+        hl = 4;
+    }
+
+    if (t.size() < hl + len)
+        return "";
+
+    *op = t[0];
+    data = t.substr(hl, len);
+    s->tx.erase(0, hl + len);
+    return data;
+}
+
+
+// wait for server frame
+static std::string sc_ws_wait(const std::shared_ptr<sim_socket> &s, uint8_t *op)
+{
+    std::string data;
+
+    sc_wait([&] { data = sc_ws_read(s, op); return *op != 0; });
+    return data;
+}
+
+
+// WebSocket upgrade on ws_path, frames both ways, ping and close
+static void scenario_ws()
+{
+    std::string big(300, 'w');
+    std::string data;
+    uint8_t op;
+
+    sc_http_setup();
+    SC_CHECK(sc_ok(sc_at("AT+CIPWS=\"/ws\"")));
+
+    // key and accept value from RFC 6455 section 1.3
+    auto c = sc_get("/ws", "Upgrade: websocket\r\nConnection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\nSec-WebSocket-Version: 13\r\n");
+    int a = sc_connect();
+    std::string r = sc_response(c);
+    SC_CHECK(r.find("HTTP/1.1 101 ") == 0);
+    SC_CHECK(sc_header(r, "Sec-WebSocket-Accept") == "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+
+    // client frames reach the MCU unmasked, two in one segment
+    c->rx += sc_ws_frame(0x1, "hello") + sc_ws_frame(0x1, big);
+    sim_activity();
+    data = sc_ipd(a);
+    while (data.size() < 5 + big.size())
+        data += sc_ipd(a);
+    SC_CHECK(data == "hello" + big);
+
+    // each AT+CIPSEND is one text frame
+    SC_CHECK(sc_send(a, "world"));
+    SC_CHECK(sc_ws_wait(c, &op) == "world" && op == 0x81);
+    SC_CHECK(sc_send(a, big));
+    SC_CHECK(sc_ws_wait(c, &op) == big && op == 0x81);
+
+    // ping is answered here, MCU sees nothing of it
+    c->rx += sc_ws_frame(0x9, "p1");
+    sim_activity();
+    SC_CHECK(sc_ws_wait(c, &op) == "p1" && op == 0x8A);
+    sc_run(10);
+    SC_CHECK(esp_out.find("+IPD") == std::string::npos);
+
+    // close is echoed with its code and MCU gets CLOSED
+    c->rx += sc_ws_frame(0x8, std::string("\x03\xe8" "bye"));
+    sim_activity();
+    SC_CHECK(sc_ws_wait(c, &op) == "\x03\xe8" && op == 0x88);
+    sc_expect(std::to_string(a) + ",CLOSED\r\n");
+    SC_CHECK(c->stopped);
+}
+
+
+// parsed JSON value, type is one of "{[\"0tfn" (object, array,
+// string, number, true, false, null)
+struct sc_json {
+    char type = 0;
+    std::string str;                     // string, number as written
+    std::map<std::string, sc_json> obj;
+    std::vector<sc_json> arr;
+};
+
+
+// parse JSON value at p, independent of the firmware check,
+// false on any deviation from RFC 8259
+static bool sc_json_parse(const std::string &s, size_t &p, sc_json &v)
+{
+    auto ws = [&] { while (p < s.size() && strchr(" \t\r\n", s[p]) && s[p]) p++; };
+    auto lit = [&](const char *w, char t) {
+        if (s.compare(p, strlen(w), w))
+            return false;
+        p += strlen(w);
+        v.type = t;
+        return true;
+    };
+
+    ws();
+    if (p >= s.size())
+        return false;
+
+    if (s[p] == '"') {
+        v.type = '"';
+        for (p++; p < s.size() && s[p] != '"'; p++) {
+            if ((uint8_t)s[p] < 0x20)
+                return false;
+            if (s[p] != '\\') {
+                v.str += s[p];
+                continue;
+            }
+            if (++p == s.size())
+                return false;
+            switch (s[p]) {
+            case '"': case '\\': case '/': v.str += s[p]; break;
+            case 'b': v.str += '\b'; break;
+            case 'f': v.str += '\f'; break;
+            case 'n': v.str += '\n'; break;
+            case 'r': v.str += '\r'; break;
+            case 't': v.str += '\t'; break;
+            case 'u': {
+                unsigned c;
+                if (p + 4 >= s.size() || sscanf(s.c_str() + p + 1, "%4x", &c) != 1 ||
+                    !std::all_of(s.begin() + p + 1, s.begin() + p + 5, ::isxdigit) || c >= 0x80)
+                    return false;
+                v.str += (char)c;
+                p += 4;
+                break;
+            }
+            default: return false;
+            }
+        }
+        return p++ < s.size();
+    }
+
+    if (s[p] == '{' || s[p] == '[') {
+        char close = s[p] == '{' ? '}' : ']';
+
+        v.type = s[p++];
+        ws();
+        if (p < s.size() && s[p] == close)
+            return ++p;
+
+        for (;;) {
+            sc_json key, item;
+
+            if (close == '}') {
+                ws();
+                if (p >= s.size() || s[p] != '"' || !sc_json_parse(s, p, key))
+                    return false;
+                ws();
+                if (p >= s.size() || s[p++] != ':' || v.obj.count(key.str))
+                    return false;
+            }
+            if (!sc_json_parse(s, p, item))
+                return false;
+            if (close == '}')
+                v.obj[key.str] = item;
+            else
+                v.arr.push_back(item);
+            ws();
+            if (p < s.size() && s[p] == close)
+                return ++p;
+            if (p >= s.size() || s[p++] != ',')
+                return false;
+        }
+    }
+
+    if (lit("true", 't') || lit("false", 'f') || lit("null", 'n'))
+        return true;
+
+    // number, checked by strtod and a JSON shape check
+    size_t start = p;
+    if (s[p] == '-')
+        p++;
+    if (p >= s.size() || !isdigit((uint8_t)s[p]) || (s[p] == '0' && p + 1 < s.size() && isdigit((uint8_t)s[p + 1])))
+        return false;
+    while (p < s.size() && (isdigit((uint8_t)s[p]) || strchr(".eE+-", s[p])) && s[p])
+        p++;
+    char *end;
+    std::string num = s.substr(start, p - start);
+    strtod(num.c_str(), &end);
+    if (*end != '\0' || num.back() == '.' || num.find(".e") != std::string::npos || num.find(".E") != std::string::npos)
+        return false;
+    v.type = '0';
+    v.str = num;
+    return true;
+}
+
+
+// whole document is one JSON value
+static bool sc_json_doc(const std::string &s, sc_json &v)
+{
+    size_t p = 0;
+
+    if (!sc_json_parse(s, p, v))
+        return false;
+    while (p < s.size() && strchr(" \t\r\n", s[p]) && s[p])
+        p++;
+    return p == s.size();
+}
+
+
+// snapshot document parses as JSON, JSON bodies are embedded as
+// values, others and broken JSON as strings, paths without a 200
+// response are null
+static void scenario_snapshot()
+{
+    static const struct {
+        const char *path;
+        const char *head;
+        std::string body;
+    } values[] = {
+        { "/temp", "200 OK\r\nContent-Type: application/json", "21.5" },
+        { "/name", "200 OK\r\nContent-Type: text/plain", "say \"hi\"\\\n\t\x01" },
+        { "/obj", "200 OK\r\nContent-Type: application/json; charset=utf-8",
+            " {\"x\": [1, -2.5e3, {\"y\": null}], \"s\": \"a\\u0041\"} " },
+        { "/comma", "200 OK\r\nContent-Type: application/json", "{\"a\":1,}" },
+        { "/word", "200 OK\r\nContent-Type: application/json", "tru" },
+        { "/zero", "200 OK\r\nContent-Type: application/json", "012" },
+        { "/gone", "404 Not Found\r\nContent-Type: text/plain", "no" },
+    };
+    std::string cmd = "AT+CIPSNAP=60000";
+    sc_json doc;
+
+    sc_http_setup();
+    for (auto &v : values)
+        cmd += std::string(",\"") + v.path + "\"";
+    SC_CHECK(sc_ok(sc_at(cmd)));
+
+    // ESP fetches each path over an internal link while UART is idle
+    for (size_t n = 0; n < sizeof(values) / sizeof(values[0]); n++) {
+        int link = sc_connect(5000);
+        std::string req = sc_ipd(link);
+        size_t k;
+
+        for (k = 0; k < sizeof(values) / sizeof(values[0]); k++)
+            if (req.find(std::string("GET ") + values[k].path + " ") == 0)
+                break;
+        SC_CHECK(k < sizeof(values) / sizeof(values[0]));
+
+        SC_CHECK(sc_send(link, std::string("HTTP/1.1 ") + values[k].head + "\r\nContent-Length: " +
+            std::to_string(values[k].body.size()) + "\r\n\r\n" + values[k].body));
+        SC_CHECK(sc_ok(sc_at("AT+CIPCLOSE=" + std::to_string(link))));
+    }
+
+    SC_CHECK(snap_doc != nullptr);
+    std::string text(snap_doc, snap_len);
+    if (!sc_json_doc(text, doc)) {
+        printf("  snapshot: %s\n", text.c_str());
+        SC_CHECK(!"snapshot is not JSON");
+    }
+    SC_CHECK(doc.type == '{' && doc.obj["uptime"].type == '0' && doc.obj["values"].type == '{');
+
+    auto &vals = doc.obj["values"].obj;
+    SC_CHECK(vals.size() == sizeof(values) / sizeof(values[0]));
+    SC_CHECK(vals["/temp"].obj["value"].type == '0' && vals["/temp"].obj["value"].str == "21.5");
+    SC_CHECK(vals["/temp"].obj["time"].type == '0');
+    SC_CHECK(vals["/name"].obj["value"].type == '"' && vals["/name"].obj["value"].str == values[1].body);
+
+    sc_json &obj = vals["/obj"].obj["value"];
+    SC_CHECK(obj.type == '{' && obj.obj["x"].arr.size() == 3 && obj.obj["x"].arr[2].obj["y"].type == 'n');
+    SC_CHECK(obj.obj["s"].str == "aA");
+
+    // broken JSON bodies are kept as strings
+    SC_CHECK(vals["/comma"].obj["value"].type == '"' && vals["/comma"].obj["value"].str == "{\"a\":1,}");
+    SC_CHECK(vals["/word"].obj["value"].type == '"');
+    SC_CHECK(vals["/zero"].obj["value"].type == '"');
+    SC_CHECK(vals["/gone"].type == 'n');
+}
+
+
+// TLS port needs RTS, with it the MCU is held off during the
+// handshake and no input is lost, without it clients are refused
+static void scenario_tls()
+{
+    const size_t burst = 400;  // more AT input than ring and fifo hold
+    std::string flood;
+
+    sc_http_setup();
+    SC_CHECK(!sc_ok(sc_at("AT+CIPSERVER=1,443,\"HTTPS\"")));
+    SC_CHECK(sc_ok(sc_at("AT+UART_CUR=" + std::to_string(opt.baud) + ",8,1,0,1")));
+    SC_CHECK(sc_ok(sc_at("AT+CIPSERVER=1,443,\"HTTPS\"")));
+
+    // client arrives while the MCU keeps writing commands
+    auto c = sc_client(443, "GET /secure HTTP/1.1\r\nHost: esp\r\n\r\n");
+    for (size_t i = 0; i < burst; i++)
+        flood += "AT\r\n";
+    mcu_write(flood);
+
+    // every command is answered, the request follows the handshake
+    SC_CHECK(sc_wait([&] {
+        size_t oks = 0;
+
+        for (size_t at = 0; (at = esp_out.find("\r\nOK\r\n", at)) != std::string::npos; at++)
+            oks++;
+        return oks == burst && esp_out.find("+IPD,") != std::string::npos;
+    }, 5000));
+    int link = sc_connect();
+    SC_CHECK(tls_handshakes == 1 && tls_link(link));
+    SC_CHECK(sc_ipd(link).find("GET /secure ") == 0);
+    SC_CHECK(total.fifo_overflows + window.fifo_overflows == 0);
+    SC_CHECK(uart_overruns == 0 && uart_rx_errors == 0);
+
+    SC_CHECK(sc_send(link, sc_http_reply("secret")));
+    SC_CHECK(sc_body(sc_response(c)) == "secret");
+
+    // RTS off, handshake would lose input, client is refused
+    SC_CHECK(sc_ok(sc_at("AT+UART_CUR=" + std::to_string(opt.baud) + ",8,1,0,0")));
+    auto d = sc_client(443, "GET /secure HTTP/1.1\r\nHost: esp\r\n\r\n");
+    SC_CHECK(sc_wait([&] { return d->stopped; }));
+    SC_CHECK(tls_refused == 1 && tls_handshakes == 1);
+    SC_CHECK(esp_out.find("CONNECT") == std::string::npos);
+}
+
+
+// decode the binary frames complete in ESP output and remove them,
+// each is <type><seq><ack><link><payload>
+static std::vector<std::string> sc_bin_frames()
+{
+    std::vector<std::string> frames;
+    size_t end;
+
+    while ((end = esp_out.find('\0')) != std::string::npos) {
+        std::string f;
+        size_t p = 0, n = 4;
+
+        while (p < end) {
+            uint8_t code = esp_out[p++];
+
+            f.append(esp_out, p, code - 1);
+            p += code - 1;
+            if (code != 0xFF && p < end)
+                f += '\0';
+        }
+        esp_out.erase(0, end + 1);
+
+        SC_CHECK(f.size() >= 7 && bin_crc((const uint8_t *)f.data(), f.size() - 2) ==
+            ((uint8_t)f[f.size() - 2] | (uint8_t)f[f.size() - 1] << 8));
+        while (f[n++] & 0x80)
+            ;
+        frames.push_back(f.substr(0, 4) + f.substr(n, f.size() - n - 2));
+    }
+
+    return frames;
+}
+
+
+// EXIT with frames still unacked is not taken, links and new clients
+// wait, the next EXIT after the ack switches back to AT commands and
+// nothing the ESP had queued is lost
+static void scenario_binexit()
+{
+    std::vector<std::string> f;
+
+    SC_CHECK(sc_ok(sc_at("AT+CIPMUX=1")));
+    SC_CHECK(sc_ok(sc_at("AT+CIPSERVER=1,81,\"TCP\"")));
+    SC_CHECK(sc_ok(sc_at("AT+CIPBINARY=1")));
+
+    auto c = sc_client(81, "hello");
+    SC_CHECK(sc_wait([&] {
+        for (const std::string &s : sc_bin_frames())
+            f.push_back(s);
+        return f.size() == 2;
+    }));
+    SC_CHECK(f[0][0] == BIN_CONNECT && f[0][1] == 0);
+    SC_CHECK(f[1][0] == BIN_DATA && f[1][1] == 1 && f[1].substr(4) == "hello");
+    int link = f[0][3];
+
+    // EXIT acks nothing, the ESP does not take it
+    mcu.bin_rx_seq = 0;
+    mcu_bin_write(BIN_EXIT, 0, 0, "");
+    sc_run(100);
+    f = sc_bin_frames();
+    SC_CHECK(!f.empty() && bin_mode);
+    for (const std::string &s : f)
+        SC_CHECK(s[0] == BIN_ACK && s[2] == 0);
+
+    // meanwhile link data and a new client are held back
+    c->rx += "more";
+    auto d = sc_client(81, "");
+    sc_run(100);
+    for (const std::string &s : sc_bin_frames())
+        SC_CHECK(s[0] == BIN_ACK);
+
+    // EXIT acking both frames is taken
+    mcu.bin_rx_seq = 2;
+    mcu_bin_write(BIN_EXIT, 0, 0, "");
+    SC_CHECK(sc_wait([] { return !bin_mode && esp_out.find('\0') != std::string::npos; }));
+    f = sc_bin_frames();
+    SC_CHECK(f.size() == 1 && f[0][0] == BIN_ACK && f[0][2] == 1);
+
+    SC_CHECK(sc_ipd(link) == "more");
+    SC_CHECK(sc_connect() != link);
+    SC_CHECK(sc_send(link, "bye"));
+    sc_run(10);
+    SC_CHECK(c->tx == "bye" && d->tx.empty());
+}
+
+
+// links as an MCU tracks them from URCs
+struct sc_links {
+    bool open[32] = {};
+    std::vector<std::pair<int, std::string>> ipd;  // link, payload
+};
+
+
+// take URCs from ESP output into links: CONNECT only on a closed
+// link, +IPD and CLOSED only on an open one
+static void sc_track(sc_links &l, const std::string &text)
+{
+    size_t p = 0;
+
+    while (p < text.size()) {
+        size_t eol = text.find('\n', p);
+        int link, len, n = 0;
+        char event[8];
+
+        if (sscanf(text.c_str() + p, "+IPD,%d,%d:%n", &link, &len, &n) == 2 && n > 0) {
+            SC_CHECK(link >= 0 && link < config::links && l.open[link]);
+            l.ipd.push_back({ link, text.substr(p + n, len) });
+            p += n + len;
+            continue;
+        }
+
+        if (eol == std::string::npos)
+            break;
+
+        if (sscanf(text.c_str() + p, "%d,%7[A-Z]\r\n", &link, event) == 2) {
+            SC_CHECK(link >= 0 && link < config::links);
+            if (!strcmp(event, "CONNECT")) {
+                SC_CHECK(!l.open[link]);
+                l.open[link] = true;
+            } else if (!strcmp(event, "CLOSED")) {
+                SC_CHECK(l.open[link]);
+                l.open[link] = false;
+            }
+        }
+        p = eol + 1;
+    }
+}
+
+
+// run until a request arrived in links, returns the oldest one
+static std::pair<int, std::string> sc_next_request(sc_links &l)
+{
+    std::pair<int, std::string> r;
+
+    SC_CHECK(sc_wait([&] {
+        size_t end = esp_out.rfind("\r\nOK\r\n");
+
+        if (end != std::string::npos) {
+            sc_track(l, esp_out.substr(0, end + 6));
+            esp_out.erase(0, end + 6);
+        }
+        return !l.ipd.empty();
+    }));
+
+    r = l.ipd.front();
+    l.ipd.erase(l.ipd.begin());
+    return r;
+}
+
+
+// AT+CIPCLOSE, waits for the CLOSED URC
+static void sc_close(sc_links &l, int link)
+{
+    std::string closed = std::to_string(link) + ",CLOSED\r\n";
+
+    mcu_write("AT+CIPCLOSE=" + std::to_string(link) + "\r\n");
+    SC_CHECK(sc_wait([&] {
+        return esp_out.find(closed) != std::string::npos && esp_out.find("\r\nOK\r\n") != std::string::npos;
+    }));
+    sc_track(l, esp_out);
+    esp_out.clear();
+    SC_CHECK(!l.open[link]);
+}
+
+
+// CIPCLOSE before the body the MCU declared is complete closes the
+// socket, a complete one keeps it for the next request on a new
+// link, which may reuse the id
+static void scenario_close()
+{
+    const std::string chunked = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n";
+    sc_links l;
+
+    sc_http_setup();
+
+    // Content-Length: 10 with 5 bytes sent
+    auto a = sc_get("/a");
+    auto r = sc_next_request(l);
+    SC_CHECK(r.second.find("GET /a ") == 0);
+    SC_CHECK(sc_send(r.first, "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nshort"));
+    sc_close(l, r.first);
+    SC_CHECK(sc_wait([&] { return a->stopped; }));
+
+    // own chunked encoding, complete, terminator split across sends
+    auto b = sc_get("/b");
+    r = sc_next_request(l);
+    SC_CHECK(sc_send(r.first, chunked + "5;x=1\r\nhel"));
+    SC_CHECK(sc_send(r.first, "lo\r\n0\r\nX-Tail: 1\r\n\r\n"));
+    sc_close(l, r.first);
+    sc_run(100);
+    SC_CHECK(!b->stopped && b->tx.find("\r\n\r\n5;x=1\r\nhello\r\n0\r\nX-Tail: 1\r\n\r\n") != std::string::npos);
+
+    // next request on that socket, last chunk never comes
+    b->tx.clear();
+    b->rx += "GET /b2 HTTP/1.1\r\nHost: esp\r\n\r\n";
+    sim_activity();
+    r = sc_next_request(l);
+    SC_CHECK(r.second.find("GET /b2 ") == 0);
+    SC_CHECK(sc_send(r.first, chunked + "5\r\nhello\r\n"));
+    sc_close(l, r.first);
+    SC_CHECK(sc_wait([&] { return b->stopped; }));
+    SC_CHECK(b->tx.find("0\r\n\r\n") == std::string::npos);
+
+    // pipelined requests, each on a link of its own, HEAD declares
+    // a length it has no body for
+    auto c = sc_get("/c1");
+    c->rx += "HEAD /c2 HTTP/1.1\r\nHost: esp\r\n\r\nGET /c3 HTTP/1.1\r\nHost: esp\r\n\r\n";
+    for (const char *path : { "GET /c1 ", "HEAD /c2 ", "GET /c3 " }) {
+        r = sc_next_request(l);
+        SC_CHECK(r.second.find(path) == 0);
+        if (path[0] == 'H')
+            SC_CHECK(sc_send(r.first, "HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\n"));
+        else
+            SC_CHECK(sc_send(r.first, sc_http_reply("ok")));
+        sc_close(l, r.first);
+    }
+    sc_run(100);
+    SC_CHECK(!c->stopped);
+
+    size_t n = 0;
+    for (size_t at = 0; (at = c->tx.find("HTTP/1.1 200 OK\r\n", at)) != std::string::npos; at++)
+        n++;
+    SC_CHECK(n == 3);
+
+    // more requests than links, ids come round again
+    std::vector<bool> seen(config::links);
+    bool reused = false;
+    for (int k = 0; k <= config::links; k++) {
+        c->rx += "GET /d HTTP/1.1\r\nHost: esp\r\n\r\n";
+        sim_activity();
+        r = sc_next_request(l);
+        reused |= seen[r.first];
+        seen[r.first] = true;
+        SC_CHECK(sc_send(r.first, sc_http_reply("ok")));
+        sc_close(l, r.first);
+    }
+    SC_CHECK(reused && !c->stopped);
+}
+
+
+static const struct {
+    const char *name;
+    void (*run)();
+} scenarios[] = {
+    { "http", scenario_http },
+    { "sendm", scenario_sendm },
+    { "breaker", scenario_breaker },
+    { "stale", scenario_stale },
+    { "gzip", scenario_gzip },
+    { "ws", scenario_ws },
+    { "snapshot", scenario_snapshot },
+    { "tls", scenario_tls },
+    { "binexit", scenario_binexit },
+    { "close", scenario_close },
+};
+
+
+// run one scenario in a child process, true if it passed
+static bool scenario_fork(int n)
+{
+    pid_t pid;
+    int status;
+
+    fflush(stdout);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return false;
+    }
+
+    if (pid == 0) {
+        sc_name = scenarios[n].name;
+        sim_base = (1ULL << 32) * 1000 - (uint64_t)(opt.wrap * 60e6);
+        setup();
+        if (Serial.baudRate() != opt.baud)
+            Serial.updateBaudRate(opt.baud);
+        sc_expect("ready\r\n");
+        esp_out.clear();
+        scenarios[n].run();
+        exit(0);
+    }
+
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+
+// sim -t [name ...], runs all scenarios without names
+static int scenario_main(int argc, char **argv)
+{
+    int failed = 0, ran = 0;
+
+    opt.rate = 0;
+    opt.publish = 0;
+    opt.outage_every = 0;
+
+    for (size_t n = 0; n < sizeof(scenarios) / sizeof(scenarios[0]); n++) {
+        bool named = argc == 0;
+
+        for (int i = 0; i < argc; i++)
+            if (!strcmp(argv[i], scenarios[n].name))
+                named = true;
+        if (!named)
+            continue;
+
+        ran++;
+        if (scenario_fork(n)) {
+            printf("ok %s\n", scenarios[n].name);
+        } else {
+            printf("FAIL %s\n", scenarios[n].name);
+            failed++;
+        }
+    }
+
+    printf("%d scenarios, %d failed\n", ran, failed);
+    return failed > 0 || ran == 0;
+}
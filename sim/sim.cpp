@@ -0,0 +1,1604 @@
+// host simulator for src/main.cpp on a virtual clock
+//  * millis() starts a few minutes before its 32 bit wrap, micros()
+//    wraps every 71 minutes
+//  * UART at the configured baud rate to an MCU model which answers
+//    HTTP requests with AT+CIPSEND and publishes over MQTT, or with
+//    binary DATA frames after AT+CIPBINARY=1
+//  * Poisson HTTP clients on port 80, an MQTT broker and periodic
+//    Wi-Fi outages which drop all sockets
+//  * prints throughput and latency for every report interval
+//  * -t runs the scripted scenarios of scenario.cpp instead
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <random>
+#include <vector>
+#include <math.h>
+#include <unistd.h>
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+#include <openssl/ssl.h>
+#include <openssl/x509.h>
+
+#include "../src/main.cpp"
+
+#define SIM_FIFO 128            // uart hardware fifo
+#define SIM_IDLE_STEP 10000     // max clock step without events, us
+#define SIM_BUSY_STEP 1000      // max clock step with requests in flight, us
+#define SIM_CLIENT_TIMEOUT 30   // HTTP client gives up, s
+#define SIM_MCU_TIMEOUT 10      // MCU gives up waiting for a reply, s
+#define SIM_CONNECT_RTT 20000   // successful TCP connect, us
+#define SIM_NET_DELAY 5000      // client close reaches the ESP, us
+#define SIM_PATHS 50            // distinct request paths
+#define SIM_DRAIN 60            // quiet time before final checks, s
+#define SIM_BIN_RETRY 500000    // binary window resend without ack, us
+
+HardwareSerial Serial;
+EspClass ESP;
+WiFiClass WiFi;
+EEPROMClass EEPROM;
+uint32_t sim_uart_regs[8];
+
+struct options {
+    double days = 2;
+    double rate = 2;             // HTTP requests per second
+    uint32_t baud = 115200;
+    uint32_t mcu_ms = 20;        // mean MCU time to build a response
+    uint32_t body = 256;         // response body bytes
+    double outage_every = 6;     // hours between Wi-Fi outages, 0 = none
+    double outage_len = 120;     // outage length, s
+    double publish = 10;         // s between MQTT publishes, 0 = no MQTT
+    double report = 6;           // hours per report line
+    double wrap = 10;            // minutes until millis() wraps
+    uint32_t loop_us = 50;       // cost of one loop() pass
+    uint32_t tls_ms = 1000;      // TLS handshake on the ESP, assumed
+    unsigned seed = 1;
+    bool binary = false;         // binary frames after setup, no MQTT
+    bool test = false;           // run scripted scenarios, see scenario.cpp
+} opt;
+
+struct stats {
+    uint32_t ok;                 // complete 200 responses
+    uint32_t status;             // complete responses with other status
+    uint32_t failed;             // closed or timed out before complete
+    uint32_t refused;            // no listener, no free link or Wi-Fi down
+    uint64_t bytes;              // response bytes received by clients
+    std::vector<uint32_t> latency;  // us, complete responses
+    uint64_t uart_tx;
+    uint64_t uart_rx;
+    uint32_t mqtt_connects;
+    uint64_t mqtt_wait;          // us from tcp_connect() to connected
+    uint32_t mqtt_published;     // PUBLISH received by broker
+    uint32_t mcu_timeouts;
+    uint32_t mcu_aborts;         // AT+CIPSEND payload cut short by close
+    uint32_t bin_resends;        // binary window sent again without ack
+    uint32_t fifo_overflows;
+    uint32_t loop_max;           // us on the virtual clock
+    uint64_t loop_passes;
+    uint64_t loop_cpu;           // ns of host CPU in loop()
+};
+
+static struct stats window, total;
+
+// virtual clock, us since start of simulation
+static uint64_t sim_now;
+static uint64_t sim_base;
+static bool sim_busy;
+
+// uart, tx is ESP to MCU
+static double tx_free;
+static std::deque<std::pair<double, std::string>> tx_line;
+static std::deque<uint8_t> rx_line;
+static double rx_next;
+static std::deque<uint8_t> rx_fifo;
+static void (*uart_isr)(void *, void *);
+
+// sockets
+static std::vector<WiFiServer *> sim_servers;
+static std::vector<std::shared_ptr<sim_socket>> broker;
+static std::vector<tcp_pcb *> connecting;
+
+struct sim_client {
+    std::shared_ptr<sim_socket> s;
+    uint64_t start;
+    size_t need;                 // response length once headers are in
+    int status;
+    uint64_t done;               // response complete, close is on its way
+    size_t sent;                 // request length
+};
+
+static std::vector<sim_client> clients;
+static uint64_t next_arrival;
+static bool wifi_up = true;
+static std::mt19937_64 rng;
+
+// MCU model
+enum { MCU_IDLE, MCU_REPLY, MCU_PROMPT, MCU_SEND, MCU_SYNC };
+
+struct mcu_cmd {
+    std::string line;
+    std::string data;            // written after "> "
+};
+
+struct mcu_frame {
+    uint8_t type;                // BIN_DATA or BIN_CLOSE
+    int link;
+    std::string data;
+};
+
+static struct {
+    std::string in;              // ESP output not parsed yet
+    std::string echo;            // command bytes not echoed yet
+    std::deque<mcu_cmd> queue;
+    mcu_cmd cmd;
+    int state;
+    uint64_t since;
+    bool ready;
+    bool open[32];
+    std::string req[32];
+    std::multimap<uint64_t, int> due;
+    uint64_t next_publish;
+    uint32_t published;
+    // binary mode
+    bool bin;                    // AT+CIPBINARY=1 was answered
+    std::string frame;           // COBS bytes of incoming frame
+    std::deque<mcu_frame> bin_queue;   // not sent yet
+    std::deque<mcu_frame> bin_window;  // sent, not acked
+    uint8_t bin_tx_seq;          // oldest frame in window
+    uint8_t bin_rx_seq;          // next ESP frame expected
+    bool bin_ack;                // ESP frame is not acked yet
+    uint64_t bin_progress;       // last ack progress
+} mcu;
+
+
+uint32_t millis()
+{
+    return (sim_base + sim_now) / 1000;
+}
+
+
+uint32_t micros()
+{
+    return sim_base + sim_now;
+}
+
+
+uint64_t micros64()
+{
+    return sim_base + sim_now;
+}
+
+
+void delay(unsigned long ms)
+{
+    sim_now += ms * 1000ULL;
+}
+
+
+void yield()
+{
+}
+
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+}
+
+
+void sim_activity()
+{
+    sim_busy = true;
+}
+
+
+bool sim_wifi_up()
+{
+    return wifi_up;
+}
+
+
+bool system_rtc_mem_write(uint8_t block, const void *src, uint16_t len)
+{
+    return true;
+}
+
+
+bool system_rtc_mem_read(uint8_t block, void *dst, uint16_t len)
+{
+    return false;
+}
+
+
+// TLS handshake blocks loop() for tls_ms, a client which closed
+// meanwhile fails it
+bool sim_tls_handshake(const std::shared_ptr<sim_socket> &s)
+{
+    sim_now += opt.tls_ms * 1000ULL;
+    sim_activity();
+    return s->open;
+}
+
+
+// WebSocket accept key, from OpenSSL
+void sha1(const uint8_t *data, uint32_t size, uint8_t hash[20])
+{
+    SHA1(data, size, hash);
+}
+
+
+String base64::encode(const uint8_t *data, size_t length, bool doNewLines)
+{
+    std::string out(4 * ((length + 2) / 3), '\0');
+
+    EVP_EncodeBlock((unsigned char *)&out[0], data, length);
+    return String(out);
+}
+
+
+size_t Print::printf(const char *fmt, ...)
+{
+    char buf[1024];
+    va_list ap;
+    int n;
+
+    va_start(ap, fmt);
+    n = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+
+    if (n < 0)
+        return 0;
+
+    return write((const uint8_t *)buf, std::min<size_t>(n, sizeof(buf) - 1));
+}
+
+
+// time on the wire for one byte, us
+static double uart_byte()
+{
+    return 10e6 / Serial.baudRate();
+}
+
+
+// queue bytes on the tx line, blocks while the fifo is full
+size_t HardwareSerial::write(const uint8_t *buf, size_t len)
+{
+    double start = std::max(tx_free, (double)sim_now);
+    double wait;
+
+    tx_free = start + len * uart_byte();
+    tx_line.emplace_back(tx_free, std::string((const char *)buf, len));
+
+    wait = tx_free - SIM_FIFO * uart_byte();
+    if (wait > sim_now)
+        sim_now = ceil(wait);
+
+    window.uart_tx += len;
+    sim_activity();
+    return len;
+}
+
+
+int HardwareSerial::availableForWrite()
+{
+    double pending = (tx_free - sim_now) / uart_byte();
+
+    return pending <= 0 ? SIM_FIFO : std::max(0, SIM_FIFO - (int)ceil(pending));
+}
+
+
+void HardwareSerial::flush()
+{
+    if (tx_free > sim_now)
+        sim_now = ceil(tx_free);
+}
+
+
+uint32_t sim_uart_status()
+{
+    return rx_fifo.size() << USRXC;
+}
+
+
+uint32_t sim_uart_fifo()
+{
+    uint8_t c = rx_fifo.front();
+
+    rx_fifo.pop_front();
+    sim_activity();
+    return c;
+}
+
+
+void sim_uart_attach(void (*isr)(void *, void *), void *arg)
+{
+    uart_isr = isr;
+}
+
+
+// move MCU output into the rx fifo and raise the rx interrupt
+static void uart_step()
+{
+    double byte = uart_byte();
+
+    while (!rx_line.empty() && rx_next <= sim_now) {
+        if (rx_fifo.size() == SIM_FIFO) {
+            // RTS holds the MCU, otherwise the byte is lost
+            if (USC1(0) & (1 << UCRXHFE)) {
+                rx_next = sim_now + byte;
+                break;
+            }
+            window.fifo_overflows++;
+            rx_fifo.pop_front();
+        }
+
+        rx_fifo.push_back(rx_line.front());
+        rx_line.pop_front();
+        rx_next += byte;
+        window.uart_rx++;
+    }
+
+    if (!rx_fifo.empty() && uart_isr != nullptr && (USIE(0) & ((1 << UIFF) | (1 << UITO))))
+        uart_isr(nullptr, nullptr);
+}
+
+
+WiFiServer::WiFiServer(uint16_t port) : port(port)
+{
+    sim_servers.push_back(this);
+}
+
+
+WiFiServer::~WiFiServer()
+{
+    sim_servers.erase(std::find(sim_servers.begin(), sim_servers.end(), this));
+}
+
+
+WiFiClient WiFiServer::available()
+{
+    std::shared_ptr<sim_socket> s;
+
+    if (backlog.empty())
+        return WiFiClient();
+
+    s = backlog.front();
+    backlog.pop_front();
+    sim_activity();
+    return WiFiClient(s);
+}
+
+
+// names resolve while Wi-Fi is up, a lookup during an outage is
+// never answered
+err_t dns_gethostbyname(const char *name, ip_addr_t *addr, dns_found_callback found, void *arg)
+{
+    if (!wifi_up)
+        return ERR_INPROGRESS;
+
+    addr->addr = 0x0400000A;
+    return ERR_OK;
+}
+
+
+struct tcp_pcb *tcp_new()
+{
+    return new tcp_pcb();
+}
+
+
+void tcp_arg(struct tcp_pcb *pcb, void *arg)
+{
+    pcb->arg = arg;
+}
+
+
+void tcp_err(struct tcp_pcb *pcb, tcp_err_fn err)
+{
+    pcb->err = err;
+}
+
+
+// only the MQTT broker is reachable, lwip_step() completes the
+// connect after SIM_CONNECT_RTT, during an outage it never does
+err_t tcp_connect(struct tcp_pcb *pcb, const ip_addr_t *addr, uint16_t port, tcp_connected_fn connected)
+{
+    window.mqtt_connects++;
+
+    pcb->connected = connected;
+    pcb->due = wifi_up ? sim_now + SIM_CONNECT_RTT : 0;
+    pcb->s = std::make_shared<sim_socket>();
+    pcb->s->port = port;
+    connecting.push_back(pcb);
+    return ERR_OK;
+}
+
+
+void tcp_abort(struct tcp_pcb *pcb)
+{
+    connecting.erase(std::remove(connecting.begin(), connecting.end(), pcb), connecting.end());
+
+    if (pcb->err != nullptr)
+        pcb->err(pcb->arg, ERR_ABRT);
+    delete pcb;
+}
+
+
+WiFiClient::WiFiClient(ClientContext *ctx) : s(ctx->s)
+{
+    delete ctx;
+    sim_activity();
+}
+
+
+int WiFiClient::read(uint8_t *buf, size_t len)
+{
+    size_t n = std::min(len, (size_t)available());
+
+    if (n == 0)
+        return 0;
+
+    memcpy(buf, s->rx.data(), n);
+    s->rx.erase(0, n);
+    sim_activity();
+    return n;
+}
+
+
+size_t WiFiClient::write(const uint8_t *buf, size_t len)
+{
+    if (!connected())
+        return 0;
+
+    s->tx.append((const char *)buf, len);
+    sim_activity();
+    return len;
+}
+
+
+// MCU writes to the rx line
+static void mcu_write(const std::string &data)
+{
+    if (rx_line.empty())
+        rx_next = std::max(rx_next, (double)sim_now);
+
+    rx_line.insert(rx_line.end(), data.begin(), data.end());
+}
+
+
+// queue AT command, data is sent after the prompt
+static void mcu_queue(const std::string &line, const std::string &data = "")
+{
+    mcu.queue.push_back({ line, data });
+}
+
+
+// HTTP request on link is complete after MCU processing time
+static void mcu_request(int link, const std::string &data)
+{
+    std::uniform_real_distribution<double> jitter(0.5, 1.5);
+
+    mcu.req[link] += data;
+    if (mcu.req[link].find("\r\n\r\n") == std::string::npos)
+        return;
+
+    mcu.req[link].clear();
+    mcu.due.emplace(sim_now + (uint64_t)(opt.mcu_ms * 1000 * jitter(rng)), link);
+}
+
+
+// link addressed by queued command, -1 for others
+static int mcu_link(const mcu_cmd &cmd)
+{
+    int link;
+
+    if (sscanf(cmd.line.c_str(), "AT+CIPSEND=%d,", &link) == 1 ||
+        sscanf(cmd.line.c_str(), "AT+CIPCLOSE=%d", &link) == 1)
+        return link;
+
+    return -1;
+}
+
+
+// command finished, start the next one
+static void mcu_done()
+{
+    mcu.state = MCU_IDLE;
+    mcu.echo.clear();
+}
+
+
+// complete line from ESP
+static void mcu_line(const std::string &line)
+{
+    int link;
+    char event[16];
+
+    if (line == "ready") {
+        mcu.ready = true;
+        mcu.queue.clear();
+        mcu_done();
+        mcu_queue("AT+CIPMUX=1");
+        mcu_queue("AT+CIPSERVER=1,80,\"HTTP\"");
+        if (opt.binary)
+            mcu_queue("AT+CIPBINARY=1");
+        if (opt.publish > 0) {
+            mcu_queue("AT+MQTTUSERCFG=0,1,\"sim\",\"\",\"\",0,0,\"\"");
+            mcu_queue("AT+MQTTCONN=0,\"broker\",1883,1");
+        }
+        return;
+    }
+
+    if (sscanf(line.c_str(), "%d,%15s", &link, event) == 2 && link >= 0 && link < 32) {
+        if (!strcmp(event, "CONNECT")) {
+            mcu.open[link] = true;
+            mcu.req[link].clear();
+        } else if (!strcmp(event, "CLOSED")) {
+            // link id is reused by the next client, drop commands for it
+            mcu.open[link] = false;
+            mcu.queue.erase(std::remove_if(mcu.queue.begin(), mcu.queue.end(),
+                [link](const mcu_cmd &cmd) { return mcu_link(cmd) == link; }), mcu.queue.end());
+
+            // ESP reads the rest of the payload as AT command, stop
+            // sending it and wait for the echo of a plain AT
+            if (mcu.state == MCU_SEND && mcu_link(mcu.cmd) == link) {
+                window.mcu_aborts++;
+                rx_line.clear();
+                mcu_write("\r\nAT\r\n");
+                mcu.state = MCU_SYNC;
+            }
+        }
+        return;
+    }
+
+    if (mcu.state == MCU_IDLE)
+        return;
+
+    if (mcu.state == MCU_SYNC) {
+        if (line == "AT")
+            mcu.state = MCU_REPLY;
+        return;
+    }
+
+    if (line == "OK" || line == "ERROR" || line == "SEND OK" || line == "SEND FAIL") {
+        if (line == "OK" && mcu.cmd.line == "AT+CIPBINARY=1")
+            mcu.bin = true;
+        mcu_done();
+        return;
+    }
+
+    // AT+CIPSEND rejected without OK or ERROR
+    if (mcu.state == MCU_PROMPT && (line == "link is not" || line == "too long")) {
+        mcu_done();
+        return;
+    }
+
+    // command was dropped, send it again
+    if (!line.compare(0, 4, "busy")) {
+        mcu.queue.push_front(mcu.cmd);
+        mcu_done();
+    }
+}
+
+
+// write binary frame with current ack, COBS encoded like bin_write()
+static void mcu_bin_write(uint8_t type, uint8_t seq, int link, const std::string &data)
+{
+    std::string f, out;
+    uint16_t crc;
+    size_t p = 0;
+
+    f += (char)type;
+    f += (char)seq;
+    f += (char)mcu.bin_rx_seq;
+    f += (char)link;
+    for (size_t v = data.size(); ; v >>= 7) {
+        f += (char)((v > 0x7F ? 0x80 : 0) | (v & 0x7F));
+        if (v <= 0x7F)
+            break;
+    }
+    f += data;
+    crc = bin_crc((const uint8_t *)f.data(), f.size());
+    f += (char)crc;
+    f += (char)(crc >> 8);
+
+    for (;;) {
+        size_t run = 0;
+
+        while (p + run < f.size() && f[p + run] != 0 && run < 254)
+            run++;
+
+        out += (char)(run + 1);
+        out.append(f, p, run);
+        p += run;
+
+        if (p == f.size())
+            break;
+        if (run < 254)
+            p++;
+    }
+
+    out += '\0';
+    mcu_write(out);
+    mcu.bin_ack = false;
+}
+
+
+// decoded ESP frame
+static void mcu_bin_frame(const std::string &f)
+{
+    const uint8_t *p = (const uint8_t *)f.data();
+    size_t n = 4, len = 0;
+    uint8_t acked;
+    int shift = 0;
+    int link;
+
+    if (f.size() < 7 || bin_crc(p, f.size() - 2) != (p[f.size() - 2] | p[f.size() - 1] << 8))
+        return;
+
+    do {
+        len |= (size_t)(p[n] & 0x7F) << shift;
+        shift += 7;
+    } while (p[n++] & 0x80);
+
+    // ack releases window
+    acked = p[2] - mcu.bin_tx_seq;
+    if (acked > 0 && acked <= mcu.bin_window.size()) {
+        mcu.bin_window.erase(mcu.bin_window.begin(), mcu.bin_window.begin() + acked);
+        mcu.bin_tx_seq = p[2];
+        mcu.bin_progress = sim_now;
+    }
+
+    if (p[0] == BIN_ACK)
+        return;
+
+    mcu.bin_ack = true;
+    if (p[1] != mcu.bin_rx_seq)
+        return;
+    mcu.bin_rx_seq++;
+
+    link = p[3];
+    if (link >= 32)
+        return;
+
+    if (p[0] == BIN_CONNECT) {
+        mcu.open[link] = true;
+        mcu.req[link].clear();
+    } else if (p[0] == BIN_DATA) {
+        mcu_request(link, f.substr(n, len));
+    } else if (p[0] == BIN_CLOSE) {
+        // link id is reused by the next client, drop frames for it
+        mcu.open[link] = false;
+        mcu.bin_queue.erase(std::remove_if(mcu.bin_queue.begin(), mcu.bin_queue.end(),
+            [link](const mcu_frame &f) { return f.link == link; }), mcu.bin_queue.end());
+    }
+}
+
+
+// COBS decode ESP output in binary mode
+static void mcu_bin_input(const std::string &data)
+{
+    for (char c : data) {
+        if (c != '\0') {
+            mcu.frame += c;
+            continue;
+        }
+
+        std::string f;
+        size_t p = 0;
+
+        while (p < mcu.frame.size()) {
+            uint8_t code = mcu.frame[p++];
+
+            f.append(mcu.frame, p, code - 1);
+            p += code - 1;
+            if (code != 0xFF && p < mcu.frame.size())
+                f += '\0';
+        }
+
+        mcu.frame.clear();
+        mcu_bin_frame(f);
+    }
+}
+
+
+// send queued frames while window has room, ack otherwise
+static void mcu_bin_send()
+{
+    // no ack progress, go back to oldest frame
+    if (!mcu.bin_window.empty() && sim_now - mcu.bin_progress >= SIM_BIN_RETRY) {
+        for (size_t n = 0; n < mcu.bin_window.size(); n++) {
+            mcu_frame &f = mcu.bin_window[n];
+            mcu_bin_write(f.type, mcu.bin_tx_seq + n, f.link, f.data);
+        }
+        window.bin_resends++;
+        mcu.bin_progress = sim_now;
+    }
+
+    while (!mcu.bin_queue.empty() && mcu.bin_window.size() < BIN_WINDOW) {
+        mcu_frame &f = mcu.bin_queue.front();
+
+        if (mcu.bin_window.empty())
+            mcu.bin_progress = sim_now;
+
+        mcu_bin_write(f.type, mcu.bin_tx_seq + mcu.bin_window.size(), f.link, f.data);
+        mcu.bin_window.push_back(f);
+        mcu.bin_queue.pop_front();
+    }
+
+    if (mcu.bin_ack)
+        mcu_bin_write(BIN_ACK, 0, 0, "");
+}
+
+
+// ESP output in scenario mode, the scenario plays the MCU
+static std::string esp_out;
+
+
+// parse ESP output, chunk is one Serial.write() call
+static void mcu_input(const std::string &chunk)
+{
+    std::string &in = mcu.in;
+
+    if (opt.test) {
+        esp_out += chunk;
+        return;
+    }
+
+    if (mcu.bin) {
+        mcu_bin_input(chunk);
+        return;
+    }
+
+    // command echo arrives in its own writes
+    if (in.empty() && !mcu.echo.empty() && !mcu.echo.compare(0, chunk.size(), chunk)) {
+        mcu.echo.erase(0, chunk.size());
+        return;
+    }
+
+    in += chunk;
+
+    for (;;) {
+        size_t eol;
+
+        if (!in.compare(0, 5, "+IPD,")) {
+            size_t colon = in.find(':');
+            int link, len;
+
+            if (colon == std::string::npos)
+                break;
+
+            sscanf(in.c_str() + 5, "%d,%d", &link, &len);
+
+            // data is followed by \r\nOK\r\n
+            if (in.size() < colon + 1 + len + 6)
+                break;
+
+            if (link >= 0 && link < 32)
+                mcu_request(link, in.substr(colon + 1, len));
+            in.erase(0, colon + 1 + len + 6);
+            continue;
+        }
+
+        if (mcu.state == MCU_PROMPT && !in.compare(0, 2, "> ")) {
+            in.erase(0, 2);
+            mcu_write(mcu.cmd.data);
+            mcu.state = MCU_SEND;
+            continue;
+        }
+
+        eol = in.find("\r\n");
+        if (eol == std::string::npos)
+            break;
+
+        std::string line = in.substr(0, eol);
+        in.erase(0, eol + 2);
+        mcu_line(line);
+
+        // frames follow OK of AT+CIPBINARY=1
+        if (mcu.bin) {
+            mcu_bin_input(in);
+            in.clear();
+            break;
+        }
+    }
+}
+
+
+// build HTTP response
+static std::string mcu_response()
+{
+    std::string r = "HTTP/1.1 200 OK\r\nContent-Type: text/plain\r\nContent-Length: ";
+
+    r += std::to_string(opt.body);
+    r += "\r\nConnection: close\r\n\r\n";
+    r.append(opt.body, 'x');
+    return r;
+}
+
+
+// MCU main loop
+static void mcu_step()
+{
+    while (!tx_line.empty() && tx_line.front().first <= sim_now) {
+        mcu_input(tx_line.front().second);
+        tx_line.pop_front();
+    }
+
+    if (!mcu.ready)
+        return;
+
+    while (!mcu.due.empty() && mcu.due.begin()->first <= sim_now) {
+        int link = mcu.due.begin()->second;
+
+        mcu.due.erase(mcu.due.begin());
+        if (!mcu.open[link])
+            continue;
+
+        std::string r = mcu_response();
+
+        if (!mcu.bin) {
+            mcu_queue("AT+CIPSEND=" + std::to_string(link) + "," + std::to_string(r.size()), r);
+            mcu_queue("AT+CIPCLOSE=" + std::to_string(link));
+            continue;
+        }
+
+        // host DATA frame is decoded into send_buffer
+        for (size_t off = 0; off < r.size(); off += sizeof(send_buffer) - 16)
+            mcu.bin_queue.push_back({ BIN_DATA, link, r.substr(off, sizeof(send_buffer) - 16) });
+        mcu.bin_queue.push_back({ BIN_CLOSE, link, "" });
+    }
+
+    if (mcu.bin) {
+        mcu_bin_send();
+        return;
+    }
+
+    if (opt.publish > 0 && sim_now >= mcu.next_publish) {
+        mcu_queue("AT+MQTTPUB=0,\"sim/seq\",\"" + std::to_string(++mcu.published) + "\",1,0");
+        mcu.next_publish = sim_now + opt.publish * 1e6;
+    }
+
+    if (mcu.state != MCU_IDLE && sim_now - mcu.since > SIM_MCU_TIMEOUT * 1000000ULL) {
+        window.mcu_timeouts++;
+        mcu_done();
+    }
+
+    if (mcu.state == MCU_IDLE && !mcu.queue.empty()) {
+        mcu.cmd = mcu.queue.front();
+        mcu.queue.pop_front();
+        mcu.echo = mcu.cmd.line + "\r\n";
+        mcu.state = mcu.cmd.data.empty() ? MCU_REPLY : MCU_PROMPT;
+        mcu.since = sim_now;
+        mcu_write(mcu.echo);
+    }
+}
+
+
+// complete broker connects which are due
+static void lwip_step()
+{
+    for (size_t i = 0; i < connecting.size(); ) {
+        tcp_pcb *pcb = connecting[i];
+
+        if (pcb->due == 0 || pcb->due > sim_now || !wifi_up) {
+            i++;
+            continue;
+        }
+
+        connecting.erase(connecting.begin() + i);
+        window.mqtt_wait += SIM_CONNECT_RTT;
+        broker.push_back(pcb->s);
+        pcb->connected(pcb->arg, pcb, ERR_OK);
+        delete pcb;
+        sim_activity();
+    }
+}
+
+
+// answer MQTT packets written by the ESP
+static void broker_step()
+{
+    for (size_t i = 0; i < broker.size(); ) {
+        std::shared_ptr<sim_socket> s = broker[i];
+        std::string &p = s->tx;
+
+        if (s->stopped || !s->open) {
+            broker.erase(broker.begin() + i);
+            continue;
+        }
+
+        while (p.size() >= 2) {
+            size_t len = 0, pos = 1;
+            int shift = 0;
+            uint8_t type = (uint8_t)p[0] >> 4;
+
+            do {
+                len |= (size_t)((uint8_t)p[pos] & 0x7F) << shift;
+                shift += 7;
+            } while (((uint8_t)p[pos++] & 0x80) && pos < p.size());
+
+            if (p.size() < pos + len)
+                break;
+
+            if (type == 1) {
+                s->rx += std::string("\x20\x02\x00\x00", 4);
+            } else if (type == 3) {
+                size_t topic = ((uint8_t)p[pos] << 8) | (uint8_t)p[pos + 1];
+
+                total.mqtt_published++;
+                window.mqtt_published++;
+                if (((uint8_t)p[0] >> 1) & 3)
+                    s->rx += std::string("\x40\x02", 2) + p.substr(pos + 2 + topic, 2);
+            } else if (type == 8) {
+                s->rx += std::string("\x90\x03", 2) + p.substr(pos, 2) + std::string(1, '\0');
+            } else if (type == 12) {
+                s->rx += std::string("\xD0\x00", 2);
+            } else if (type == 14) {
+                s->open = false;
+            }
+
+            p.erase(0, pos + len);
+        }
+
+        i++;
+    }
+}
+
+
+// start new HTTP clients and collect responses
+static void clients_step()
+{
+    std::exponential_distribution<double> gap(opt.rate);
+    std::uniform_int_distribution<int> path(0, SIM_PATHS - 1);
+
+    while (opt.rate > 0 && next_arrival <= sim_now) {
+        WiFiServer *server = nullptr;
+
+        next_arrival += (uint64_t)(gap(rng) * 1e6) + 1;
+
+        for (WiFiServer *s : sim_servers)
+            if (s->port == 80 && s->listening)
+                server = s;
+
+        if (!wifi_up || server == nullptr || server->backlog.size() >= 5) {
+            window.refused++;
+            continue;
+        }
+
+        auto s = std::make_shared<sim_socket>();
+        s->port = 80;
+        s->rx = "GET /item/" + std::to_string(path(rng)) +
+            " HTTP/1.1\r\nHost: esp\r\nConnection: close\r\n\r\n";
+        server->backlog.push_back(s);
+        clients.push_back({ s, sim_now, 0, 0, 0, s->rx.size() });
+    }
+
+    for (size_t i = 0; i < clients.size(); ) {
+        sim_client &c = clients[i];
+        std::string &r = c.s->tx;
+        bool closed = c.s->stopped || !c.s->open;
+
+        if (c.need == 0) {
+            size_t end = r.find("\r\n\r\n");
+            const char *cl;
+
+            if (end != std::string::npos) {
+                cl = strstr(r.c_str(), "Content-Length: ");
+                sscanf(r.c_str(), "HTTP/1.%*d %d", &c.status);
+                c.need = end + 4 + (cl != nullptr ? atoi(cl + 16) : 0);
+            }
+        }
+
+        if (c.done == 0 && c.need > 0 && r.size() >= c.need) {
+            if (c.status == 200)
+                window.ok++;
+            else
+                window.status++;
+            window.bytes += c.need;
+            window.latency.push_back(sim_now - c.start);
+            c.done = sim_now;
+        }
+
+        // client closes after the response, unless the ESP was first
+        if (c.done > 0) {
+            closed = closed || sim_now - c.done >= SIM_NET_DELAY;
+        } else if (c.s->stopped && c.s->rx.size() == c.sent) {
+            // ESP closed without reading the request, all links busy
+            window.refused++;
+            closed = true;
+        } else if (closed || sim_now - c.start > SIM_CLIENT_TIMEOUT * 1000000ULL) {
+            window.failed++;
+            closed = true;
+        }
+
+        if (!closed) {
+            i++;
+            continue;
+        }
+
+        c.s->open = false;
+        clients.erase(clients.begin() + i);
+    }
+}
+
+
+// Wi-Fi drops every outage_every hours for outage_len seconds
+static void wifi_step()
+{
+    bool up = true;
+
+    if (opt.outage_every > 0) {
+        uint64_t every = opt.outage_every * 3600e6;
+        uint64_t t = sim_now % every;
+
+        up = t < every / 2 || t >= every / 2 + (uint64_t)(opt.outage_len * 1e6);
+    }
+
+    if (wifi_up && !up) {
+        for (sim_client &c : clients)
+            c.s->open = false;
+        for (auto &s : broker)
+            s->open = false;
+        for (WiFiServer *s : sim_servers)
+            for (auto &b : s->backlog)
+                b->open = false;
+    }
+
+    wifi_up = up;
+}
+
+
+// next time something happens outside loop()
+static uint64_t next_event()
+{
+    uint64_t t = sim_now + (clients.empty() && mcu.state == MCU_IDLE ? SIM_IDLE_STEP : SIM_BUSY_STEP);
+
+    if (opt.rate > 0)
+        t = std::min(t, next_arrival);
+    if (!tx_line.empty())
+        t = std::min(t, (uint64_t)ceil(tx_line.front().first));
+    if (!rx_line.empty())
+        t = std::min(t, (uint64_t)ceil(rx_next));
+    if (!mcu.due.empty())
+        t = std::min(t, mcu.due.begin()->first);
+    for (tcp_pcb *pcb : connecting)
+        if (pcb->due > 0)
+            t = std::min(t, pcb->due);
+    if (mcu.ready && mcu.state == MCU_IDLE && !mcu.queue.empty())
+        t = sim_now;
+    if (mcu.ready && opt.publish > 0)
+        t = std::min(t, mcu.next_publish);
+    if (mcu.bin && (mcu.bin_ack || (!mcu.bin_queue.empty() && mcu.bin_window.size() < BIN_WINDOW)))
+        t = sim_now;
+    if (mcu.bin && !mcu.bin_window.empty())
+        t = std::min(t, mcu.bin_progress + SIM_BIN_RETRY);
+
+    return std::max(t, sim_now + 1);
+}
+
+
+// run the models and one loop() pass
+static void sim_pass()
+{
+    wifi_step();
+    clients_step();
+    lwip_step();
+    broker_step();
+    mcu_step();
+    uart_step();
+
+    // host CPU time compares link profiles, the virtual clock
+    // only moves where the firmware waits
+    sim_busy = false;
+    auto cpu = std::chrono::steady_clock::now();
+    loop();
+    window.loop_cpu += std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - cpu).count();
+    window.loop_passes++;
+}
+
+
+// move the clock past a pass which started at before
+static void sim_advance(uint64_t before)
+{
+    if (sim_busy)
+        sim_now = std::max(sim_now, before + opt.loop_us);
+    else
+        sim_now = std::max(sim_now, next_event());
+}
+
+
+// latency percentile in ms
+static double percentile(std::vector<uint32_t> &v, double p)
+{
+    if (v.empty())
+        return 0;
+
+    return v[std::min(v.size() - 1, (size_t)(p * v.size()))] / 1000.0;
+}
+
+
+// print one report line and add window to total
+static void report(double hours)
+{
+    static double last;
+    std::vector<uint32_t> &l = window.latency;
+    double seconds = (hours - last) * 3600;
+
+    last = hours;
+    std::sort(l.begin(), l.end());
+
+    printf("%7.1f %8u %6u %6u %7u %7.2f %7.2f %7.1f %7.1f %7.1f %8.1f %7u %6u %7.1f %6u\n",
+        hours, window.ok, window.status, window.failed, window.refused,
+        (window.ok + window.status) / seconds, window.bytes / seconds / 1024,
+        percentile(l, 0.5), percentile(l, 0.95), percentile(l, 0.99),
+        l.empty() ? 0 : l.back() / 1000.0,
+        loop_max, window.mqtt_connects, window.mqtt_wait / 1e6, window.mqtt_published);
+
+    total.ok += window.ok;
+    total.status += window.status;
+    total.failed += window.failed;
+    total.refused += window.refused;
+    total.bytes += window.bytes;
+    total.latency.insert(total.latency.end(), l.begin(), l.end());
+    total.uart_tx += window.uart_tx;
+    total.uart_rx += window.uart_rx;
+    total.mqtt_connects += window.mqtt_connects;
+    total.mqtt_wait += window.mqtt_wait;
+    total.mcu_timeouts += window.mcu_timeouts;
+    total.mcu_aborts += window.mcu_aborts;
+    total.bin_resends += window.bin_resends;
+    total.fifo_overflows += window.fifo_overflows;
+    total.loop_max = std::max(total.loop_max, loop_max);
+    total.loop_passes += window.loop_passes;
+    total.loop_cpu += window.loop_cpu;
+
+    window = stats();
+    loop_max = 0;
+}
+
+
+// Serial.printf() of the ESP8266 core without its write(), the URC
+// format before put_uint()
+static int __attribute__((noinline)) urc_printf(char *out, const char *fmt, ...)
+{
+    va_list args;
+    int n;
+
+    va_start(args, fmt);
+    n = vsnprintf(out, 64, fmt, args);
+    va_end(args);
+
+    return n;
+}
+
+
+// URC and HTTP framing formats, each as printf and as the put_*()
+// writers used in main.cpp
+static const char *const urc_names[] = {
+    "<link>,CONNECT", "+IPD,<link>,<len>:", "<len hex> chunk", "Content-Length:",
+    "Age:", "+IPD,<link>,<len>: mirror", "+MQTTSUBRECV len",
+};
+#define URC_FORMATS (int)(sizeof(urc_names) / sizeof(urc_names[0]))
+
+
+// format row r with values i and len into line, put selects the
+// put_*() writers, returns the length
+static int urc_format(int r, bool put, char *line, int i, int len)
+{
+    char *out = line;
+
+    if (!put) {
+        switch (r) {
+        case 0: return urc_printf(line, "%d,CONNECT\r\n", i);
+        case 1: return urc_printf(line, "+IPD,%d,%d:", i, len);
+        case 2: return urc_printf(line, "%x\r\n", len);
+        case 3: return urc_printf(line, "Content-Length: %u\r\n", len);
+        case 4: return urc_printf(line, "Age: %u\r\n", len);
+        case 5: return urc_printf(line, "+%s,%d,%d:", "IPD", i, len);
+        case 6: return urc_printf(line, "\",%d,", len);
+        }
+    }
+
+    switch (r) {
+    case 0:
+        out = put_uint(out, i);
+        *out++ = ',';
+        out = put_str(out, "CONNECT");
+        out = put_str(out, "\r\n");
+        break;
+    case 1:
+        out = put_str(out, "+IPD,");
+        out = put_uint(out, i);
+        *out++ = ',';
+        out = put_uint(out, len);
+        *out++ = ':';
+        break;
+    case 2:
+        out = put_str(put_hex(out, len), "\r\n");
+        break;
+    case 3:
+        out = put_str(out, "Content-Length: ");
+        out = put_str(put_uint(out, len), "\r\n");
+        break;
+    case 4:
+        out = put_str(out, "Age: ");
+        out = put_str(put_uint(out, len), "\r\n");
+        break;
+    case 5: {
+        const char *dir = "IPD";
+
+        *out++ = '+';
+        while (*dir)
+            *out++ = *dir++;
+        *out++ = ',';
+        out = put_uint(out, i);
+        *out++ = ',';
+        out = put_uint(out, len);
+        *out++ = ':';
+        break;
+    }
+    case 6:
+        out = put_str(out, "\",");
+        out = put_uint(out, len);
+        *out++ = ',';
+        break;
+    }
+
+    return out - line;
+}
+
+
+// host ns per URC, printf formatting against the put_*() writers,
+// both end in one Serial.write() of the same bytes which is left out
+//  * outputs are compared first, a mismatch exits with an error
+static void urc_bench()
+{
+    const int n = 10000000;
+    const uint32_t check[] = { 0, 1, 9, 10, 15, 16, 255, 256, 2047, 65535, 0x7FFFFFFF };
+    char line[64], ref[64];
+    volatile uint32_t sink = 0;
+    double ns[URC_FORMATS][2];
+
+    for (int r = 0; r < URC_FORMATS; r++) {
+        for (uint32_t v : check) {
+            int a = urc_format(r, false, ref, v % 32, v);
+            int b = urc_format(r, true, line, v % 32, v);
+
+            if (a != b || memcmp(ref, line, a)) {
+                fprintf(stderr, "FAIL %s: %u formats as \"%.*s\", printf \"%.*s\"\n",
+                    urc_names[r], v, b, line, a, ref);
+                exit(1);
+            }
+        }
+    }
+
+    for (int r = 0; r < URC_FORMATS; r++) {
+        for (int put = 0; put < 2; put++) {
+            auto t = std::chrono::steady_clock::now();
+
+            for (int j = 0; j < n; j++) {
+                sink = sink + urc_format(r, put, line, j % config::links, 1 + j % 2048);
+                sink = sink + line[0];
+            }
+
+            ns[r][put] = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - t).count() / (double)n;
+        }
+    }
+
+    printf("URC formatting, host ns per URC over %d URCs:\n", n);
+    for (int r = 0; r < URC_FORMATS; r++)
+        printf("  %-26s printf %6.1f  put_* %6.1f\n", urc_names[r], ns[r][0], ns[r][1]);
+}
+
+
+#include "scenario.cpp"
+
+
+// one TLS 1.2 handshake between ctx and client over memory BIOs,
+// returns us the server side spent in OpenSSL, 0 on failure
+static double tls_handshake(SSL_CTX *ctx, SSL_CTX *cctx, SSL_SESSION **session, SSL **server, SSL **client)
+{
+    BIO *sb, *cb;
+    double us = 0;
+    bool sdone = false, cdone = false;
+
+    *server = SSL_new(ctx);
+    *client = SSL_new(cctx);
+    BIO_new_bio_pair(&sb, 0, &cb, 0);
+    SSL_set_bio(*server, sb, sb);
+    SSL_set_bio(*client, cb, cb);
+    SSL_set_accept_state(*server);
+    SSL_set_connect_state(*client);
+    if (*session != nullptr)
+        SSL_set_session(*client, *session);
+
+    for (int n = 0; n < 100 && !(sdone && cdone); n++) {
+        if (!cdone)
+            cdone = SSL_do_handshake(*client) == 1;
+        if (!sdone) {
+            auto t = std::chrono::steady_clock::now();
+            sdone = SSL_do_handshake(*server) == 1;
+            us += std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now() - t).count() / 1e3;
+        }
+    }
+
+    if (!(sdone && cdone))
+        return 0;
+
+    if (*session == nullptr)
+        *session = SSL_get1_session(*client);
+    else if (!SSL_session_reused(*server))
+        return 0;
+    return us;
+}
+
+
+// close both ends, a session is kept only after a clean shutdown
+static void tls_close(SSL *server, SSL *client)
+{
+    SSL_shutdown(server);
+    SSL_shutdown(client);
+    SSL_shutdown(server);
+    SSL_free(server);
+    SSL_free(client);
+}
+
+
+// host cost of the TLS server side with OpenSSL: RSA-2048 key,
+// ECDHE-RSA-AES128-GCM-SHA256 as BearSSL on the ESP prefers, full
+// and resumed handshakes and one 1460 byte record each way
+static void tls_bench()
+{
+    const int n = 50, records = 20000;
+    EVP_PKEY *key = EVP_RSA_gen(2048);
+    X509 *cert = X509_new();
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+    SSL_CTX *cctx = SSL_CTX_new(TLS_client_method());
+    SSL_SESSION *session = nullptr;
+    SSL *server, *client;
+    double full = 0, resumed = 0, wr = 0, rd = 0;
+    char rec[1460], buf[1460];
+
+    X509_set_version(cert, 2);
+    ASN1_INTEGER_set(X509_get_serialNumber(cert), 1);
+    X509_gmtime_adj(X509_getm_notBefore(cert), 0);
+    X509_gmtime_adj(X509_getm_notAfter(cert), 86400);
+    X509_set_pubkey(cert, key);
+    X509_NAME_add_entry_by_txt(X509_get_subject_name(cert), "CN", MBSTRING_ASC, (const uint8_t *)"esp", -1, -1, 0);
+    X509_set_issuer_name(cert, X509_get_subject_name(cert));
+    X509_sign(cert, key, EVP_sha256());
+
+    SSL_CTX_use_certificate(ctx, cert);
+    SSL_CTX_use_PrivateKey(ctx, key);
+    for (SSL_CTX *c : { ctx, cctx }) {
+        SSL_CTX_set_min_proto_version(c, TLS1_2_VERSION);
+        SSL_CTX_set_max_proto_version(c, TLS1_2_VERSION);
+        SSL_CTX_set_cipher_list(c, "ECDHE-RSA-AES128-GCM-SHA256");
+    }
+    SSL_CTX_set_session_cache_mode(ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_set_session_cache_mode(cctx, SSL_SESS_CACHE_CLIENT);
+    memset(rec, 'x', sizeof(rec));
+
+    for (int k = 0; k < n; k++) {
+        SSL_SESSION *none = nullptr;
+        double us = tls_handshake(ctx, cctx, &none, &server, &client);
+
+        if (us == 0) {
+            fprintf(stderr, "FAIL: TLS handshake\n");
+            exit(1);
+        }
+        full += us;
+        SSL_SESSION_free(none);
+        tls_close(server, client);
+    }
+
+    tls_handshake(ctx, cctx, &session, &server, &client);
+    tls_close(server, client);
+    for (int k = 0; k < n; k++) {
+        double us = tls_handshake(ctx, cctx, &session, &server, &client);
+
+        if (us == 0) {
+            fprintf(stderr, "FAIL: TLS session not resumed\n");
+            exit(1);
+        }
+        resumed += us;
+        if (k < n - 1)
+            tls_close(server, client);
+    }
+
+    // records on the last connection, server writes and reads
+    for (int k = 0; k < records; k++) {
+        auto t = std::chrono::steady_clock::now();
+        SSL_write(server, rec, sizeof(rec));
+        auto m = std::chrono::steady_clock::now();
+        SSL_read(client, buf, sizeof(buf));
+        SSL_write(client, rec, sizeof(rec));
+        auto r = std::chrono::steady_clock::now();
+        SSL_read(server, buf, sizeof(buf));
+        auto e = std::chrono::steady_clock::now();
+
+        wr += std::chrono::duration_cast<std::chrono::nanoseconds>(m - t).count();
+        rd += std::chrono::duration_cast<std::chrono::nanoseconds>(e - r).count();
+    }
+
+    printf("TLS server side, host OpenSSL %s, not ESP figures:\n", OpenSSL_version(OPENSSL_VERSION_STRING));
+    printf("  full handshake    %8.0f us  (RSA-2048 signature, ECDHE, %d runs)\n", full / n, n);
+    printf("  resumed handshake %8.0f us  (session resumption, %d runs)\n", resumed / n, n);
+    printf("  1460 byte record  %8.2f us write, %.2f us read  (AES-128-GCM)\n",
+        wr / records / 1e3, rd / records / 1e3);
+
+    tls_close(server, client);
+    SSL_SESSION_free(session);
+    SSL_CTX_free(ctx);
+    SSL_CTX_free(cctx);
+    X509_free(cert);
+    EVP_PKEY_free(key);
+}
+
+
+static void usage()
+{
+    fprintf(stderr,
+        "usage: sim [options]\n"
+        "  -d days        simulated time (%g)\n"
+        "  -r rate        HTTP requests per second (%g)\n"
+        "  -b baud        uart baud rate (%u)\n"
+        "  -m ms          mean MCU response time (%u)\n"
+        "  -s bytes       response body (%u)\n"
+        "  -o hours       hours between Wi-Fi outages, 0 = none (%g)\n"
+        "  -l seconds     outage length (%g)\n"
+        "  -p seconds     MQTT publish interval, 0 = no MQTT (%g)\n"
+        "  -i hours       report interval (%g)\n"
+        "  -w minutes     uptime left until millis() wraps (%g)\n"
+        "  -c us          cost of one loop() pass (%u)\n"
+        "  -S seed        random seed (%u)\n"
+        "  -B             MCU uses binary frames (AT+CIPBINARY=1), no MQTT\n"
+        "  -T ms          TLS handshake time charged to loop() (%u)\n"
+        "  -u             time URC formatting and TLS on the host and exit\n"
+        "  -t [name ...]  run scripted scenarios, all or the named ones, and exit\n",
+        opt.days, opt.rate, opt.baud, opt.mcu_ms, opt.body, opt.outage_every,
+        opt.outage_len, opt.publish, opt.report, opt.wrap, opt.loop_us, opt.seed, opt.tls_ms);
+    exit(2);
+}
+
+
+int main(int argc, char **argv)
+{
+    uint64_t end, drain, next_report;
+    uint64_t last_ms = 0;
+    uint32_t last_millis;
+    unsigned wraps = 0;
+    int errors = 0;
+    int c, i, used;
+
+    while ((c = getopt(argc, argv, "d:r:b:m:s:o:l:p:i:w:c:S:BT:uth")) != -1) {
+        switch (c) {
+        case 'd': opt.days = atof(optarg); break;
+        case 'r': opt.rate = atof(optarg); break;
+        case 'b': opt.baud = atoi(optarg); break;
+        case 'm': opt.mcu_ms = atoi(optarg); break;
+        case 's': opt.body = atoi(optarg); break;
+        case 'o': opt.outage_every = atof(optarg); break;
+        case 'l': opt.outage_len = atof(optarg); break;
+        case 'p': opt.publish = atof(optarg); break;
+        case 'i': opt.report = atof(optarg); break;
+        case 'w': opt.wrap = atof(optarg); break;
+        case 'c': opt.loop_us = atoi(optarg); break;
+        case 'S': opt.seed = atoi(optarg); break;
+        case 'B': opt.binary = true; break;
+        case 'T': opt.tls_ms = atoi(optarg); break;
+        case 'u': urc_bench(); tls_bench(); return 0;
+        case 't': opt.test = true; break;
+        default: usage();
+        }
+    }
+
+    if (opt.days <= 0 || opt.report <= 0 || opt.baud == 0)
+        usage();
+
+    if (opt.test)
+        return scenario_main(argc - optind, argv + optind);
+
+    // MQTT is driven with AT commands
+    if (opt.binary)
+        opt.publish = 0;
+
+    rng.seed(opt.seed);
+    sim_base = (1ULL << 32) * 1000 - (uint64_t)(opt.wrap * 60e6);
+    end = opt.days * 86400e6;
+    drain = end + SIM_DRAIN * 1000000ULL;
+    next_report = opt.report * 3600e6;
+
+    setup();
+    if (Serial.baudRate() != opt.baud)
+        Serial.updateBaudRate(opt.baud);
+    last_millis = millis();
+
+    printf("%u baud %s, %g req/s, MCU %u ms, body %u bytes, outage %gs every %gh, "
+        "millis() wraps after %g min\n\n",
+        opt.baud, opt.binary ? "binary" : "AT", opt.rate, opt.mcu_ms, opt.body, opt.outage_len, opt.outage_every, opt.wrap);
+    printf("  hours       ok  other   fail refused   req/s    KB/s     p50     p95"
+        "     p99   max ms loop us  mqtt     wait    pub\n");
+
+    while (sim_now < drain) {
+        uint64_t before = sim_now;
+
+        // traffic stops before the final checks
+        if (sim_now >= end)
+            opt.rate = 0;
+
+        sim_pass();
+
+        // millis64() must follow the clock through every wrap
+        if (millis64() < last_ms || millis64() != (sim_base + sim_now) / 1000 ||
+            (uint32_t)millis64() != millis()) {
+            if (errors++ < 10)
+                printf("FAIL: millis64() %llu at %.3f s\n",
+                    (unsigned long long)millis64(), sim_now / 1e6);
+        }
+        last_ms = millis64();
+        if (millis() < last_millis)
+            wraps++;
+        last_millis = millis();
+
+        sim_advance(before);
+
+        if (sim_now >= next_report && next_report <= end) {
+            report(next_report / 3600e6);
+            next_report += opt.report * 3600e6;
+        }
+    }
+
+    // responses which completed while draining
+    if (window.ok + window.status + window.failed + window.refused > 0)
+        report(drain / 3600e6);
+
+    std::sort(total.latency.begin(), total.latency.end());
+
+    used = 0;
+    for (i = 0; i < config::links; i++)
+        if (client[i] != nullptr)
+            used++;
+
+    printf("\ntotal: %u ok, %u other status, %u failed, %u refused\n",
+        total.ok, total.status, total.failed, total.refused);
+    printf("latency: p50 %.1f ms, p95 %.1f ms, p99 %.1f ms, max %.1f ms\n",
+        percentile(total.latency, 0.5), percentile(total.latency, 0.95),
+        percentile(total.latency, 0.99), total.latency.empty() ? 0 : total.latency.back() / 1000.0);
+    printf("uart: %llu bytes out, %llu bytes in, %u fifo overflows, %u AT+CIPSEND aborted\n",
+        (unsigned long long)total.uart_tx, (unsigned long long)total.uart_rx,
+        total.fifo_overflows, total.mcu_aborts);
+    printf("uart per MCU response: %.0f bytes out, %.0f bytes in\n",
+        (double)total.uart_tx / std::max(total.ok, 1U),
+        (double)total.uart_rx / std::max(total.ok, 1U));
+    if (opt.binary)
+        printf("binary: %u windows resent by MCU, %u by ESP, %u bad frames\n",
+            total.bin_resends, bin_retries, bin_errors);
+    printf("mqtt: %u connects, %.1f s connect wait, %u published by MCU, %u received by broker\n",
+        total.mqtt_connects, total.mqtt_wait / 1e6, mcu.published, total.mqtt_published);
+    printf("loop: %d links, max %u us, %llu passes, %.0f ns host CPU per pass\n",
+        config::links, total.loop_max, (unsigned long long)total.loop_passes,
+        (double)total.loop_cpu / std::max(total.loop_passes, (uint64_t)1));
+    printf("clock: millis() wrapped %u times, final millis64() %llu\n",
+        wraps, (unsigned long long)millis64());
+
+    if (wraps == 0 && opt.days * 1440 > opt.wrap) {
+        printf("FAIL: millis() did not wrap\n");
+        errors++;
+    }
+
+    if (used > 0) {
+        printf("FAIL: %d links still open after %d s without traffic\n", used, SIM_DRAIN);
+        errors++;
+    }
+
+    if (total.mcu_timeouts > 0) {
+        printf("FAIL: %u AT commands without reply\n", total.mcu_timeouts);
+        errors++;
+    }
+
+    return errors > 0;
+}
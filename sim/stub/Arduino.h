@@ -0,0 +1,146 @@
+// Arduino core for the host simulator
+//  * time comes from the virtual clock in sim.cpp
+//  * UART0 registers read the simulated rx fifo
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <string>
+
+#define PROGMEM
+#define PSTR(s) (s)
+#define F(s) (s)
+#define IRAM_ATTR
+#define ICACHE_RAM_ATTR
+#define strcpy_P strcpy
+#define strcat_P strcat
+#define strncmp_P strncmp
+#define memcpy_P memcpy
+#define strlen_P strlen
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+
+#define INPUT 0
+#define OUTPUT 1
+#define FUNCTION_4 4
+
+typedef bool boolean;
+
+uint32_t millis();
+uint32_t micros();
+uint64_t micros64();
+void delay(unsigned long ms);
+void yield();
+void pinMode(uint8_t pin, uint8_t mode);
+
+
+class String {
+public:
+    String() {}
+    String(const char *s) : s(s ? s : "") {}
+    String(const std::string &s) : s(s) {}
+    const char *c_str() const { return s.c_str(); }
+    size_t length() const { return s.size(); }
+    bool operator==(const char *o) const { return s == o; }
+
+private:
+    std::string s;
+};
+
+
+class Print {
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t *buf, size_t len) = 0;
+    size_t write(const char *buf, size_t len) { return write((const uint8_t *)buf, len); }
+    size_t write(const char *s) { return write((const uint8_t *)s, strlen(s)); }
+    size_t print(const char *s) { return write(s); }
+    size_t print(int n) { return printf("%d", n); }
+    size_t print(unsigned n) { return printf("%u", n); }
+    size_t println(const char *s) { return print(s) + print("\r\n"); }
+    size_t printf(const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+};
+
+
+class Stream : public Print {
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    virtual bool hasPeekBufferAPI() const { return false; }
+    virtual size_t peekAvailable() { return 0; }
+    virtual const char *peekBuffer() { return nullptr; }
+    virtual void peekConsume(size_t) {}
+};
+
+
+// tx goes through the simulated line, rx is read from the registers
+class HardwareSerial : public Stream {
+public:
+    void begin(unsigned long baud) { this->baud = baud; }
+    size_t setRxBufferSize(size_t size) { return size; }
+    void updateBaudRate(unsigned long baud) { this->baud = baud; }
+    uint32_t baudRate() { return baud; }
+    int available() override { return 0; }
+    int read() override { return -1; }
+    int peek() override { return -1; }
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t len) override;
+    using Print::write;
+    int availableForWrite() override;
+    void flush() override;
+
+private:
+    unsigned long baud = 0;
+};
+
+extern HardwareSerial Serial;
+
+
+class EspClass {
+public:
+    String getResetReason() { return String("Power On"); }
+    uint32_t getFreeHeap() { return 30000; }
+    uint16_t getMaxFreeBlockSize() { return 20000; }
+    uint32_t getCycleCount() { return micros() * 80; }
+    void restart() { abort(); }
+};
+
+extern EspClass ESP;
+
+
+// UART0 registers
+uint32_t sim_uart_status();
+uint32_t sim_uart_fifo();
+void sim_uart_attach(void (*isr)(void *, void *), void *arg);
+extern uint32_t sim_uart_regs[8];
+
+#define UART0 0
+#define USC0(u) sim_uart_regs[0]
+#define USC1(u) sim_uart_regs[1]
+#define USS(u) sim_uart_status()
+#define USF(u) sim_uart_fifo()
+#define USIS(u) sim_uart_regs[4]
+#define USIC(u) sim_uart_regs[5]
+#define USIE(u) sim_uart_regs[6]
+#define USIR(u) sim_uart_regs[7]
+#define USRXC 0
+#define UCFFT 0
+#define UCRXHFT 16
+#define UCTXHFE 15
+#define UCRXHFE 23
+#define UIFF 0
+#define UIPE 2
+#define UIFR 3
+#define UIOF 4
+#define UITO 8
+
+#define ETS_UART_INTR_ATTACH(f, a) sim_uart_attach(f, a)
+#define ETS_UART_INTR_ENABLE()
+#define ETS_UART_INTR_DISABLE()
@@ -0,0 +1,13 @@
+// EEPROM for the host simulator, reads as erased flash
+#pragma once
+#include "Arduino.h"
+
+class EEPROMClass {
+public:
+    void begin(size_t) {}
+    template <typename T> T &get(int, T &t) { memset(&t, 0xFF, sizeof(t)); return t; }
+    template <typename T> const T &put(int, const T &t) { return t; }
+    bool commit() { return true; }
+};
+
+extern EEPROMClass EEPROM;
@@ -0,0 +1,8 @@
+// firmware update page is not simulated
+#pragma once
+#include "ESP8266WebServer.h"
+
+class ESP8266HTTPUpdateServer {
+public:
+    void setup(ESP8266WebServer *, const char *, const char *, const char *) {}
+};
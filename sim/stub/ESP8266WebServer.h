@@ -0,0 +1,14 @@
+// status pages are not simulated
+#pragma once
+#include "ESP8266WiFi.h"
+
+class ESP8266WebServer {
+public:
+    typedef void (*THandlerFunction)();
+    ESP8266WebServer(int) {}
+    void on(const char *, THandlerFunction) {}
+    void begin() {}
+    void handleClient() {}
+    void send(int, const char *, const char *) {}
+    void send(int, const char *, const char *, size_t) {}
+};
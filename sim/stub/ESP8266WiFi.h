@@ -0,0 +1,119 @@
+// Wi-Fi and TCP for the host simulator
+//  * a socket is a pair of byte queues shared with the traffic model
+//  * all sockets drop and connects time out during a Wi-Fi outage
+#pragma once
+#include "Arduino.h"
+#include <deque>
+#include <memory>
+
+typedef enum {
+    WL_IDLE_STATUS = 0,
+    WL_NO_SSID_AVAIL = 1,
+    WL_CONNECTED = 3,
+    WL_CONNECT_FAILED = 4,
+    WL_WRONG_PASSWORD = 6,
+    WL_DISCONNECTED = 7,
+} wl_status_t;
+
+#define WIFI_STA 1
+
+bool sim_wifi_up();
+void sim_activity();
+
+class ClientContext;
+
+
+class IPAddress {
+public:
+    IPAddress(uint32_t a = 0) : a(a) {}
+    bool fromString(const char *) { return true; }
+    String toString() const { return String("10.0.0.2"); }
+    operator uint32_t() const { return a; }
+
+private:
+    uint32_t a;
+};
+
+
+class WiFiClass {
+public:
+    void mode(int) {}
+    void begin(const char *, const char *) {}
+    void disconnect() {}
+    bool isConnected() { return sim_wifi_up(); }
+    wl_status_t status() { return sim_wifi_up() ? WL_CONNECTED : WL_DISCONNECTED; }
+    int32_t RSSI() { return sim_wifi_up() ? -60 : 31; }
+    IPAddress localIP() { return IPAddress(sim_wifi_up() ? 0x0200000A : 0); }
+};
+
+extern WiFiClass WiFi;
+
+
+// both directions of one TCP connection
+struct sim_socket {
+    std::string rx;        // peer to ESP
+    std::string tx;        // ESP to peer
+    bool open = true;      // peer has not closed, Wi-Fi was up
+    bool stopped = false;  // ESP called stop()
+    uint16_t port = 0;
+};
+
+
+class WiFiClient : public Stream {
+public:
+    WiFiClient() {}
+    WiFiClient(std::shared_ptr<sim_socket> s) : s(s) {}
+    virtual ~WiFiClient() {}
+
+    virtual uint8_t connected() { return s && s->open && !s->stopped; }
+    virtual void stop() { if (s && !s->stopped) { s->stopped = true; sim_activity(); } }
+    operator bool() { return s != nullptr; }
+
+    int available() override { return s && !s->stopped ? s->rx.size() : 0; }
+    int read() override { uint8_t c; return read(&c, 1) == 1 ? c : -1; }
+    int peek() override { return available() ? (uint8_t)s->rx[0] : -1; }
+    virtual size_t peekBytes(uint8_t *buf, size_t len) { len = std::min(len, (size_t)available()); memcpy(buf, s->rx.data(), len); return len; }
+    virtual int read(uint8_t *buf, size_t len);
+    int read(char *buf, size_t len) { return read((uint8_t *)buf, len); }
+    size_t write(uint8_t c) override { return write(&c, 1); }
+    size_t write(const uint8_t *buf, size_t len) override;
+    using Print::write;
+    int availableForWrite() override { return connected() ? 1460 : 0; }
+
+    bool hasPeekBufferAPI() const override { return true; }
+    size_t peekAvailable() override { return available(); }
+    const char *peekBuffer() override { return s ? s->rx.data() : nullptr; }
+    void peekConsume(size_t len) override { s->rx.erase(0, len); sim_activity(); }
+
+    void setNoDelay(bool) {}
+    void setTimeout(unsigned long ms) { timeout = ms; }
+    void keepAlive(uint16_t = 0, uint16_t = 0, uint8_t = 0) {}
+    IPAddress remoteIP() { return IPAddress(0x0300000A); }
+    uint16_t remotePort() { return 40000; }
+    uint16_t localPort() { return s ? s->port : 0; }
+
+protected:
+    WiFiClient(ClientContext *ctx);
+
+    std::shared_ptr<sim_socket> s;
+    unsigned long timeout = 1000;
+};
+
+
+// listening socket, the traffic model queues connections in backlog
+class WiFiServer {
+public:
+    WiFiServer(uint16_t port);
+    virtual ~WiFiServer();
+    void begin() { listening = true; }
+    void stop() { listening = false; backlog.clear(); }
+    bool hasClient() { return !backlog.empty(); }
+    WiFiClient available();
+    WiFiClient accept() { return available(); }
+    void setNoDelay(bool) {}
+    uint8_t status() { return listening; }
+
+    uint16_t port;
+    bool listening = false;
+    std::deque<std::shared_ptr<sim_socket>> backlog;
+};
@@ -0,0 +1,5 @@
+// SHA-1 for the host simulator, done by OpenSSL in sim.cpp
+#pragma once
+#include <stdint.h>
+
+void sha1(const uint8_t *data, uint32_t size, uint8_t hash[20]);
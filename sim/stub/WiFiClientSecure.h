@@ -0,0 +1,34 @@
+// BearSSL client for the host simulator
+//  * records are not encrypted, the socket carries plain bytes
+//  * handshake time is charged on the virtual clock by the server
+#pragma once
+#include "ESP8266WiFi.h"
+
+namespace BearSSL {
+
+class X509List {
+public:
+    X509List(const char *) {}
+};
+
+
+class PrivateKey {
+public:
+    PrivateKey(const char *) {}
+    bool isRSA() const { return true; }
+};
+
+
+class ServerSessions {
+public:
+    ServerSessions(int) {}
+};
+
+
+class WiFiClientSecure : public WiFiClient {
+public:
+    WiFiClientSecure() {}
+    WiFiClientSecure(std::shared_ptr<sim_socket> s) : WiFiClient(s) {}
+};
+
+}
@@ -0,0 +1,31 @@
+// BearSSL server for the host simulator, available() blocks for
+// sim_tls_handshake() of virtual time like the handshake on the ESP
+#pragma once
+#include "WiFiClientSecure.h"
+
+#define BR_KEYTYPE_KEYX 0x10
+#define BR_KEYTYPE_SIGN 0x20
+
+bool sim_tls_handshake(const std::shared_ptr<sim_socket> &s);
+
+namespace BearSSL {
+
+class WiFiServerSecure : public WiFiServer {
+public:
+    WiFiServerSecure(uint16_t port) : WiFiServer(port) {}
+    void setRSACert(const X509List *, const PrivateKey *) {}
+    void setECCert(const X509List *, unsigned, const PrivateKey *) {}
+    void setCache(ServerSessions *) {}
+
+    WiFiClientSecure available()
+    {
+        if (backlog.empty())
+            return WiFiClientSecure();
+
+        std::shared_ptr<sim_socket> s = backlog.front();
+        backlog.pop_front();
+        return sim_tls_handshake(s) ? WiFiClientSecure(s) : WiFiClientSecure();
+    }
+};
+
+}
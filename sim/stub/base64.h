@@ -0,0 +1,8 @@
+// base64 for the host simulator, done by OpenSSL in sim.cpp
+#pragma once
+#include "Arduino.h"
+
+class base64 {
+public:
+    static String encode(const uint8_t *data, size_t length, bool doNewLines);
+};
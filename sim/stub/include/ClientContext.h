@@ -0,0 +1,9 @@
+// connected tcp_pcb handed to a WiFiClient
+#pragma once
+#include "lwip/tcp.h"
+
+class ClientContext {
+public:
+    ClientContext(struct tcp_pcb *pcb, void *discard, void *discard_arg) : s(pcb->s) {}
+    std::shared_ptr<sim_socket> s;
+};
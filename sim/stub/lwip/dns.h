@@ -0,0 +1,18 @@
+// lwIP DNS for the host simulator, names resolve at once while
+// Wi-Fi is up and never while it is down
+#pragma once
+#include <stdint.h>
+
+typedef int8_t err_t;
+#define ERR_OK 0
+#define ERR_INPROGRESS -5
+#define ERR_VAL -6
+#define ERR_ABRT -13
+
+typedef struct {
+    uint32_t addr;
+} ip_addr_t;
+
+typedef void (*dns_found_callback)(const char *name, const ip_addr_t *addr, void *arg);
+
+err_t dns_gethostbyname(const char *name, ip_addr_t *addr, dns_found_callback found, void *arg);
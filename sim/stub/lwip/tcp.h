@@ -0,0 +1,22 @@
+// lwIP raw tcp for the host simulator, only active connects, which
+// reach the MQTT broker after SIM_CONNECT_RTT while Wi-Fi is up
+#pragma once
+#include "ESP8266WiFi.h"
+#include "lwip/dns.h"
+
+typedef err_t (*tcp_connected_fn)(void *arg, struct tcp_pcb *pcb, err_t err);
+typedef void (*tcp_err_fn)(void *arg, err_t err);
+
+struct tcp_pcb {
+    void *arg = nullptr;
+    tcp_err_fn err = nullptr;
+    tcp_connected_fn connected = nullptr;
+    uint64_t due = 0;      // connect completes, 0 - never
+    std::shared_ptr<sim_socket> s;
+};
+
+struct tcp_pcb *tcp_new();
+void tcp_arg(struct tcp_pcb *pcb, void *arg);
+void tcp_err(struct tcp_pcb *pcb, tcp_err_fn err);
+err_t tcp_connect(struct tcp_pcb *pcb, const ip_addr_t *addr, uint16_t port, tcp_connected_fn connected);
+void tcp_abort(struct tcp_pcb *pcb);
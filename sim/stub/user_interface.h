@@ -0,0 +1,6 @@
+// rtc user memory for the host simulator, starts empty as after power on
+#pragma once
+#include <stdint.h>
+
+bool system_rtc_mem_write(uint8_t block, const void *src, uint16_t len);
+bool system_rtc_mem_read(uint8_t block, void *dst, uint16_t len);
@@ -6,16 +6,48 @@
  */
 
 #include <ESP8266WiFi.h>
+#include <WiFiClientSecure.h>
+#include <WiFiServerSecure.h>
 #include <ESP8266WebServer.h>
 #include <ESP8266HTTPUpdateServer.h>
+#include <Hash.h>
+#include <base64.h>
 #include <Arduino.h>
 #include <EEPROM.h>
+#include <lwip/dns.h>
+#include <lwip/tcp.h>
+#include <include/ClientContext.h>
 
 extern "C" {
 #include "user_interface.h"
 }
 
 
+// build profile, link table, buffers and history are sized from it,
+// override with -DCONFIG_LINKS=<n> etc, see envs in platformio.ini
+#ifndef CONFIG_LINKS
+#define CONFIG_LINKS 16
+#endif
+#ifndef CONFIG_BUFFER
+#define CONFIG_BUFFER 2048
+#endif
+#ifndef CONFIG_HISTORY
+#define CONFIG_HISTORY 8
+#endif
+template <int LINKS, size_t BUFFER, int HISTORY>
+struct profile {
+    static constexpr int links = LINKS;       // link ids 0..links-1
+    static constexpr size_t buffer = BUFFER;  // status page, AT command and AT+CIPSEND buffers
+    static constexpr int history = HISTORY;   // AT commands shown on status page
+    static constexpr uint32_t link_mask = LINKS == 32 ? 0xFFFFFFFF : (1U << LINKS) - 1;
+
+    static_assert(LINKS > 0 && LINKS <= 32, "link masks are 32 bit");
+    static_assert(BUFFER >= 512, "AT+CIPSEND needs 512 bytes at least");
+    static_assert(HISTORY > 0, "history is a ring");
+};
+typedef profile<CONFIG_LINKS, CONFIG_BUFFER, CONFIG_HISTORY> config;
+
+
 // WiFi credentials
 #define CREDS_MAGIC 14337
 struct creds {
@@ -24,73 +56,665 @@ struct creds {
     char ssid[33];  // max length of wifi ssid is 32 bytes
 } creds;
 
+// UART settings, stored in eeprom after creds
+#define UART_MAGIC 21331
+#define UART_BAUD 115200
+#define UART_RTS_THRESHOLD 110  // rx fifo level to deassert RTS, fifo is 128 bytes
+#define UART_FLOW_RTS 1
+#define UART_FLOW_CTS 2
+#ifndef UART_RX_BUFFER
+#define UART_RX_BUFFER 1024
+#endif
+struct uart_cfg {
+    uint16_t crc;
+    uint32_t baud;
+    uint8_t flow;        // UART_FLOW_RTS | UART_FLOW_CTS
+    uint16_t rx_buffer;  // serial rx buffer size
+} uart_cfg;
+uint8_t uart_flow = 0;
+unsigned uart_rx_buffer = 0;
+
+// serial rx ring, filled from uart interrupt, drained from loop()
+//  * single producer (isr) and single consumer (task_serial)
+//  * uart_rx_ready is set when a complete line (frame in binary
+//    mode) or uart_rx_want bytes of AT+CIPSEND payload are available
+#define UART_RX_FIFO_THRESHOLD 64  // rx fifo level to raise interrupt
+#define UART_CORE_RX_BUFFER 16     // core serial rx buffer, unused after uart_rx_begin()
+uint8_t *uart_rx_ring = nullptr;
+uint32_t uart_rx_mask = 0;
+volatile uint32_t uart_rx_head = 0;
+volatile uint32_t uart_rx_tail = 0;
+volatile uint32_t uart_rx_want = 0;
+volatile bool uart_rx_ready = false;
+volatile uint8_t uart_rx_delim = '\n';  // 0 in binary mode
+
+// serial rx overrun counters
+volatile uint32_t uart_overruns = 0;   // ring full
+volatile uint32_t uart_rx_errors = 0;  // fifo overflow, framing or parity error
+
 // firmware update password <ip>:8080/firmware
 const char* fwpw = "AHU_8266";
 
+// listening port settings
+#define MAX_SERVERS 4
+#define SERVER_HTTP 1  // HTTP keep-alive multiplexing
+#define SERVER_TLS 2   // TLS termination
+struct server_cfg {
+    uint16_t port;
+    uint8_t quota;     // max links for this port, 0 - unlimited
+    uint8_t reserved;  // links kept free for this port
+    uint8_t flags;     // SERVER_*
+};
+
 // rtc user memory storage
 #define RTC_BASE 32
 struct rtc_storage {
     uint8_t magic[3];  // RUM
     uint8_t checksum;  // sum(data_bytes)
     union {
-        int32_t data;
-        uint8_t data_bytes[4];
+        struct server_cfg data[MAX_SERVERS];
+        uint8_t data_bytes[sizeof(struct server_cfg) * MAX_SERVERS];
     };
 } __attribute__((packed, aligned(4)));
 
 // servers
-int server_port = 0;
-WiFiServer *server = nullptr;
+struct server {
+    WiFiServer *server;
+    struct server_cfg cfg;
+    int links;  // links accepted on this port
+} servers[MAX_SERVERS];
 ESP8266WebServer httpServer(8080);
 ESP8266HTTPUpdateServer httpUpdater;
 
+// TLS termination, certificate and key are built in from
+// src/tls_cert.h (not in git) defining TLS_CERT and TLS_KEY as PEM
+//  * handshake blocks the loop for ~1 s, at 115200 baud that is more
+//    input than the largest rx ring holds, so TLS ports need RTS
+//    flow control to hold the MCU off meanwhile, AT+CIPSERVER refuses
+//    them without it and clients are refused while it is off
+//  * each TLS link holds ~20KB of BearSSL buffers, TLS ports
+//    get TLS_MAX_LINKS quota by default, all ports together hold
+//    at most TLS_MAX_TOTAL and a client is refused before the
+//    handshake when less than TLS_HEAP_MIN heap is free
+//  * reconnecting clients resume sessions from the cache
+//  * TLS_DISABLED leaves TLS out, links32 has no heap left for it
+#if __has_include("tls_cert.h") && !defined(TLS_DISABLED)
+#include "tls_cert.h"
+#define TLS_ENABLED
+#endif
+#ifndef TLS_MAX_LINKS
+#define TLS_MAX_LINKS 2
+#endif
+#ifndef TLS_MAX_TOTAL
+#define TLS_MAX_TOTAL 2
+#endif
+static_assert(TLS_MAX_LINKS <= TLS_MAX_TOTAL, "default TLS port quota over TLS_MAX_TOTAL");
+#ifndef TLS_HEAP_MIN
+#define TLS_HEAP_MIN 24576  // one link's buffers and some margin
+#endif
+#ifndef TLS_SESSIONS
+#define TLS_SESSIONS 4  // ~100 bytes each
+#endif
+#ifdef TLS_ENABLED
+BearSSL::X509List tls_chain(TLS_CERT);
+BearSSL::PrivateKey tls_key(TLS_KEY);
+BearSSL::ServerSessions tls_sessions(TLS_SESSIONS);
+#endif
+uint32_t tls_handshakes = 0;
+uint32_t tls_failed = 0;
+uint32_t tls_refused = 0;        // over TLS_MAX_TOTAL, low heap or no RTS flow control
+uint32_t tls_handshake_avg = 0;  // moving average, us
+uint32_t tls_handshake_min = 0;  // resumed sessions show up here
+uint32_t tls_handshake_max = 0;
+uint32_t tls_bytes = 0;  // record payload read and written
+uint32_t tls_us = 0;     // time spent in TLS read and write
+
 // clients
-#define MAX_CLIENTS 16
-WiFiClient *client[MAX_CLIENTS] = { nullptr };
+WiFiClient *client[config::links] = { nullptr };
+int link_server[config::links];  // index in servers[]
+uint32_t link_used = 0;          // bit per occupied link
+int link_next = 0;               // link_slot() search start
 int connected = 0;
 
+// links closed by ESP are kept out of link_slot() until MCU answers
+// CLOSED with AT+CIPCLOSE or LINK_LINGER expires, a late AT+CIPCLOSE
+// would otherwise close the next client on the same id
+#ifndef LINK_LINGER
+#define LINK_LINGER 1000  // ms
+#endif
+uint32_t link_linger = 0;  // bit per link
+uint32_t link_linger_since[config::links];
+
+// observer mirror: read-only sockets receiving a copy of traffic
+// on subscribed links, observer sends link ids as "0,3,5\n" or "*\n"
+//  * debug builds only: any LAN host can connect and read all link
+//    traffic, there is no authentication
+#ifndef MIRROR_PORT
+#define MIRROR_PORT 0  // disabled, set in debug env only
+#endif
+#define MAX_OBSERVERS 2
+WiFiServer *mirror_server = nullptr;
+struct observer {
+    WiFiClient *client;
+    uint32_t mask;   // subscribed links
+    uint32_t drops;  // frames dropped on full send buffer
+    char line[64];
+    size_t line_len;
+} observers[MAX_OBSERVERS];
+
+// +IPD coalescing: small reads are held back until the window
+// expires or enough bytes are queued in the socket
+#ifndef IPD_COALESCE_US
+#define IPD_COALESCE_US 0
+#endif
+#ifndef IPD_COALESCE_BYTES
+#define IPD_COALESCE_BYTES 0
+#endif
+uint32_t coalesce_us = IPD_COALESCE_US;
+int coalesce_bytes = IPD_COALESCE_BYTES;
+uint32_t ipd_since[config::links];
+bool ipd_wait[config::links] = { false };
+
 // stats buffer
-char buffer[2048];
+char buffer[config::buffer];
+
+// max +IPD frame length, larger reads are split and interleaved
+// with other links in round-robin order
+#ifndef IPD_MAX
+#define IPD_MAX sizeof(buffer)
+#endif
+int ipd_max = IPD_MAX;
+int ipd_next = 0;
 
 // at command buffer
-char input_buffer[2048];
+char input_buffer[config::buffer];
 int input_len = sizeof(input_buffer);
 int input_pos = 0;
 
 // at+cipsend buffer
-char send_buffer[2048];
+char send_buffer[config::buffer];
 int send_len = 0;
 int send_pos = 0;
-int send_to = -1;
+int send_off[config::links];
+uint32_t send_mask = 0;  // target links, bit per link
+bool send_fail = false;
+const char *send_data = send_buffer;  // payload as written to clients
+int send_size = 0;
+
+// HTTP keep-alive links
+//  * socket stays open between requests, every request is presented
+//    to MCU as a new connection on the same link id
+//  * requests are forwarded one at a time, pipelined requests wait
+//    in the socket until MCU closes the link, so responses go back
+//    in request order
+//  * responses without length are sent with chunked encoding
+#define HTTP_KEEPALIVE_TIMEOUT 15000
+#define HTTP_LINE 48
+#define HTTP_PATH 64  // longer paths are not cached
+// http_response() output for len bytes of input: header line carried
+// from previous call, headers added at end of headers, gzip growth
+// with gzip header, chunk framing
+#define HTTP_ADDED (sizeof("Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n") - 1 + \
+    sizeof("Transfer-Encoding: chunked\r\n") - 1 + sizeof("Connection: close\r\n") - 1 + \
+    sizeof("Age: 4294967295\r\n") - 1)
+#define HTTP_RESPONSE_MAX(len) ((len) * 9 / 8 + 16 + (HTTP_LINE - 1) + HTTP_ADDED + \
+    sizeof("ffffffff\r\n\r\n") - 1)
+enum http_state {
+    HTTP_IDLE,     // waiting for next request, link is closed for MCU
+    HTTP_REQUEST,  // request is forwarded to MCU
+    HTTP_WAIT,     // request forwarded, waiting for MCU to close link
+    HTTP_WS,       // WebSocket, link is open until either side closes
+};
+enum http_part {
+    HTTP_LINE_START,  // request or status line
+    HTTP_HEADERS,
+    HTTP_BODY,
+};
+enum http_chunk_part {
+    CHUNK_SIZE,     // hex chunk size
+    CHUNK_EXT,      // chunk extension up to end of line
+    CHUNK_DATA,
+    CHUNK_CRLF,     // end of chunk data
+    CHUNK_TRAILER,  // trailer lines after last chunk
+    CHUNK_END,      // empty line after last chunk
+};
+
+// WebSocket bridge: GET of ws_path with Upgrade: websocket on HTTP
+// port is answered here, link stays open for MCU as one connection
+//  * client frames are unwrapped into +IPD data, ping is answered
+//  * AT+CIPSEND data goes out as one text or binary frame
+#define WS_CTL 125  // control frame payload echoed in pong or close, RFC 6455 max
+char ws_path[64] = "";
+uint32_t ws_hash = 0;   // 0 - disabled
+uint8_t ws_opcode = 1;  // text frames
+uint32_t ws_upgrades = 0;
+
+// gzip compression of MCU responses for clients sending
+// Accept-Encoding: gzip, enabled with AT+CIPGZIP=1
+//  * streaming deflate with fixed Huffman codes and a small LZ77
+//    window, compressor is allocated for the response body only
+//  * already compressed content types are sent as is
+#ifndef HTTP_GZIP
+#define HTTP_GZIP 0  // disabled
+#endif
+#define GZIP_WINDOW 1024  // LZ77 window, power of two
+#define GZIP_HASH 256
+#define GZIP_MAX 2        // responses compressed at once
+struct gzip {
+    uint8_t win[GZIP_WINDOW * 2];  // history and new data
+    uint16_t head[GZIP_HASH];      // last position + 1 of 3 byte hash
+    int pos;                       // bytes in win
+    bool started;                  // gzip header was written
+    uint32_t crc;
+    uint32_t size;
+    uint32_t bits;                 // pending output bits
+    int nbits;
+};
+struct gzip_stat {
+    uint32_t in;   // body bytes from MCU
+    uint32_t out;  // compressed bytes
+    uint32_t us;   // time spent compressing
+} gzip_stats[config::links];
+bool gzip_enabled = HTTP_GZIP;
+int gzip_active = 0;
+struct http {
+    uint8_t state;      // http_state
+    bool keepalive;     // socket can be reused after response
+    bool head;          // HEAD request, response has no body
+    bool get;           // GET request, response can be cached
+    bool announced;     // MCU knows about request, CONNECT was sent
+    bool local;         // request is answered by ESP from cache or with 503
+    bool responded;     // MCU started response
+    bool detached;      // stale copy was served, MCU response goes to cache only
+    bool late;          // pending over breaker_latency, breaker was tripped once
+    uint32_t since;     // idle since, request start otherwise
+    uint32_t path;      // request path hash
+    char url[HTTP_PATH];  // request path, checked on hash match
+    uint8_t url_len;
+    uint32_t age;       // add Age header to response, seconds + 1
+    char *cap;          // captured MCU response for cache
+    int cap_len;
+    struct gzip *gz;    // response body compressor
+    // request parser
+    uint8_t req;        // http_part
+    uint8_t req_word;   // word in request line
+    bool req_chunked;
+    bool req_gzip;      // client accepts gzip
+    bool req_upgrade;   // Upgrade: websocket
+    char ws_key[25];    // Sec-WebSocket-Key
+    uint32_t req_body;  // remaining request body
+    uint8_t req_len;
+    char req_line[HTTP_LINE];
+    // response parser
+    uint8_t resp;       // http_part
+    bool resp_length;   // response has own length or chunked encoding
+    bool resp_chunked;  // response body is wrapped into chunks here
+    bool resp_pass;     // long header line is passed through
+    bool resp_plain;    // response must not be compressed
+    uint32_t resp_clen; // held back Content-Length + 1
+    bool resp_te;       // MCU chunked encoding is passed through
+    uint8_t resp_chunk; // http_chunk_part of passed through body
+    uint32_t resp_left; // body left of Content-Length or current chunk
+    uint16_t status;
+    uint8_t resp_len;
+    char resp_line[HTTP_LINE];
+    // WebSocket frame parser
+    bool ws_payload;    // header is complete, payload follows
+    uint8_t ws_op;
+    uint8_t ws_hdr_len;
+    uint8_t ws_hdr[14];
+    uint8_t ws_mask[4];
+    uint8_t ws_pos;     // payload offset for mask
+    uint32_t ws_left;   // payload left in frame
+    uint8_t ws_ctl_len;
+    uint8_t ws_ctl[WS_CTL];
+} http[config::links];
+char http_buffer[HTTP_RESPONSE_MAX(sizeof(send_buffer))];
+static_assert(sizeof("Content-Length: 4294967295\r\n") <= sizeof("Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n"),
+    "Content-Length replaces gzip headers in HTTP_ADDED");
+uint32_t http_reused = 0;
+uint32_t http_requests = 0;   // requests forwarded to MCU
+uint32_t http_pipelined = 0;  // requests queued in socket behind previous one
+
+// MCU response time, from request +IPD to first AT+CIPSEND, and
+// circuit breaker answering HTTP requests with 503 while MCU is slow
+//  * trips when average latency or the oldest pending request exceeds
+//    breaker_latency, or breaker_backlog requests are pending
+//  * after breaker_cooldown one probe request is let through
+#ifndef BREAKER_LATENCY
+#define BREAKER_LATENCY 3000  // ms, 0 - disabled
+#endif
+#ifndef BREAKER_BACKLOG
+#define BREAKER_BACKLOG 8
+#endif
+#ifndef BREAKER_COOLDOWN
+#define BREAKER_COOLDOWN 5000  // ms
+#endif
+#define LATENCY_BUCKETS 14     // <1, <2, <4 ... <4096, >=4096 ms
+#define LATENCY_WINDOW 60000   // histogram is rolled every minute
+enum breaker {
+    BREAKER_CLOSED,
+    BREAKER_OPEN,
+    BREAKER_HALF,  // probe request is pending
+} breaker = BREAKER_CLOSED;
+uint32_t breaker_latency = BREAKER_LATENCY;
+int breaker_backlog = BREAKER_BACKLOG;
+uint32_t breaker_cooldown = BREAKER_COOLDOWN;
+uint32_t breaker_since;
+int breaker_probe = -1;
+uint32_t breaker_trips = 0;
+uint32_t breaker_rejected = 0;
+uint32_t latency_avg = 0;
+uint32_t latency_hist[2][LATENCY_BUCKETS];  // current and previous window
+uint32_t latency_window = 0;
+
+// last successful response per GET path, served with Age header when
+// MCU doesn't start response within cache_deadline, MCU response is
+// still collected in background to refresh the copy
+#ifndef CACHE_DEADLINE
+#define CACHE_DEADLINE 2000  // ms, 0 - disabled
+#endif
+#define CACHE_ENTRIES 4
+#define CACHE_ENTRY_MAX 4096
+#define CACHE_CAPTURE_MAX 8192  // responses collected at once, all links
+#define CACHE_HEAP_MIN 12288    // free heap left when collecting
+struct cache {
+    uint32_t path;  // path hash, 0 - empty
+    char url[HTTP_PATH];
+    uint32_t time;  // millis() when stored
+    int len;
+    char *data;     // raw MCU response
+} cache[CACHE_ENTRIES];
+uint32_t cache_deadline = CACHE_DEADLINE;
+uint32_t cache_served = 0;
+int cache_captured = 0;  // bytes in link captures
+
+// cache warming: ESP requests configured paths from MCU over an
+// internal link while UART is idle, requests for these paths are
+// answered from cache while the copy is fresh
+#define WARM_PATHS 4
+#define WARM_TIMEOUT 10000  // ms for MCU to close internal or detached link
+#define LINK_INTERNAL -1    // link_server[] of internal link
+struct warm {
+    char path[64];
+    uint32_t hash;
+    uint32_t time;  // last request
+} warm[WARM_PATHS];
+int warm_count = 0;
+uint32_t warm_interval = 0;  // ms, 0 - disabled
+int warm_link = -1;          // link of request in progress
+uint32_t warm_hits = 0;
+
+// JSON snapshot at <ip>:8080/snapshot: ESP requests configured paths
+// from MCU over the warming internal link while UART is idle and
+// combines response bodies into one document, pollers never reach UART
+//  * JSON bodies are embedded as is, others as strings
+//  * last 200 response is kept per path, missing values are null
+#define SNAP_PATHS 8
+#define SNAP_VALUE_MAX 512  // response body
+#define SNAP_MAX 4096       // document
+struct warm snap[SNAP_PATHS];
+struct snap_value {
+    char *body;     // nullptr - no response yet
+    int len;
+    bool json;
+    uint64_t time;  // millis64() when stored
+} snap_values[SNAP_PATHS];
+int snap_count = 0;
+uint32_t snap_interval = 0;  // ms, 0 - disabled
+#define SNAP_DISCARD -2      // snap_pending of dropped snapshot path
+int snap_pending = -1;       // snap[] of warm_link request, -1 - warm[]
+char *snap_doc = nullptr;
+int snap_len = 0;
+uint32_t snap_served = 0;
+
+// internal link client, MCU response is only captured to cache
+class InternalClient : public WiFiClient {
+public:
+    bool open = true;
+    uint8_t connected() override { return open; }
+    int available() override { return 0; }
+    int availableForWrite() override { return 1460; }
+    size_t write(const uint8_t *buf, size_t size) override { return size; }
+    using WiFiClient::write;
+    void stop() override { open = false; }
+};
+
+// long running operations, AT commands are queued until finished
+#define CWJAP_TIMEOUT 15000
+#define SEND_TIMEOUT 5000
+enum busy {
+    BUSY_NONE,
+    BUSY_CONNECT,  // AT+CWJAP is waiting for connection
+    BUSY_SEND,     // AT+CIPSEND payload is written to client
+    BUSY_MQTT,     // AT+MQTTCONN is waiting for CONNACK
+} busy = BUSY_NONE;
+uint32_t busy_since;
+
+// queued AT commands
+#define CMDQ_SIZE 4
+struct cmdq {
+    char buffer[128];
+    size_t len;
+} cmdq[CMDQ_SIZE];
+int cmdq_head = 0;
+int cmdq_count = 0;
 
 // history
-#define HISTSIZE 8
 struct history {
     char buffer[128];
     struct history *next;
-} *history, h[HISTSIZE];
+} *history, h[config::history];
+
+// binary UART mode, entered with AT+CIPBINARY=1, left with EXIT frame
+//  * frames are COBS encoded and end with 0x00:
+//    <type><seq><ack><link><len varint><payload><crc16 le>
+//  * ack is the next seq expected from the other side, ACK frames
+//    carry it alone and are not sequenced
+//  * ESP frames stay in a go-back-N window in input_buffer until
+//    acked, links are not read while the window is full
+//  * host frames are decoded into send_buffer, DATA is written like
+//    AT+CIPSEND payload and UART is not read until it is written,
+//    DATA which cannot be written closes its link
+//  * EXIT is not taken while the window holds unacked frames or link
+//    events are queued, links and new clients wait meanwhile and host
+//    resends EXIT until it is acked
+#define BIN_DATA 1     // link data, both directions
+#define BIN_CONNECT 2  // link connected, ESP only
+#define BIN_CLOSE 3    // close link, link closed
+#define BIN_ACK 4
+#define BIN_EXIT 5     // back to AT commands, host only
+#define BIN_WINDOW 4
+#define BIN_SLOT (config::buffer / BIN_WINDOW)
+#define BIN_MTU (int)(BIN_SLOT - 9)  // link payload in ESP frame
+#define BIN_RETRY 500                // ms without ack before window is resent
+bool bin_mode = false;
+uint8_t bin_tx_seq;     // oldest frame in window
+uint8_t bin_tx_count;   // frames in window
+uint16_t bin_tx_len[BIN_WINDOW];
+uint32_t bin_tx_time;   // last ack progress
+uint8_t bin_rx_seq;     // next frame expected from host
+bool bin_ack_due;
+bool bin_exit;          // EXIT waits for window to drain
+uint32_t bin_connect;   // link events waiting for window
+uint32_t bin_close;
+size_t bin_rx_pos;      // COBS decoder
+int bin_rx_left;        // bytes left in block
+int bin_rx_code;        // current block code, 0 - frame start
+bool bin_rx_drop;       // frame overflow, skip to delimiter
+uint32_t bin_tx_bytes = 0;
+uint32_t bin_tx_data = 0;
+uint32_t bin_rx_bytes = 0;
+uint32_t bin_rx_data = 0;
+uint32_t bin_retries = 0;
+uint32_t bin_errors = 0;
+uint32_t bin_send_fails = 0;  // acked DATA not written, link was closed
+
+// MQTT 3.1.1 client with ESP-AT style AT+MQTT* commands, link 0 only
+//  * QoS 0 and 1 publish, QoS 1 messages are kept until PUBACK and
+//    sent again with DUP flag after MQTT_RETRY or on reconnect
+//  * outbound queue is bounded by MQTT_QUEUE messages and
+//    MQTT_QUEUE_BYTES, pending messages are written in one batch
+//  * clean session, subscriptions are renewed on every connect
+//  * DNS and tcp connect run in the background with lwIP callbacks,
+//    the broker address is kept until a connect to it fails
+//  * subscriptions are QoS 0 or 1, a QoS 2 message from the broker
+//    is answered with PUBREC and PUBCOMP
+#ifndef MQTT_QUEUE
+#define MQTT_QUEUE 16
+#endif
+#ifndef MQTT_QUEUE_BYTES
+#define MQTT_QUEUE_BYTES 4096
+#endif
+#define MQTT_SUBS 4
+#define MQTT_RX 512           // largest incoming packet, larger are dropped
+#define MQTT_KEEPALIVE 60     // s
+#define MQTT_TIMEOUT 5000     // CONNACK wait, ms
+#define MQTT_RETRY 10000      // QoS 1 resend, ms
+#define MQTT_CONNECT 5000     // DNS and tcp connect wait, ms
+#define MQTT_RECONNECT 5000   // first reconnect delay, ms
+#define MQTT_RECONNECT_MAX 300000  // delay doubles up to this, ms
+enum mqtt_state {
+    MQTT_UNINIT,            // no AT+MQTTUSERCFG
+    MQTT_USERCFG,           // AT+MQTTUSERCFG is set
+    MQTT_DISCONNECTED = 3,  // broker is set, not connected
+    MQTT_CONNECTED,         // CONNACK received
+};
+enum mqtt_tcp {
+    MQTT_TCP_IDLE,
+    MQTT_TCP_DNS,           // waiting for dns_gethostbyname()
+    MQTT_TCP_RESOLVED,      // mqtt_addr is set
+    MQTT_TCP_CONNECTING,    // waiting for tcp_connect()
+    MQTT_TCP_CONNECTED,     // mqtt_ctx is set
+    MQTT_TCP_FAILED,
+};
+struct mqtt_cfg {
+    char client_id[64];
+    char username[64];
+    char password[64];
+    char host[64];
+    uint16_t port;
+    bool reconnect;
+} mqtt_cfg;
+struct mqtt_msg {
+    uint8_t *packet;  // encoded PUBLISH, nullptr when done
+    uint16_t len;
+    uint16_t id;      // packet id, 0 for QoS 0
+    uint32_t sent;    // millis() of last write, 0 - not written
+} mqtt_queue[MQTT_QUEUE];
+struct mqtt_sub {
+    char topic[64];
+    uint8_t qos;
+} mqtt_subs[MQTT_SUBS];
+
+// broker connection made with lwIP calls, the WiFiClient constructor
+// which adopts a ClientContext is protected
+class MqttClient : public WiFiClient {
+public:
+    MqttClient(ClientContext *ctx) : WiFiClient(ctx) {}
+};
+
+uint8_t mqtt_state = MQTT_UNINIT;
+WiFiClient *mqtt_client = nullptr;
+uint8_t mqtt_tcp = MQTT_TCP_IDLE;
+struct tcp_pcb *mqtt_pcb = nullptr;   // connect in progress
+ClientContext *mqtt_ctx = nullptr;    // connected, not yet in mqtt_client
+ip_addr_t mqtt_addr;
+bool mqtt_addr_ok = false;            // mqtt_addr is mqtt_cfg.host
+uint32_t mqtt_since;    // connect or reconnect attempt
+uint32_t mqtt_backoff = MQTT_RECONNECT;
+uint32_t mqtt_tx_time;  // last packet written
+uint32_t mqtt_rx_time;  // last packet received
+int mqtt_head = 0;
+int mqtt_count = 0;
+uint32_t mqtt_bytes = 0;
+uint16_t mqtt_id = 0;
+int mqtt_sub_count = 0;
+uint8_t mqtt_rx[MQTT_RX];
+int mqtt_rx_len = 0;
+uint32_t mqtt_rx_skip = 0;  // rest of dropped packet
+uint32_t mqtt_published = 0;
+uint32_t mqtt_batches = 0;
+uint32_t mqtt_retries = 0;
+uint32_t mqtt_received = 0;
+
+// loop() tasks, run in priority order with a time budget in us
+#ifndef TASK_BUDGET_SERIAL
+#define TASK_BUDGET_SERIAL 2000
+#endif
+#ifndef TASK_BUDGET_HTTP
+#define TASK_BUDGET_HTTP 10000
+#endif
+#ifndef TASK_BUDGET_ACCEPT
+#define TASK_BUDGET_ACCEPT 1000
+#endif
+#ifndef TASK_BUDGET_CLIENTS
+#define TASK_BUDGET_CLIENTS 5000
+#endif
+#ifndef TASK_BUDGET_MIRROR
+#define TASK_BUDGET_MIRROR 1000
+#endif
+#ifndef TASK_BUDGET_WARM
+#define TASK_BUDGET_WARM 1000
+#endif
+#ifndef TASK_BUDGET_MQTT
+#define TASK_BUDGET_MQTT 2000
+#endif
+static void task_serial(uint32_t budget);
+static void task_http(uint32_t budget);
+static void task_accept(uint32_t budget);
+static void task_clients(uint32_t budget);
+static void task_mirror(uint32_t budget);
+static void task_warm(uint32_t budget);
+static void task_mqtt(uint32_t budget);
+struct task {
+    const char *name;
+    void (*run)(uint32_t budget);
+    uint32_t budget;
+    uint8_t priority;  // lower value runs first, serial is always 0
+    uint32_t runs;
+    uint32_t overruns;
+    uint32_t max_us;
+} tasks[] = {
+    { "serial",  task_serial,  TASK_BUDGET_SERIAL,  0 },
+    { "clients", task_clients, TASK_BUDGET_CLIENTS, 1 },
+    { "accept",  task_accept,  TASK_BUDGET_ACCEPT,  2 },
+    { "mirror",  task_mirror,  TASK_BUDGET_MIRROR,  3 },
+    { "mqtt",    task_mqtt,    TASK_BUDGET_MQTT,    4 },
+    { "http",    task_http,    TASK_BUDGET_HTTP,    5 },
+    { "warm",    task_warm,    TASK_BUDGET_WARM,    6 },
+};
+#define TASKS (int)(sizeof(tasks) / sizeof(tasks[0]))
+uint32_t serial_checked = 0;
+uint32_t serial_gap_max = 0;
+uint32_t loop_avg = 0;  // moving average of loop() time, us
+uint32_t loop_max = 0;
 
 
 // rtc user memory write
-static bool rtc_usermem_set(int32_t data)
+static bool rtc_usermem_set(const struct server_cfg *data)
 {
     struct rtc_storage d = {
         .magic = {'R','U','M'},
     };
+    unsigned i;
 
-    d.data = data;
-    d.checksum = d.data_bytes[0] + d.data_bytes[1] + \
-                 d.data_bytes[2] + d.data_bytes[3];
+    memcpy(d.data, data, sizeof(d.data));
+
+    d.checksum = 0;
+    for (i = 0; i < sizeof(d.data_bytes); i++)
+        d.checksum += d.data_bytes[i];
 
     return system_rtc_mem_write(RTC_BASE, &d, sizeof(d));
 }
 
 
 // rtc user memory read
-static bool rtc_usermem_get(int32_t *data)
+static bool rtc_usermem_get(struct server_cfg *data)
 {
     struct rtc_storage d;
     uint8_t csum;
+    unsigned i;
 
     if (!system_rtc_mem_read(RTC_BASE, &d, sizeof(d)))
         return false;
@@ -98,26 +722,109 @@ static bool rtc_usermem_get(int32_t *data)
     if (d.magic[0] != 'R' || d.magic[1] != 'U' || d.magic[2] != 'M')
         return false;
 
-    csum = d.data_bytes[0] + d.data_bytes[1] + \
-           d.data_bytes[2] + d.data_bytes[3];
+    csum = 0;
+    for (i = 0; i < sizeof(d.data_bytes); i++)
+        csum += d.data_bytes[i];
 
     if (csum != d.checksum)
         return false;
 
-    *data = d.data;
+    memcpy(data, d.data, sizeof(d.data));
 
     return true;
 }
 
 
-// 64bit millis() implementation
+// 64bit millis() implementation, core keeps micros64() across
+// 32 bit wraps on its own, so it does not depend on loop() calls
 static uint64_t millis64(void)
 {
-    static uint32_t low32 = 0, high32 = 0;
-    uint32_t new_low32 = millis();
-    if (new_low32 < low32) high32++;
-    low32 = new_low32;
-    return (uint64_t) high32 << 32 | low32;
+    return micros64() / 1000;
+}
+
+
+// append string literal, length is known at compile time
+template <size_t N>
+static inline char *put_str(char *out, const char (&str)[N])
+{
+    memcpy(out, str, N - 1);
+    return out + N - 1;
+}
+
+
+// append unsigned decimal
+static char *put_uint(char *out, uint32_t v)
+{
+    uint32_t d = 1;
+
+    while (v / d >= 10)
+        d *= 10;
+
+    for (; d > 0; d /= 10)
+        *out++ = '0' + v / d % 10;
+
+    return out;
+}
+
+
+// append lower-case hex
+static char *put_hex(char *out, uint32_t v)
+{
+    int s = 28;
+
+    while (s > 0 && (v >> s) == 0)
+        s -= 4;
+
+    for (; s >= 0; s -= 4)
+        *out++ = "0123456789abcdef"[(v >> s) & 15];
+
+    return out;
+}
+
+
+// queue binary mode link event, link reported closed before it is
+// reported connected was never seen by host
+static void bin_event(int i, bool connect)
+{
+    if (connect)
+        bin_connect |= 1U << i;
+    else if (bin_connect & (1U << i))
+        bin_connect &= ~(1U << i);
+    else
+        bin_close |= 1U << i;
+}
+
+
+// link event URC: <link>,<event>
+template <size_t N>
+static void urc_link(int i, const char (&event)[N])
+{
+    char line[N + 16];
+    char *out = put_uint(line, i);
+
+    if (bin_mode) {
+        bin_event(i, !strcmp(event, "CONNECT"));
+        return;
+    }
+
+    *out++ = ',';
+    out = put_str(out, event);
+    out = put_str(out, "\r\n");
+    Serial.write(line, out - line);
+}
+
+
+// received data URC header: +IPD,<link>,<len>:
+static void urc_ipd(int i, int len)
+{
+    char line[32];
+    char *out = put_str(line, "+IPD,");
+
+    out = put_uint(out, i);
+    *out++ = ',';
+    out = put_uint(out, len);
+    *out++ = ':';
+    Serial.write(line, out - line);
 }
 
 
@@ -137,333 +844,4080 @@ static uint16_t creds_crc(struct creds *creds)
 }
 
 
-// close all client connections and stop server
-static void server_stop()
+// calculate crc for uart settings
+static uint16_t uart_cfg_crc(struct uart_cfg *cfg)
 {
-    // close all client connections...
-    for (int i = 0; i < MAX_CLIENTS; i++) {
-        if (client[i] == nullptr)
-            continue;
-
-        client[i]->stop();
-        delete client[i];
-        client[i] = nullptr;
-    }
-
-    // stop server
-    if (server != nullptr) {
-        server->stop();
-        delete server;
-        server = nullptr;
-    }
+    uint8_t *p = (uint8_t *)&cfg->baud;
+    uint16_t crc = 0;
+    unsigned i;
 
-    // reset connected clients count and server port
-    server_port = 0;
-    connected = 0;
+    for (i = 0; i < sizeof(cfg->baud); i++)
+        crc += p[i];
 
-    // update port in rtc user memory
-    rtc_usermem_set(0);
+    return crc + cfg->flow + (cfg->rx_buffer & 0xFF) + (cfg->rx_buffer >> 8) + UART_MAGIC;
 }
 
 
-// process AT command
-static void process_command(char *command, size_t len)
+// apply uart baud rate and hardware flow control
+//  * RTS on GPIO15 (U0RTS), CTS on GPIO13 (U0CTS)
+//  * flow control is not available with swapped pins
+static void uart_setup(uint32_t baud, uint8_t flow)
 {
-    if (len == 0)
-        return;
+    // drain pending output at the old rate
+    Serial.flush();
+    uart_flow = flow;
 
-    history = history->next;
+    if (Serial.baudRate() != baud)
+        Serial.updateBaudRate(baud);
 
-    if (len < sizeof(history->buffer)) {
-        memcpy(history->buffer, command, len);
-        history->buffer[len] = '\0';
+    USC1(0) &= ~((1 << UCRXHFE) | (0x7F << UCRXHFT));
+    if (flow & UART_FLOW_RTS) {
+        pinMode(15, FUNCTION_4);
+        USC1(0) |= (1 << UCRXHFE) | ((UART_RTS_THRESHOLD & 0x7F) << UCRXHFT);
     } else {
-        memcpy(history->buffer, command, sizeof(history->buffer) - 1);
-        history->buffer[sizeof(history->buffer) - 1] = '\0';
+        pinMode(15, INPUT);
     }
 
-    // test
-    if (!strcmp(command, "AT"))
-        goto ok;
-
-    // reset
-    if (!strcmp(command, "AT+RST")) {
-        server_stop();
-        Serial.print(F("\r\nOK\r\n...bla-bla-bla...\r\nready\r\n"));
-        return;
+    USC0(0) &= ~(1 << UCTXHFE);
+    if (flow & UART_FLOW_CTS) {
+        pinMode(13, FUNCTION_4);
+        USC0(0) |= (1 << UCTXHFE);
+    } else {
+        pinMode(13, INPUT);
     }
+}
 
-    // station mode
-    if (!strcmp(command, "AT+CWMODE=1"))
-        goto ok;
-
-    // enable multiple connections
-    if (!strcmp(command, "AT+CIPMUX=1"))
-        goto ok;
 
-    // check AP
-    if (!strcmp(command, "AT+CWJAP?")) {
-        if (WiFi.isConnected()) {
-            char *dst, *src;
-            char buf[80];
+// uart rx interrupt, moves bytes from hardware fifo to rx ring
+//  * with RTS flow control bytes are left in the fifo when the ring
+//    is full and rx interrupts stay off until loop() reads the ring
+static void IRAM_ATTR uart_rx_isr(void *arg, void *frame)
+{
+    uint32_t status = USIS(0);
+    uint32_t head = uart_rx_head;
 
-            strcpy_P(buf, PSTR("+CWJAP:\""));
+    if (status & ((1 << UIOF) | (1 << UIFR) | (1 << UIPE)))
+        uart_rx_errors++;
 
-            src = creds.ssid;
-            dst = buf + 8;
+    while ((USS(0) >> USRXC) & 0xFF) {
+        uint32_t next = (head + 1) & uart_rx_mask;
+        uint8_t c;
 
-            while (*src != '\0') {
-                if (*src == '"' || *src == ',' || *src == '\\')
-                    *dst++ = '\\';
-                *dst++ = *src++;
+        if (next == uart_rx_tail) {
+            if (uart_flow & UART_FLOW_RTS) {
+                USIE(0) &= ~((1 << UIFF) | (1 << UITO));
+                break;
             }
-
-            *dst = '\0';
-            strcat_P(dst, PSTR("\"\r\n"));
-
-            Serial.print(buf);
-            goto ok;
-        } else {
-            Serial.print(F("No AP\r\n"));
-            goto error;
+            (void)USF(0);
+            uart_overruns++;
+            continue;
         }
-    }
 
-    // connect to AP
-    if (len > 9 && (!strncmp(command, "AT+CWJAP=", 9))) {
-        char *src = command + 9;
-        char *dst;
-        char ssid[33];
-        char pass[64];
+        c = USF(0);
+        uart_rx_ring[head] = c;
+        head = next;
 
-        // check start double quote
-        if (*src != '"')
-            goto error;
+        if (c == uart_rx_delim)
+            uart_rx_ready = true;
+    }
 
-        // parse ssid
-        src++;
-        dst = ssid;
-        while (*src != '"' && *src != '\0' && dst - ssid < (int)sizeof(ssid) - 1) {
-            if (*src == '\\')
-                src++;
-            *dst++ = *src++;
-        }
+    uart_rx_head = head;
 
-        // check delimiter
-        if (*src++ != '"' || *src++ != ',' || *src++ != '"')
-            goto error;
+    // payload complete or ring is filling up
+    if (((head - uart_rx_tail) & uart_rx_mask) >= (uart_rx_want ? uart_rx_want : uart_rx_mask / 4 * 3))
+        uart_rx_ready = true;
 
-        *dst = '\0';
+    USIC(0) = status;
+}
 
-        // hide password in history
-        strcpy_P(history->buffer + (src - command), PSTR("*\""));
 
-        // parse password
-        dst = pass;
-        while (*src != '"' && *src != '\0' && dst - pass < (int)sizeof(pass) - 1) {
-            if (*src == '\\')
-                src++;
-            *dst++ = *src++;
-        }
+// bytes in rx ring
+static inline uint32_t uart_rx_count()
+{
+    return (uart_rx_head - uart_rx_tail) & uart_rx_mask;
+}
 
-        // check end double quote
-        if (*src != '"')
-            goto error;
 
-        *dst = '\0';
+// read up to len bytes from rx ring, stop after delim if delim >= 0
+static size_t uart_rx_read(char *dst, size_t len, int delim)
+{
+    uint32_t tail = uart_rx_tail;
+    uint32_t head = uart_rx_head;
+    size_t n = 0;
 
-        // check if ssid and pass was changed
-        if (strcmp(ssid, creds.ssid) || strcmp(pass, creds.pass)) {
-            // copy new creds
-            memset(creds.ssid, 0, sizeof(creds.ssid));
-            memset(creds.pass, 0, sizeof(creds.pass));
-            strcpy(creds.ssid, ssid);
-            strcpy(creds.pass, pass);
-            creds.crc = creds_crc(&creds);
+    while (n < len && tail != head) {
+        char c = uart_rx_ring[tail];
 
-            // save creds to eeprom
-            EEPROM.put(0, creds);
-            EEPROM.commit();
+        tail = (tail + 1) & uart_rx_mask;
+        dst[n++] = c;
 
-            // connect to wifi
-            WiFi.disconnect();
-            WiFi.begin(creds.ssid, creds.pass);
-        }
+        if (c == delim)
+            break;
+    }
 
-        if (WiFi.waitForConnectResult(15000) != WL_CONNECTED) {
-            Serial.print(F("+CWJAP:1\r\n\r\nFAIL\r\n"));
-            return;
-        }
+    uart_rx_tail = tail;
 
-        goto ok;
+    // ring has free space again
+    if (n > 0 && (uart_flow & UART_FLOW_RTS)) {
+        ETS_UART_INTR_DISABLE();
+        USIE(0) |= (1 << UIFF) | (1 << UITO);
+        ETS_UART_INTR_ENABLE();
     }
 
-    // set ip
-    //  * WiFi connects only to DHCP-enabled networks
-    //  * there is no any sense to set static ip
-    if (len > 10 && (!strncmp(command, "AT+CIPSTA=", 10)))
-        goto ok;
+    return n;
+}
 
-    // start/stop server
-    if (len > 13 && (!strncmp(command, "AT+CIPSERVER=", 13))) {
-        int cmd, port, r;
 
-        r = sscanf(command + 13, "%d,%d", &cmd, &port);
+// (re)allocate rx ring, size is rounded up to power of two,
+// returns new size or 0 on failure
+static unsigned uart_rx_resize(unsigned size)
+{
+    uint8_t *ring, *old;
+    uint32_t n = 1;
+    uint32_t count;
 
-        if (r > 0 && cmd == 0) {
-            server_stop();
-            goto ok;
-        }
+    while (n < size)
+        n <<= 1;
 
-        if (r == 2 && cmd == 1 && port > 0 && port < 65536 && port != 8080 && server == nullptr) {
-            server = new WiFiServer(port);
-            rtc_usermem_set(port);
-            server_port = port;
-            server->begin();
-            goto ok;
-        }
+    ring = (uint8_t *)malloc(n);
+    if (ring == nullptr)
+        return 0;
 
-        goto error;
+    ETS_UART_INTR_DISABLE();
+
+    // keep unread bytes which fit into the new ring
+    count = 0;
+    while (uart_rx_ring != nullptr && uart_rx_tail != uart_rx_head && count < n - 1) {
+        ring[count++] = uart_rx_ring[uart_rx_tail];
+        uart_rx_tail = (uart_rx_tail + 1) & uart_rx_mask;
     }
 
-    // close client connection
-    if (len > 12 && (!strncmp(command, "AT+CIPCLOSE=", 12))) {
-        int n;
+    old = uart_rx_ring;
+    uart_rx_ring = ring;
+    uart_rx_mask = n - 1;
+    uart_rx_tail = 0;
+    uart_rx_head = count;
 
-        if (sscanf(command + 12, "%d", &n) != 1)
-            goto error;
+    ETS_UART_INTR_ENABLE();
 
-        if (n < 0 || n >= MAX_CLIENTS)
-            goto error;
+    free(old);
 
-        if (client[n] == nullptr) {
-            Serial.print(F("link is not\r\n"));
-            goto error;
-        }
+    return n;
+}
 
-        client[n]->stop();
-        delete client[n];
-        client[n] = nullptr;
-        Serial.printf("%d,CLOSED\r\n", n);
-        connected--;
 
-        goto ok;
-    }
+// take over uart0 rx interrupt from the core serial driver,
+// Serial is still used for tx
+static void uart_rx_begin()
+{
+    ETS_UART_INTR_DISABLE();
+    ETS_UART_INTR_ATTACH(uart_rx_isr, nullptr);
+    USC1(0) = (USC1(0) & ~(0x7F << UCFFT)) | (UART_RX_FIFO_THRESHOLD << UCFFT);
+    USIC(0) = 0xFFFF;
+    USIE(0) = (1 << UIFF) | (1 << UITO) | (1 << UIOF) | (1 << UIFR) | (1 << UIPE);
+    ETS_UART_INTR_ENABLE();
+}
 
-    // send data
-    if (len > 11 && (!strncmp(command, "AT+CIPSEND=", 11))) {
-        int i, l;
 
-        if (sscanf(command + 11, "%d,%d", &i, &l) != 2)
-            goto error;
+// save listening ports in rtc user memory
+static void server_save()
+{
+    struct server_cfg cfg[MAX_SERVERS];
 
-        if (i < 0 || i >= MAX_CLIENTS)
-            goto error;
+    for (int i = 0; i < MAX_SERVERS; i++)
+        cfg[i] = servers[i].cfg;
 
-        if (client[i] == nullptr || !client[i]->connected()) {
-            Serial.print(F("link is not\r\n"));
-            return;
-        }
+    rtc_usermem_set(cfg);
+}
 
-        if (l > (int)sizeof(send_buffer)) {
-            Serial.print(F("too long\r\n"));
-            return;
-        }
 
-        send_to = i;
-        send_pos = 0;
-        send_len = l;
-        Serial.print(F("> "));
-        return;
-    }
+// find server by port
+static struct server *server_find(int port)
+{
+    for (int i = 0; i < MAX_SERVERS; i++)
+        if (servers[i].server != nullptr && servers[i].cfg.port == port)
+            return &servers[i];
 
-error:
-    Serial.print(F("\r\nERROR\r\n"));
-    return;
-ok:
-    Serial.print(F("\r\nOK\r\n"));
+    return nullptr;
 }
 
 
-// handle / page
-void handle_root()
+// start listening on port
+static struct server *server_start(const struct server_cfg *cfg)
 {
-    size_t i;
+    struct server *s = nullptr;
+
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        if (servers[i].server == nullptr) {
+            s = &servers[i];
+            break;
+        }
+    }
 
-    strcpy_P(buffer, PSTR("MSR23 WiFi modem\n\nAT history:\n"));
+    if (s == nullptr)
+        return nullptr;
 
-    for (i = 0; i < HISTSIZE; i++) {
-        history = history->next;
-        strcat(buffer, "> ");
-        strcat(buffer, history->buffer);
-        strcat(buffer, "\n");
+    if (cfg->flags & SERVER_TLS) {
+#ifdef TLS_ENABLED
+        BearSSL::WiFiServerSecure *tls = new BearSSL::WiFiServerSecure(cfg->port);
+
+        if (tls_key.isRSA())
+            tls->setRSACert(&tls_chain, &tls_key);
+        else
+            tls->setECCert(&tls_chain, BR_KEYTYPE_KEYX | BR_KEYTYPE_SIGN, &tls_key);
+        tls->setCache(&tls_sessions);
+        s->server = tls;
+#else
+        return nullptr;
+#endif
+    } else {
+        s->server = new WiFiServer(cfg->port);
     }
 
-    i = strlen(buffer);
-    i += snprintf(buffer + i, sizeof(buffer) - i,
-        "\nConnected: %d\nServer port: %d\n\nRSSI: %d\nUptime: %llu sec\nReset reason: %s",
-        connected, server_port, WiFi.RSSI(), millis64() / 1000, ESP.getResetReason().c_str()
-    );
+    s->cfg = *cfg;
+    s->links = 0;
+    s->server->begin();
 
-    httpServer.send(200, "text/plain", buffer, i);
+    return s;
 }
 
 
-// setup
-void setup()
+// copy link data to subscribed observers, frames which don't fit
+// into observer send buffer are dropped so the link is never delayed
+//  * dir is "IPD" for data from client, "SEND" for data to client
+static void mirror(int link, const char *dir, const char *data, int len)
 {
-    unsigned i;
-    int port;
+    char hdr[24];
+    char *out = hdr;
+    int n;
+
+    *out++ = '+';
+    while (*dir)
+        *out++ = *dir++;
+    *out++ = ',';
+    out = put_uint(out, link);
+    *out++ = ',';
+    out = put_uint(out, len);
+    *out++ = ':';
+    n = out - hdr;
+
+    for (int i = 0; i < MAX_OBSERVERS; i++) {
+        struct observer *o = &observers[i];
+
+        if (o->client == nullptr || !(o->mask & (1U << link)))
+            continue;
+
+        if (o->client->availableForWrite() < n + len + 2) {
+            o->drops++;
+            continue;
+        }
+
+        o->client->write((uint8_t *)hdr, n);
+        if (len > 0)
+            o->client->write((uint8_t *)data, len);
+        o->client->write((uint8_t *)"\r\n", 2);
+    }
+}
+
+
+// parse observer subscription line
+static void mirror_subscribe(struct observer *o)
+{
+    char *p = o->line;
+    uint32_t mask = 0;
+
+    if (*p == '*') {
+        o->mask = 0xFFFFFFFF;
+        return;
+    }
+
+    while (*p != '\0') {
+        char *end;
+        long n = strtol(p, &end, 10);
+
+        if (end == p)
+            break;
+
+        if (n >= 0 && n < config::links)
+            mask |= 1U << n;
+
+        p = end;
+        while (*p == ',' || *p == ' ')
+            p++;
+    }
+
+    o->mask = mask;
+}
+
+
+// write bits, LSB first
+static uint8_t *gzip_bits(struct gzip *gz, uint8_t *out, uint32_t value, int n)
+{
+    gz->bits |= value << gz->nbits;
+    gz->nbits += n;
+
+    while (gz->nbits >= 8) {
+        *out++ = gz->bits;
+        gz->bits >>= 8;
+        gz->nbits -= 8;
+    }
+
+    return out;
+}
+
+
+// write Huffman code, MSB first
+static uint8_t *gzip_code(struct gzip *gz, uint8_t *out, uint32_t code, int n)
+{
+    uint32_t r = 0;
+
+    for (int k = 0; k < n; k++, code >>= 1)
+        r = (r << 1) | (code & 1);
+
+    return gzip_bits(gz, out, r, n);
+}
+
+
+// write literal/length symbol with fixed Huffman code
+static uint8_t *gzip_symbol(struct gzip *gz, uint8_t *out, int sym)
+{
+    if (sym < 144)
+        return gzip_code(gz, out, 0x30 + sym, 8);
+    if (sym < 256)
+        return gzip_code(gz, out, 0x190 + sym - 144, 9);
+    if (sym < 280)
+        return gzip_code(gz, out, sym - 256, 7);
+    return gzip_code(gz, out, 0xC0 + sym - 280, 8);
+}
+
+
+// write match of len bytes at dist
+static uint8_t *gzip_match(struct gzip *gz, uint8_t *out, int len, int dist)
+{
+    static const uint16_t lbase[29] = {
+        3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+        35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258,
+    };
+    static const uint8_t lext[29] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+        3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0,
+    };
+    static const uint16_t dbase[20] = {
+        1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+        257, 385, 513, 769,
+    };
+    static const uint8_t dext[20] = {
+        0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+        7, 7, 8, 8,
+    };
+    int l = 28, d = 19;
+
+    while (lbase[l] > len)
+        l--;
+    while (dbase[d] > dist)
+        d--;
+
+    out = gzip_symbol(gz, out, 257 + l);
+    out = gzip_bits(gz, out, len - lbase[l], lext[l]);
+    out = gzip_code(gz, out, d, 5);
+    return gzip_bits(gz, out, dist - dbase[d], dext[d]);
+}
+
+
+// gzip header and start of first block
+static uint8_t *gzip_start(struct gzip *gz, uint8_t *out)
+{
+    static const uint8_t header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+
+    if (gz->started)
+        return out;
+
+    gz->started = true;
+    memcpy(out, header, sizeof(header));
+    return gzip_bits(gz, out + sizeof(header), 2, 3);  // not final, fixed codes
+}
+
+
+// compress len bytes of src into out, returns output length,
+// out must have room for len * 9 / 8 + 16 bytes
+static int gzip_deflate(struct gzip *gz, const char *src, int len, uint8_t *out)
+{
+    static const uint32_t crc_nibble[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+    uint8_t *start = out;
+
+    out = gzip_start(gz, out);
+
+    while (len > 0) {
+        int k, p, end;
+
+        // slide window, drop positions out of reach
+        if (gz->pos == GZIP_WINDOW * 2) {
+            memcpy(gz->win, gz->win + GZIP_WINDOW, GZIP_WINDOW);
+            gz->pos = GZIP_WINDOW;
+            for (k = 0; k < GZIP_HASH; k++)
+                gz->head[k] = gz->head[k] > GZIP_WINDOW ? gz->head[k] - GZIP_WINDOW : 0;
+        }
+
+        k = GZIP_WINDOW * 2 - gz->pos;
+        if (k > len)
+            k = len;
+
+        memcpy(gz->win + gz->pos, src, k);
+        for (p = 0; p < k; p++) {
+            gz->crc ^= (uint8_t)src[p];
+            gz->crc = (gz->crc >> 4) ^ crc_nibble[gz->crc & 15];
+            gz->crc = (gz->crc >> 4) ^ crc_nibble[gz->crc & 15];
+        }
+        gz->size += k;
+        src += k;
+        len -= k;
+
+        // matches reach back into history but not past new data
+        end = gz->pos + k;
+        for (p = gz->pos; p < end; ) {
+            int best = 0;
+            int cand;
+            uint32_t h;
+
+            if (end - p >= 3) {
+                h = (gz->win[p] | gz->win[p + 1] << 8 | gz->win[p + 2] << 16) * 2654435761U >> 24;
+                cand = gz->head[h] - 1;
+                gz->head[h] = p + 1;
+
+                if (cand >= 0 && p - cand <= GZIP_WINDOW) {
+                    int max = end - p < 258 ? end - p : 258;
+
+                    while (best < max && gz->win[cand + best] == gz->win[p + best])
+                        best++;
+                }
+            }
+
+            if (best < 3) {
+                out = gzip_symbol(gz, out, gz->win[p++]);
+                continue;
+            }
+
+            out = gzip_match(gz, out, best, p - cand);
+
+            // hash skipped positions
+            for (int j = p + 1; j < p + best && j + 2 < end; j++) {
+                h = (gz->win[j] | gz->win[j + 1] << 8 | gz->win[j + 2] << 16) * 2654435761U >> 24;
+                gz->head[h] = j + 1;
+            }
+            p += best;
+        }
+
+        gz->pos = end;
+    }
+
+    return out - start;
+}
+
+
+// end compressed stream: last block and gzip trailer, returns
+// output length, out must have room for 32 bytes
+static int gzip_finish(struct gzip *gz, uint8_t *out)
+{
+    uint8_t *start = out;
+    uint32_t crc = ~gz->crc;
+
+    out = gzip_start(gz, out);
+    out = gzip_symbol(gz, out, 256);
+    out = gzip_bits(gz, out, 3, 3);  // final, fixed codes
+    out = gzip_symbol(gz, out, 256);
+    if (gz->nbits > 0)
+        out = gzip_bits(gz, out, 0, 8 - gz->nbits);
+
+    for (int k = 0; k < 4; k++)
+        *out++ = crc >> (8 * k);
+    for (int k = 0; k < 4; k++)
+        *out++ = gz->size >> (8 * k);
+
+    return out - start;
+}
+
+
+// content type is compressed already
+static bool gzip_plain_type(const char *type)
+{
+    while (*type == ' ')
+        type++;
+
+    if (!strncasecmp(type, "image/svg", 9))
+        return false;
+
+    return !strncasecmp(type, "image/", 6) || !strncasecmp(type, "video/", 6) ||
+           !strncasecmp(type, "audio/", 6) || !strncasecmp(type, "font/woff", 9) ||
+           !strncasecmp(type, "application/octet-stream", 24) || strcasestr(type, "zip") != nullptr;
+}
+
+
+// allocate compressor for response on HTTP link
+static struct gzip *gzip_alloc()
+{
+    struct gzip *gz;
+
+    if (gzip_active >= GZIP_MAX)
+        return nullptr;
+
+    gz = (struct gzip *)calloc(1, sizeof(*gz));
+    if (gz == nullptr)
+        return nullptr;
+
+    gz->crc = 0xFFFFFFFF;
+    gzip_active++;
+
+    return gz;
+}
+
+
+// free compressor of HTTP link
+static void gzip_free(int i)
+{
+    if (http[i].gz == nullptr)
+        return;
+
+    free(http[i].gz);
+    http[i].gz = nullptr;
+    gzip_active--;
+}
+
+
+// next free link in round-robin order, -1 if all are occupied
+//  * a closed id is reused as late as possible, lingering ids are
+//    not reused at all until MCU closed them or LINK_LINGER expired
+static inline int link_slot()
+{
+    uint32_t free;
+    int i;
+
+    for (uint32_t m = link_linger; m != 0; m &= m - 1)
+        if (millis() - link_linger_since[__builtin_ctz(m)] >= LINK_LINGER)
+            link_linger &= ~(1U << __builtin_ctz(m));
+
+    // link with pending binary CLOSE is not reused yet
+    free = ~(link_used | link_linger | bin_close) & config::link_mask;
+
+    if (free == 0)
+        return -1;
+
+    // free links rotated so bit 0 is link_next
+    if (link_next > 0)
+        free = ((free >> link_next) | (free << (config::links - link_next))) & config::link_mask;
+
+    i = (link_next + __builtin_ctz(free)) % config::links;
+    link_next = (i + 1) % config::links;
+
+    return i;
+}
+
+
+// free links not reserved for ports other than servers[n],
+// n is LINK_INTERNAL for internal links which take no reserved link
+static int link_avail(int n)
+{
+    int avail = config::links - connected;
+
+    for (int i = 0; i < MAX_SERVERS; i++)
+        if (i != n && servers[i].server != nullptr && servers[i].links < servers[i].cfg.reserved)
+            avail -= servers[i].cfg.reserved - servers[i].links;
+
+    return avail;
+}
+
+
+// allocate free link for new connection on servers[n] or for
+// internal link, returns -1 if port quota is exhausted or remaining
+// links are reserved for other ports
+static int link_alloc(int n)
+{
+    if (n != LINK_INTERNAL && servers[n].cfg.quota > 0 && servers[n].links >= servers[n].cfg.quota)
+        return -1;
+
+    if (link_avail(n) <= 0)
+        return -1;
+
+    return link_slot();
+}
+
+
+// drop response captured on link
+static void cache_release(struct http *h)
+{
+    if (h->cap_len > 0)
+        cache_captured -= h->cap_len;
+
+    free(h->cap);
+    h->cap = nullptr;
+    h->cap_len = 0;
+}
+
+
+// close client connection and free link
+static void link_free(int i)
+{
+    mirror(i, "CLOSED", nullptr, 0);
+    cache_release(&http[i]);
+    gzip_free(i);
+    client[i]->stop();
+    delete client[i];
+    client[i] = nullptr;
+    link_used &= ~(1U << i);
+    ipd_wait[i] = false;
+    if (link_server[i] != LINK_INTERNAL)
+        servers[link_server[i]].links--;
+    if (warm_link == i)
+        warm_link = -1;
+    connected--;
+}
+
+
+// free link closed on ESP side and report it to MCU, the id lingers
+// until MCU closes it too
+static void link_lost(int i)
+{
+    link_free(i);
+    link_linger |= 1U << i;
+    link_linger_since[i] = millis();
+    urc_link(i, "CLOSED");
+}
+
+
+// link belongs to HTTP keep-alive server or is internal
+static inline bool http_link(int i)
+{
+    return link_server[i] == LINK_INTERNAL || (servers[link_server[i]].cfg.flags & SERVER_HTTP);
+}
+
+
+// listener type name
+static const char *server_type(const struct server_cfg *cfg)
+{
+    if (cfg->flags & SERVER_TLS)
+        return cfg->flags & SERVER_HTTP ? "HTTPS" : "SSL";
+
+    return cfg->flags & SERVER_HTTP ? "HTTP" : "TCP";
+}
+
+
+// link belongs to TLS server
+static inline bool tls_link(int i)
+{
+    return link_server[i] != LINK_INTERNAL && (servers[link_server[i]].cfg.flags & SERVER_TLS);
+}
+
+
+// TLS links open on all ports
+static int tls_count()
+{
+    int count = 0;
+
+    for (uint32_t m = link_used; m != 0; m &= m - 1)
+        if (tls_link(__builtin_ctz(m)))
+            count++;
+
+    return count;
+}
+
+
+// UART input can wait while a TLS handshake blocks loop(), only RTS
+// holds the MCU off for that long
+static bool tls_uart_ok()
+{
+    return uart_flow & UART_FLOW_RTS;
+}
+
+
+// accept TLS connection, handshake runs here
+//  * rx interrupts are off meanwhile, with RTS flow control the fifo
+//    fills up to UART_RTS_THRESHOLD and RTS holds the MCU off
+static WiFiClient *tls_accept(struct server *s)
+{
+#ifdef TLS_ENABLED
+    uint32_t start, elapsed;
+
+    if (uart_flow & UART_FLOW_RTS) {
+        ETS_UART_INTR_DISABLE();
+        USIE(0) &= ~((1 << UIFF) | (1 << UITO));
+        ETS_UART_INTR_ENABLE();
+    }
+
+    start = micros();
+    BearSSL::WiFiClientSecure c = static_cast<BearSSL::WiFiServerSecure *>(s->server)->available();
+    elapsed = micros() - start;
+
+    if (uart_flow & UART_FLOW_RTS) {
+        ETS_UART_INTR_DISABLE();
+        USIE(0) |= (1 << UIFF) | (1 << UITO);
+        ETS_UART_INTR_ENABLE();
+    }
+
+    if (!c) {
+        tls_failed++;
+        return nullptr;
+    }
+
+    if (tls_handshakes++ == 0) {
+        tls_handshake_avg = elapsed;
+        tls_handshake_min = elapsed;
+    }
+
+    tls_handshake_avg = (tls_handshake_avg * 7 + elapsed) / 8;
+    if (elapsed < tls_handshake_min)
+        tls_handshake_min = elapsed;
+    if (elapsed > tls_handshake_max)
+        tls_handshake_max = elapsed;
+
+    return new BearSSL::WiFiClientSecure(c);
+#else
+    return nullptr;
+#endif
+}
+
+
+// link is WebSocket
+static inline bool ws_link(int i)
+{
+    return http_link(i) && http[i].state == HTTP_WS;
+}
+
+
+// link is open for MCU
+static bool link_open(int i)
+{
+    if (client[i] == nullptr || !client[i]->connected())
+        return false;
+
+    return !http_link(i) || http[i].announced;
+}
+
+
+// case insensitive header name match
+static bool http_header(const char *line, const char *name)
+{
+    return !strncasecmp(line, name, strlen(name));
+}
+
+
+// start new request on HTTP link
+static void http_begin(int i)
+{
+    struct http *h = &http[i];
+
+    cache_release(h);
+    gzip_free(i);
+    memset(h, 0, sizeof(*h));
+    h->state = HTTP_REQUEST;
+    h->keepalive = true;
+    h->path = 2166136261;
+}
+
+
+// parse request data, returns number of bytes belonging to current
+// request, state is HTTP_WAIT when whole request was parsed
+static int http_request(int i, const char *data, int len)
+{
+    struct http *h = &http[i];
+    int n = 0;
+
+    while (n < len && h->state == HTTP_REQUEST) {
+        char c;
+
+        // request body
+        if (h->req == HTTP_BODY) {
+            uint32_t k = len - n;
+
+            if (k > h->req_body)
+                k = h->req_body;
+
+            n += k;
+            h->req_body -= k;
+
+            if (h->req_body == 0)
+                h->state = HTTP_WAIT;
+            continue;
+        }
+
+        c = data[n++];
+
+        // request line: method, path, version
+        if (h->req == HTTP_LINE_START && c == ' ') {
+            if (h->req_word++ == 0) {
+                h->req_line[h->req_len] = '\0';
+                h->head = !strcmp(h->req_line, "HEAD");
+                h->get = !strcmp(h->req_line, "GET");
+            }
+            h->req_len = 0;
+            continue;
+        }
+
+        // FNV-1a hash of path, path is kept to rule out collisions
+        if (h->req == HTTP_LINE_START && h->req_word == 1) {
+            h->path = (h->path ^ (uint8_t)c) * 16777619;
+            if (h->url_len < HTTP_PATH - 1)
+                h->url[h->url_len++] = c;
+            else
+                h->get = false;  // too long to be cached
+            continue;
+        }
+
+        if (c != '\n') {
+            if (h->req_len < HTTP_LINE - 1)
+                h->req_line[h->req_len++] = c;
+            continue;
+        }
+
+        if (h->req_len > 0 && h->req_line[h->req_len - 1] == '\r')
+            h->req_len--;
+        h->req_line[h->req_len] = '\0';
+
+        if (h->req == HTTP_LINE_START) {
+            // skip empty lines before request
+            if (h->req_word == 0 && h->req_len == 0)
+                continue;
+
+            // HTTP/1.0 closes connection by default
+            if (strcmp(h->req_line, "HTTP/1.1"))
+                h->keepalive = false;
+
+            h->req = HTTP_HEADERS;
+        } else if (h->req_len == 0) {
+            // end of headers, chunked request can't be framed
+            // here so the rest of the socket goes to this request
+            if (h->req_chunked) {
+                h->keepalive = false;
+                h->req_body = 0xFFFFFFFF;
+            }
+
+            if (h->req_body > 0)
+                h->req = HTTP_BODY;
+            else
+                h->state = HTTP_WAIT;
+        } else if (http_header(h->req_line, "content-length:")) {
+            h->req_body = strtoul(h->req_line + 15, nullptr, 10);
+        } else if (http_header(h->req_line, "transfer-encoding:")) {
+            h->req_chunked = strcasestr(h->req_line, "chunked") != nullptr;
+        } else if (http_header(h->req_line, "accept-encoding:")) {
+            h->req_gzip = strcasestr(h->req_line, "gzip") != nullptr;
+        } else if (http_header(h->req_line, "upgrade:")) {
+            h->req_upgrade = strcasestr(h->req_line, "websocket") != nullptr;
+        } else if (http_header(h->req_line, "sec-websocket-key:")) {
+            const char *key = h->req_line + 18;
+
+            while (*key == ' ')
+                key++;
+            snprintf(h->ws_key, sizeof(h->ws_key), "%s", key);
+        } else if (http_header(h->req_line, "connection:")) {
+            if (strcasestr(h->req_line, "close"))
+                h->keepalive = false;
+        }
+
+        h->req_len = 0;
+    }
+
+    return n;
+}
+
+
+// request line of next request is in socket, it is only peeked so
+// nothing is consumed before the request is routed
+//  * a line longer than buffer is routed on its first part
+//  * TLS socket shows the current record only, a line split across
+//    records is routed on its first part too
+static bool http_line(int i)
+{
+    int n = client[i]->available();
+    bool text = false;
+
+    // peekBytes() waits for more than is available
+    if (n > (int)sizeof(buffer))
+        n = sizeof(buffer);
+    n = client[i]->peekBytes((uint8_t *)buffer, n);
+
+    for (int k = 0; k < n; k++) {
+        if (buffer[k] == '\n' && text)
+            return true;
+        if (buffer[k] != '\r' && buffer[k] != '\n')
+            text = true;
+    }
+
+    return n == (int)sizeof(buffer) || tls_link(i);
+}
+
+
+// read current request into buffer, pipelined requests stay in socket
+//  * sockets without peek buffer (TLS) are parsed byte by byte
+static int http_read(int i, int len)
+{
+    int n = 0;
+
+    if (client[i]->hasPeekBufferAPI()) {
+        if ((int)client[i]->peekAvailable() < len)
+            len = client[i]->peekAvailable();
+
+        n = http_request(i, client[i]->peekBuffer(), len);
+        if (n > 0)
+            n = client[i]->read((uint8_t *)buffer, n);
+        return n;
+    }
+
+    while (n < len && http[i].state == HTTP_REQUEST) {
+        int c = client[i]->read();
+
+        if (c < 0)
+            break;
+
+        buffer[n] = c;
+        n += http_request(i, buffer + n, 1);
+    }
+
+    return n;
+}
+
+
+// write WebSocket control frame
+static void ws_control(int i, uint8_t op, const uint8_t *data, int len)
+{
+    uint8_t frame[2 + WS_CTL] = { (uint8_t)(0x80 | op), (uint8_t)len };
+
+    memcpy(frame + 2, data, len);
+    client[i]->write(frame, 2 + len);
+}
+
+
+// write WebSocket frame header for len bytes of AT+CIPSEND data
+static void ws_header(int i, int len)
+{
+    uint8_t hdr[4] = { (uint8_t)(0x80 | ws_opcode) };
+    int n = 2;
+
+    if (len < 126) {
+        hdr[1] = len;
+    } else {
+        hdr[1] = 126;
+        hdr[2] = len >> 8;
+        hdr[3] = len;
+        n = 4;
+    }
+
+    client[i]->write(hdr, n);
+}
+
+
+// request is for WebSocket path, request line is complete
+static bool ws_request(int i)
+{
+    struct http *h = &http[i];
+
+    return ws_hash != 0 && h->get && h->req != HTTP_LINE_START && h->path == ws_hash && !strcmp(h->url, ws_path);
+}
+
+
+// answer WebSocket upgrade, link is open for MCU from now on,
+// anything else on WebSocket path gets 400
+static void ws_accept(int i)
+{
+    struct http *h = &http[i];
+    uint8_t hash[20];
+    int l;
+
+    if (!h->req_upgrade || strlen(h->ws_key) != 24) {
+        client[i]->write((uint8_t *)"HTTP/1.1 400 Bad Request\r\nConnection: close\r\nContent-Length: 0\r\n\r\n", 66);
+        link_free(i);
+        return;
+    }
+
+    l = snprintf(buffer, sizeof(buffer), "%s258EAFA5-E914-47DA-95CA-C5AB0DC85B11", h->ws_key);
+    sha1((uint8_t *)buffer, l, hash);
+    l = snprintf(buffer, sizeof(buffer),
+        "HTTP/1.1 101 Switching Protocols\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Accept: %s\r\n\r\n",
+        base64::encode(hash, sizeof(hash), false).c_str());
+    client[i]->write((uint8_t *)buffer, l);
+
+    h->state = HTTP_WS;
+    h->announced = true;
+    ws_upgrades++;
+    urc_link(i, "CONNECT");
+    mirror(i, "CONNECT", nullptr, 0);
+}
+
+
+// header length of WebSocket frame being parsed
+static int ws_header_len(const struct http *h)
+{
+    int n = 2;
+
+    if (h->ws_hdr_len < 2)
+        return n;
+
+    if ((h->ws_hdr[1] & 0x7F) == 126)
+        n += 2;
+    else if ((h->ws_hdr[1] & 0x7F) == 127)
+        n += 8;
+
+    if (h->ws_hdr[1] & 0x80)
+        n += 4;
+
+    return n;
+}
+
+
+// read WebSocket frames, data payload is unmasked in place into
+// buffer, returns payload length
+//  * ping is answered with pong, close is echoed and socket closed
+//  * frames of 4GB and more are closed with 1009 (message too big)
+static int ws_read(int i, int len)
+{
+    struct http *h = &http[i];
+    uint8_t *p = (uint8_t *)buffer;
+    int n = client[i]->read(p, len);
+    int out = 0;
+
+    for (int k = 0; k < n; ) {
+        if (!h->ws_payload) {
+            int hl;
+
+            h->ws_hdr[h->ws_hdr_len++] = p[k++];
+            hl = ws_header_len(h);
+            if (h->ws_hdr_len < hl)
+                continue;
+
+            // frame header is complete
+            h->ws_op = h->ws_hdr[0] & 0x0F;
+            h->ws_left = h->ws_hdr[1] & 0x7F;
+            if (h->ws_left == 126)
+                h->ws_left = h->ws_hdr[2] << 8 | h->ws_hdr[3];
+            else if (h->ws_left == 127)
+                h->ws_left = (uint32_t)h->ws_hdr[6] << 24 | h->ws_hdr[7] << 16 | h->ws_hdr[8] << 8 | h->ws_hdr[9];
+
+            // 64 bit length does not fit ws_left
+            if ((h->ws_hdr[1] & 0x7F) == 127 && (h->ws_hdr[2] | h->ws_hdr[3] | h->ws_hdr[4] | h->ws_hdr[5])) {
+                static const uint8_t too_big[2] = { 1009 >> 8, 1009 & 0xFF };
+
+                ws_control(i, 0x8, too_big, sizeof(too_big));
+                client[i]->stop();
+                h->ws_hdr_len = 0;
+                break;
+            }
+
+            if (h->ws_hdr[1] & 0x80)
+                memcpy(h->ws_mask, h->ws_hdr + hl - 4, 4);
+            else
+                memset(h->ws_mask, 0, 4);
+
+            h->ws_hdr_len = 0;
+            h->ws_pos = 0;
+            h->ws_ctl_len = 0;
+            h->ws_payload = true;
+        } else {
+            uint8_t c = p[k++] ^ h->ws_mask[h->ws_pos++ & 3];
+
+            h->ws_left--;
+            if (!(h->ws_op & 0x08))
+                p[out++] = c;
+            else if (h->ws_ctl_len < WS_CTL)
+                h->ws_ctl[h->ws_ctl_len++] = c;
+        }
+
+        if (!h->ws_payload || h->ws_left > 0)
+            continue;
+
+        // frame is complete
+        h->ws_payload = false;
+
+        if (h->ws_op == 0x9) {
+            ws_control(i, 0xA, h->ws_ctl, h->ws_ctl_len);
+        } else if (h->ws_op == 0x8) {
+            ws_control(i, 0x8, h->ws_ctl, h->ws_ctl_len < 2 ? h->ws_ctl_len : 2);
+            client[i]->stop();
+            break;
+        }
+    }
+
+    return out;
+}
+
+
+// append string to output
+static char *http_put(char *out, const char *str, int len)
+{
+    memcpy(out, str, len);
+    return out + len;
+}
+
+
+// wrap len bytes at data into chunk at out, data may be at out + 8
+static char *http_chunk(char *out, const char *data, int len)
+{
+    char hdr[8];
+    int k;
+
+    if (len == 0)
+        return out;
+
+    k = put_str(put_hex(hdr, len), "\r\n") - hdr;
+    memmove(out + k, data, len);
+    memcpy(out, hdr, k);
+    return http_put(out + k + len, "\r\n", 2);
+}
+
+
+// compress response body into out
+static char *gzip_body(int i, const char *src, int len, char *out)
+{
+    struct http *h = &http[i];
+    uint32_t start = micros();
+    char *p = h->resp_chunked ? out + 8 : out;
+    int m = gzip_deflate(h->gz, src, len, (uint8_t *)p);
+
+    gzip_stats[i].in += len;
+    gzip_stats[i].out += m;
+    gzip_stats[i].us += micros() - start;
+
+    if (h->resp_chunked)
+        return http_chunk(out, p, m);
+
+    return out + m;
+}
+
+
+// finish compressed response body on HTTP link
+static void gzip_end(int i)
+{
+    struct http *h = &http[i];
+    char out[48];
+    int m;
+
+    m = gzip_finish(h->gz, (uint8_t *)out + 8);
+    gzip_stats[i].out += m;
+
+    if (h->resp_chunked)
+        m = http_chunk(out, out + 8, m) - out;
+    else
+        memmove(out, out + 8, m);
+
+    client[i]->write((uint8_t *)out, m);
+    gzip_free(i);
+}
+
+
+// count response body from MCU against Content-Length or the
+// chunks of its own chunked encoding
+static void http_body(struct http *h, const char *src, int len)
+{
+    int n = 0;
+
+    if (!h->resp_te) {
+        h->resp_left -= (uint32_t)len < h->resp_left ? len : h->resp_left;
+        return;
+    }
+
+    while (n < len && h->resp_chunk != CHUNK_END) {
+        char c;
+
+        if (h->resp_chunk == CHUNK_DATA) {
+            uint32_t k = len - n;
+
+            if (k > h->resp_left)
+                k = h->resp_left;
+
+            n += k;
+            h->resp_left -= k;
+            if (h->resp_left == 0)
+                h->resp_chunk = CHUNK_CRLF;
+            continue;
+        }
+
+        c = src[n++];
+
+        switch (h->resp_chunk) {
+        case CHUNK_SIZE:
+        case CHUNK_EXT:
+            if (c == '\n')
+                h->resp_chunk = h->resp_left > 0 ? CHUNK_DATA : CHUNK_TRAILER;
+            else if (h->resp_chunk == CHUNK_SIZE && isxdigit(c))
+                h->resp_left = h->resp_left << 4 | (isdigit(c) ? c - '0' : (c | 0x20) - 'a' + 10);
+            else
+                h->resp_chunk = CHUNK_EXT;
+            break;
+
+        case CHUNK_CRLF:
+            if (c == '\n')
+                h->resp_chunk = CHUNK_SIZE;
+            break;
+
+        // resp_left counts trailer line length
+        case CHUNK_TRAILER:
+            if (c == '\n') {
+                if (h->resp_left == 0)
+                    h->resp_chunk = CHUNK_END;
+                h->resp_left = 0;
+            } else if (c != '\r') {
+                h->resp_left++;
+            }
+            break;
+        }
+    }
+}
+
+
+// MCU sent all of the body its headers declared
+static bool http_body_done(struct http *h)
+{
+    return h->resp == HTTP_BODY && h->resp_left == 0 && (!h->resp_te || h->resp_chunk == CHUNK_END);
+}
+
+
+// rewrite response data from MCU for keep-alive socket into dst,
+// returns output length, dst must have room for HTTP_RESPONSE_MAX(len)
+//  * Connection header is replaced with our own
+//  * body without length is wrapped into chunks
+//  * body is compressed if client accepts gzip
+static int http_response(int i, const char *src, int len, char *dst)
+{
+    struct http *h = &http[i];
+    char *out = dst;
+    int n = 0;
+
+    while (n < len) {
+        char c;
+
+        // response body
+        if (h->resp == HTTP_BODY) {
+            http_body(h, src + n, len - n);
+
+            if (h->gz != nullptr) {
+                out = gzip_body(i, src + n, len - n, out);
+            } else if (h->resp_chunked) {
+                out = put_str(put_hex(out, len - n), "\r\n");
+                out = http_put(out, src + n, len - n);
+                out = http_put(out, "\r\n", 2);
+            } else {
+                out = http_put(out, src + n, len - n);
+            }
+            break;
+        }
+
+        c = src[n++];
+
+        // long header line
+        if (h->resp_pass) {
+            *out++ = c;
+            if (c == '\n')
+                h->resp_pass = false;
+            continue;
+        }
+
+        if (c != '\n') {
+            if (h->resp_len < HTTP_LINE - 1) {
+                h->resp_line[h->resp_len++] = c;
+            } else {
+                out = http_put(out, h->resp_line, h->resp_len);
+                *out++ = c;
+                h->resp_len = 0;
+                h->resp_pass = true;
+            }
+            continue;
+        }
+
+        h->resp_line[h->resp_len] = '\0';
+
+        if (h->resp == HTTP_LINE_START) {
+            unsigned status = 0;
+
+            sscanf(h->resp_line, "HTTP/%*u.%*u %u", &status);
+            h->status = status;
+            h->resp = HTTP_HEADERS;
+
+            // keep-alive and chunked encoding need HTTP/1.1
+            if (h->keepalive && !strncmp(h->resp_line, "HTTP/1.0", 8))
+                h->resp_line[7] = '1';
+        } else if (h->resp_len == 0 || (h->resp_len == 1 && h->resp_line[0] == '\r')) {
+            // end of headers, add framing for keep-alive
+            bool body = !h->head && h->status >= 200 && h->status != 204 && h->status != 304;
+
+            // declared length does not apply without body
+            if (!body) {
+                h->resp_left = 0;
+                h->resp_te = false;
+            }
+
+            if (body && h->req_gzip && gzip_enabled && !h->resp_plain)
+                h->gz = gzip_alloc();
+
+            if (h->gz != nullptr) {
+                h->resp_length = false;
+                out = http_put(out, "Content-Encoding: gzip\r\nVary: Accept-Encoding\r\n", 47);
+            } else if (h->resp_clen > 0) {
+                out = put_str(out, "Content-Length: ");
+                out = put_str(put_uint(out, h->resp_clen - 1), "\r\n");
+            }
+
+            if (body && !h->resp_length) {
+                if (h->keepalive) {
+                    h->resp_chunked = true;
+                    out = http_put(out, "Transfer-Encoding: chunked\r\n", 28);
+                }
+            }
+
+            if (!h->keepalive)
+                out = http_put(out, "Connection: close\r\n", 19);
+
+            if (h->age > 0) {
+                out = put_str(out, "Age: ");
+                out = put_str(put_uint(out, h->age - 1), "\r\n");
+            }
+
+            h->resp = HTTP_BODY;
+        } else if (http_header(h->resp_line, "connection:")) {
+            h->resp_len = 0;
+            continue;
+        } else if (http_header(h->resp_line, "content-length:")) {
+            h->resp_length = true;
+            h->resp_left = strtoul(h->resp_line + 15, nullptr, 10);
+
+            // held back until it is known if body is compressed
+            if (h->req_gzip && gzip_enabled) {
+                h->resp_clen = strtoul(h->resp_line + 15, nullptr, 10) + 1;
+                h->resp_len = 0;
+                continue;
+            }
+        } else if (http_header(h->resp_line, "transfer-encoding:")) {
+            h->resp_length = true;
+            h->resp_plain = true;
+            h->resp_te = strcasestr(h->resp_line, "chunked") != nullptr;
+        } else if (http_header(h->resp_line, "content-encoding:")) {
+            h->resp_plain = true;
+        } else if (http_header(h->resp_line, "content-type:")) {
+            if (gzip_plain_type(h->resp_line + 13))
+                h->resp_plain = true;
+        }
+
+        out = http_put(out, h->resp_line, h->resp_len);
+        *out++ = '\n';
+        h->resp_len = 0;
+    }
+
+    return out - dst;
+}
+
+
+// MCU closed HTTP link, returns true if socket is kept for the
+// next request
+static bool http_close(int i)
+{
+    struct http *h = &http[i];
+
+    // compressed body ends also on closing socket
+    if (h->gz != nullptr)
+        gzip_end(i);
+
+    // WebSocket closes with normal closure
+    if (h->state == HTTP_WS) {
+        uint8_t code[2] = { 1000 >> 8, 1000 & 0xFF };
+        ws_control(i, 0x8, code, sizeof(code));
+        return false;
+    }
+
+    // stale copy was already sent
+    if (h->detached) {
+        if (!h->keepalive)
+            return false;
+        h->state = HTTP_IDLE;
+        h->announced = false;
+        h->since = millis();
+        return true;
+    }
+
+    // body cut short is ended by closing the socket, client would
+    // otherwise wait for the rest or take the next response as body
+    if (!h->keepalive || h->state != HTTP_WAIT || !http_body_done(h))
+        return false;
+
+    if (h->resp_chunked)
+        client[i]->write((uint8_t *)"0\r\n\r\n", 5);
+
+    h->state = HTTP_IDLE;
+    h->announced = false;
+    h->since = millis();
+    http_reused++;
+
+    return true;
+}
+
+
+// free oldest idle HTTP link which makes room on servers[n],
+// prefer links of servers[n]
+//  * at its quota servers[n] can only take over its own links
+//  * link of another port is freed only if that port holds more
+//    than its reservation, otherwise the link stays reserved
+static bool http_evict(int n)
+{
+    bool full = servers[n].cfg.quota > 0 && servers[n].links >= servers[n].cfg.quota;
+    int victim = -1;
+
+    for (uint32_t m = link_used; m != 0; m &= m - 1) {
+        int i = __builtin_ctz(m);
+        int s = link_server[i];
+
+        if (!http_link(i) || http[i].state != HTTP_IDLE || s == LINK_INTERNAL)
+            continue;
+
+        if (s != n && (full || servers[s].links <= servers[s].cfg.reserved))
+            continue;
+
+        if (victim < 0 ||
+            (link_server[i] == n && link_server[victim] != n) ||
+            ((link_server[i] == n) == (link_server[victim] == n) &&
+             (int32_t)(http[i].since - http[victim].since) < 0))
+            victim = i;
+    }
+
+    if (victim < 0)
+        return false;
+
+    link_free(victim);
+    return true;
+}
+
+
+// find cached response for path
+static struct cache *cache_find(uint32_t path, const char *url)
+{
+    for (int i = 0; i < CACHE_ENTRIES; i++)
+        if (cache[i].path == path && cache[i].data != nullptr && !strcmp(cache[i].url, url))
+            return &cache[i];
+
+    return nullptr;
+}
+
+
+// store response, replaces entry for the same path or the oldest one
+static void cache_store(uint32_t path, const char *url, char *data, int len)
+{
+    struct cache *c = cache_find(path, url);
+
+    if (c == nullptr) {
+        c = &cache[0];
+        for (int i = 1; i < CACHE_ENTRIES; i++)
+            if (cache[i].data == nullptr || (c->data != nullptr && (int32_t)(cache[i].time - c->time) < 0))
+                c = &cache[i];
+    }
+
+    free(c->data);
+    c->path = path;
+    strcpy(c->url, url);
+    c->time = millis();
+    c->len = len;
+    c->data = data;
+}
+
+
+// append MCU response data to link capture
+static void cache_capture(int i, const char *data, int len)
+{
+    struct http *h = &http[i];
+    char *cap;
+
+    if (!h->get || h->cap_len < 0)
+        return;
+
+    // too long for cache, or captures would take heap needed elsewhere
+    if (h->cap_len + len > CACHE_ENTRY_MAX || cache_captured + len > CACHE_CAPTURE_MAX ||
+        ESP.getFreeHeap() < CACHE_HEAP_MIN + (uint32_t)len) {
+        cache_release(h);
+        h->cap_len = -1;
+        return;
+    }
+
+    cap = (char *)realloc(h->cap, h->cap_len + len);
+    if (cap == nullptr) {
+        cache_release(h);
+        h->cap_len = -1;
+        return;
+    }
+
+    memcpy(cap + h->cap_len, data, len);
+    h->cap = cap;
+    h->cap_len += len;
+    cache_captured += len;
+}
+
+
+// append to snapshot document, as JSON string if quote, keeps room
+// for null and closing braces, returns false if it doesn't fit
+static bool snap_put(int *pos, const char *s, int len, bool quote)
+{
+    int n = *pos;
+
+    if (quote)
+        snap_doc[n++] = '"';
+
+    for (int k = 0; k < len; k++) {
+        uint8_t c = s[k];
+
+        if (n + 8 > SNAP_MAX - 16)
+            return false;
+
+        if (quote && (c == '"' || c == '\\')) {
+            snap_doc[n++] = '\\';
+            snap_doc[n++] = c;
+        } else if (quote && c < 0x20) {
+            n += snprintf(snap_doc + n, 7, "\\u%04x", c);
+        } else {
+            snap_doc[n++] = c;
+        }
+    }
+
+    if (quote)
+        snap_doc[n++] = '"';
+
+    *pos = n;
+    return true;
+}
+
+
+// skip JSON whitespace
+static int snap_ws(const char *s, int len, int k)
+{
+    while (k < len && (s[k] == ' ' || s[k] == '\t' || s[k] == '\r' || s[k] == '\n'))
+        k++;
+
+    return k;
+}
+
+
+// JSON value at s + k by RFC 8259 grammar, returns position after
+// it or -1, nesting is limited to depth
+static int snap_value(const char *s, int len, int k, int depth)
+{
+    if (k >= len || depth == 0)
+        return -1;
+
+    switch (s[k]) {
+    case '"':
+        for (k++; k < len && s[k] != '"'; k++) {
+            if ((uint8_t)s[k] < 0x20)
+                return -1;
+            if (s[k] != '\\')
+                continue;
+            if (++k == len)
+                return -1;
+            if (s[k] == 'u') {
+                for (int n = 0; n < 4; n++)
+                    if (++k == len || !isxdigit((uint8_t)s[k]))
+                        return -1;
+            } else if (s[k] == '\0' || strchr("\"\\/bfnrt", s[k]) == nullptr) {
+                return -1;
+            }
+        }
+        return k < len ? k + 1 : -1;
+
+    case '{':
+    case '[': {
+        char close = s[k] == '{' ? '}' : ']';
+
+        k = snap_ws(s, len, k + 1);
+        if (k < len && s[k] == close)
+            return k + 1;
+
+        for (;;) {
+            if (close == '}') {
+                if (k >= len || s[k] != '"' || (k = snap_value(s, len, k, 1)) < 0)
+                    return -1;
+                k = snap_ws(s, len, k);
+                if (k >= len || s[k] != ':')
+                    return -1;
+                k = snap_ws(s, len, k + 1);
+            }
+
+            k = snap_value(s, len, k, depth - 1);
+            if (k < 0)
+                return -1;
+            k = snap_ws(s, len, k);
+
+            if (k < len && s[k] == close)
+                return k + 1;
+            if (k >= len || s[k] != ',')
+                return -1;
+            k = snap_ws(s, len, k + 1);
+        }
+    }
+
+    case 't':
+        return len - k >= 4 && !memcmp(s + k, "true", 4) ? k + 4 : -1;
+    case 'f':
+        return len - k >= 5 && !memcmp(s + k, "false", 5) ? k + 5 : -1;
+    case 'n':
+        return len - k >= 4 && !memcmp(s + k, "null", 4) ? k + 4 : -1;
+    }
+
+    // number: -?(0|[1-9][0-9]*)(.[0-9]+)?([eE][+-]?[0-9]+)?
+    if (s[k] == '-')
+        k++;
+    if (k < len && s[k] == '0')
+        k++;
+    else if (k < len && isdigit((uint8_t)s[k]))
+        while (k < len && isdigit((uint8_t)s[k]))
+            k++;
+    else
+        return -1;
+
+    if (k < len && s[k] == '.') {
+        if (++k == len || !isdigit((uint8_t)s[k]))
+            return -1;
+        while (k < len && isdigit((uint8_t)s[k]))
+            k++;
+    }
+
+    if (k < len && (s[k] == 'e' || s[k] == 'E')) {
+        if (++k < len && (s[k] == '+' || s[k] == '-'))
+            k++;
+        if (k == len || !isdigit((uint8_t)s[k]))
+            return -1;
+        while (k < len && isdigit((uint8_t)s[k]))
+            k++;
+    }
+
+    return k;
+}
+
+
+// body is one JSON value with optional whitespace around, a body
+// failing it is embedded as string
+static bool snap_json(const char *s, int len)
+{
+    int k = snap_value(s, len, snap_ws(s, len, 0), 32);
+
+    return k >= 0 && snap_ws(s, len, k) == len;
+}
+
+
+// rebuild snapshot document:
+// {"uptime":<ms>,"values":{"<path>":{"time":<ms>,"value":<body>},...}}
+static void snap_build()
+{
+    int pos;
+
+    // snapshot disabled, /snapshot answers 503
+    if (snap_count == 0) {
+        free(snap_doc);
+        snap_doc = nullptr;
+        snap_len = 0;
+        return;
+    }
+
+    if (snap_doc == nullptr)
+        snap_doc = (char *)malloc(SNAP_MAX);
+    if (snap_doc == nullptr)
+        return;
+
+    pos = snprintf(snap_doc, SNAP_MAX, "{\"uptime\":%llu,\"values\":{", (unsigned long long)millis64());
+
+    for (int k = 0; k < snap_count; k++) {
+        struct snap_value *v = &snap_values[k];
+        int mark = pos;
+        char time[32];
+
+        if (k > 0)
+            snap_doc[pos++] = ',';
+
+        // path and time or null, value doesn't fit
+        if (!snap_put(&pos, snap[k].path, strlen(snap[k].path), true)) {
+            pos = mark;
+            break;
+        }
+
+        if (v->body == nullptr) {
+            pos += snprintf(snap_doc + pos, SNAP_MAX - pos, ":null");
+            continue;
+        }
+
+        mark = pos;
+        snprintf(time, sizeof(time), ":{\"time\":%llu,\"value\":", (unsigned long long)v->time);
+        if (!snap_put(&pos, time, strlen(time), false) || !snap_put(&pos, v->body, v->len, !v->json)) {
+            pos = mark;
+            pos += snprintf(snap_doc + pos, SNAP_MAX - pos, ":null");
+            continue;
+        }
+        snap_doc[pos++] = '}';
+    }
+
+    pos += snprintf(snap_doc + pos, SNAP_MAX - pos, "}}");
+    snap_len = pos;
+}
+
+
+// remove chunk framing from body in place, returns body length or
+// -1 if framing is broken or cut short
+static int snap_dechunk(char *p, int len)
+{
+    int in = 0;
+    int out = 0;
+
+    for (;;) {
+        uint32_t size = 0;
+        int start = in;
+
+        for (; in < len && isxdigit((uint8_t)p[in]) && in - start < 8; in++)
+            size = size * 16 + (isdigit((uint8_t)p[in]) ? p[in] - '0' : (p[in] | 0x20) - 'a' + 10);
+        if (in == start)
+            return -1;
+
+        // chunk extensions are skipped with the line
+        while (in < len && p[in] != '\n')
+            in++;
+        if (in++ == len)
+            return -1;
+
+        if (size == 0)
+            return out;
+
+        if (size + 2 > (uint32_t)(len - in) || memcmp(p + in + size, "\r\n", 2))
+            return -1;
+
+        memmove(p + out, p + in, size);
+        out += size;
+        in += size + 2;
+    }
+}
+
+
+// keep body of MCU response for snap[k], takes data
+static void snap_store(int k, char *data, int len)
+{
+    struct snap_value *v = &snap_values[k];
+    char *body;
+    char *end;
+    char *type;
+    char *te;
+
+    for (end = data; end + 4 <= data + len; end++)
+        if (!memcmp(end, "\r\n\r\n", 4))
+            break;
+
+    if (end + 4 > data + len) {
+        free(data);
+        return;
+    }
+
+    *end = '\0';
+    type = strcasestr(data, "\r\nContent-Type:");
+    v->json = type != nullptr && strncasecmp(type + 15 + strspn(type + 15, " "), "application/json", 16) == 0;
+
+    len = data + len - (end + 4);
+    te = strcasestr(data, "\r\nTransfer-Encoding:");
+    if (te != nullptr && strncasecmp(te + 20 + strspn(te + 20, " "), "chunked", 7) == 0)
+        len = snap_dechunk(end + 4, len);
+
+    if (len < 0 || len > SNAP_VALUE_MAX) {
+        free(data);
+        return;
+    }
+
+    memmove(data, end + 4, len);
+    body = (char *)realloc(data, len > 0 ? len : 1);
+    v->json = v->json && snap_json(body != nullptr ? body : data, len);
+
+    free(v->body);
+    v->body = body != nullptr ? body : data;
+    v->len = len;
+    v->time = millis64();
+
+    snap_build();
+}
+
+
+// status code of captured response, capture is not terminated
+static unsigned cache_status(const char *p, int len)
+{
+    unsigned status = 0;
+    int n = 5;
+
+    if (len < 12 || memcmp(p, "HTTP/", 5))
+        return 0;
+
+    while (n < len && p[n] != ' ')
+        n++;
+
+    for (n++; n < len && p[n] >= '0' && p[n] <= '9' && status < 1000; n++)
+        status = status * 10 + p[n] - '0';
+
+    return status;
+}
+
+
+// response is complete, keep it if MCU answered 200
+static void cache_commit(int i)
+{
+    struct http *h = &http[i];
+    char *cap = h->cap;
+    int len = h->cap_len;
+
+    // response cut short is not cached, body is counted only
+    // on its way to a client
+    if (cap == nullptr || cache_status(cap, len) != 200 || (!h->detached && !http_body_done(h)) || (i == warm_link && snap_pending == SNAP_DISCARD)) {
+        cache_release(h);
+        return;
+    }
+
+    // capture becomes cache entry or snapshot value
+    h->cap = nullptr;
+    cache_release(h);
+
+    if (i == warm_link && snap_pending >= 0)
+        snap_store(snap_pending, cap, len);
+    else
+        cache_store(h->path, h->url, cap, len);
+}
+
+
+// send cached response to HTTP link, returns false if there is none
+static bool cache_serve(int i)
+{
+    struct http *h = &http[i];
+    struct cache *c;
+    int off, n;
+
+    if (!h->get)
+        return false;
+
+    c = cache_find(h->path, h->url);
+    if (c == nullptr)
+        return false;
+
+    // frame stored response for this socket
+    h->resp = HTTP_LINE_START;
+    h->resp_length = false;
+    h->resp_chunked = false;
+    h->resp_pass = false;
+    h->resp_plain = false;
+    h->resp_clen = 0;
+    h->resp_te = false;
+    h->resp_chunk = CHUNK_SIZE;
+    h->resp_left = 0;
+    h->resp_len = 0;
+    h->age = (millis() - c->time) / 1000 + 1;
+
+    for (off = 0; off < c->len; off += n) {
+        n = c->len - off;
+        if (n > (int)sizeof(send_buffer))
+            n = sizeof(send_buffer);
+
+        client[i]->write((uint8_t *)http_buffer, http_response(i, c->data + off, n, http_buffer));
+    }
+
+    if (h->gz != nullptr)
+        gzip_end(i);
+
+    if (h->resp_chunked)
+        client[i]->write((uint8_t *)"0\r\n\r\n", 5);
+
+    cache_served++;
+
+    return true;
+}
+
+
+// open circuit breaker, cooldown starts when it opens, not when
+// it is tripped again while open
+static void breaker_trip()
+{
+    if (breaker == BREAKER_OPEN)
+        return;
+
+    breaker_trips++;
+    breaker = BREAKER_OPEN;
+    breaker_since = millis();
+    breaker_probe = -1;
+}
+
+
+// record MCU response time for link
+static void latency_record(int i)
+{
+    uint32_t now = millis();
+    uint32_t ms = now - http[i].since;
+    int b = 0;
+
+    http[i].responded = true;
+
+    // roll histogram window
+    if (now - latency_window >= LATENCY_WINDOW) {
+        memcpy(latency_hist[1], latency_hist[0], sizeof(latency_hist[0]));
+        memset(latency_hist[0], 0, sizeof(latency_hist[0]));
+        latency_window = now;
+    }
+
+    while (b < LATENCY_BUCKETS - 1 && ms >= (1U << b))
+        b++;
+    latency_hist[0][b]++;
+
+    latency_avg = (latency_avg * 7 + ms) / 8;
+
+    // probe request decides breaker state
+    if (breaker == BREAKER_HALF && i == breaker_probe) {
+        if (ms < breaker_latency) {
+            breaker = BREAKER_CLOSED;
+            latency_avg = ms;
+        } else {
+            breaker_trip();
+        }
+    }
+}
+
+
+// check MCU state before forwarding new HTTP request,
+// returns false if request should be rejected
+static bool breaker_allow(int link)
+{
+    uint32_t now = millis();
+    int pending = 0;
+
+    if (breaker_latency == 0)
+        return true;
+
+    // pending requests and the oldest one
+    for (uint32_t m = link_used; m != 0; m &= m - 1) {
+        int i = __builtin_ctz(m);
+
+        if (!http_link(i) || !http[i].announced)
+            continue;
+
+        if (http[i].state == HTTP_IDLE || http[i].state == HTTP_WS || http[i].responded)
+            continue;
+
+        // a stalled request trips breaker once, it would otherwise
+        // trip every probe and keep breaker open until it is answered
+        pending++;
+        if (!http[i].late && now - http[i].since >= breaker_latency) {
+            http[i].late = true;
+            breaker_trip();
+        }
+    }
+
+    if (breaker == BREAKER_CLOSED) {
+        if (latency_avg >= breaker_latency || pending >= breaker_backlog)
+            breaker_trip();
+        else
+            return true;
+    }
+
+    // half open: probe is pending or gone without response
+    if (breaker == BREAKER_HALF) {
+        if (breaker_probe >= 0 && client[breaker_probe] != nullptr &&
+            http[breaker_probe].state != HTTP_IDLE)
+            return false;
+        breaker_trip();
+    }
+
+    // cooldown passed, let one probe through
+    if (now - breaker_since >= breaker_cooldown) {
+        breaker = BREAKER_HALF;
+        breaker_probe = link;
+        return true;
+    }
+
+    return false;
+}
+
+
+// answer request from cache, or with 503 if there is no copy
+static void http_local(int i)
+{
+    char buf[128];
+    int n;
+
+    if (!cache_serve(i)) {
+        n = snprintf(buf, sizeof(buf),
+            "HTTP/1.1 503 Service Unavailable\r\nRetry-After: %u\r\nContent-Length: 0\r\n%s\r\n",
+            (breaker_cooldown + 999) / 1000, http[i].keepalive ? "" : "Connection: close\r\n");
+
+        client[i]->write((uint8_t *)buf, n);
+        breaker_rejected++;
+    }
+
+    if (!http[i].keepalive) {
+        link_free(i);
+        return;
+    }
+
+    http[i].state = HTTP_IDLE;
+    http[i].since = millis();
+
+    if (client[i]->available() > 0)
+        http_pipelined++;
+}
+
+
+// FNV-1a hash of path, same as computed by http_request()
+static uint32_t path_hash(const char *path)
+{
+    uint32_t hash = 2166136261;
+
+    while (*path != '\0')
+        hash = (hash ^ (uint8_t)*path++) * 16777619;
+
+    return hash;
+}
+
+
+// request is for warmed path with fresh copy in cache
+static bool warm_hit(int i)
+{
+    struct cache *c;
+
+    if (warm_interval == 0 || !http[i].get)
+        return false;
+
+    for (int j = 0; j < warm_count; j++) {
+        if (warm[j].hash != http[i].path || strcmp(warm[j].path, http[i].url))
+            continue;
+
+        c = cache_find(http[i].path, http[i].url);
+        return c != nullptr && millis() - c->time < 2 * warm_interval;
+    }
+
+    return false;
+}
+
+
+// CRC-16/CCITT-FALSE of binary frame
+static uint16_t bin_crc(const uint8_t *data, size_t len)
+{
+    static const uint16_t crc_nibble[16] = {
+        0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+        0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF,
+    };
+    uint16_t crc = 0xFFFF;
+
+    while (len-- > 0) {
+        crc = (crc << 4) ^ crc_nibble[(crc >> 12) ^ (*data >> 4)];
+        crc = (crc << 4) ^ crc_nibble[(crc >> 12) ^ (*data++ & 15)];
+    }
+
+    return crc;
+}
+
+
+// write frame with current ack and crc, COBS encoded,
+// frame needs 2 spare bytes for crc
+static void bin_write(uint8_t *frame, size_t len)
+{
+    uint16_t crc;
+    size_t p = 0;
+
+    frame[2] = bin_rx_seq;
+    crc = bin_crc(frame, len);
+    frame[len++] = crc;
+    frame[len++] = crc >> 8;
+
+    // blocks of up to 254 non-zero bytes, zero is implied between blocks
+    for (;;) {
+        uint8_t code;
+        size_t run = 0;
+
+        while (p + run < len && frame[p + run] != 0 && run < 254)
+            run++;
+
+        code = run + 1;
+        Serial.write(&code, 1);
+        Serial.write(frame + p, run);
+        bin_tx_bytes += run + 1;
+        p += run;
+
+        if (p == len)
+            break;
+        if (run < 254)
+            p++;
+    }
+
+    Serial.write((uint8_t)0);
+    bin_tx_bytes++;
+    bin_ack_due = false;
+}
+
+
+// send frame through window, false if window is full
+static bool bin_send(uint8_t type, int link, const char *data, size_t len)
+{
+    uint8_t *f;
+    size_t n = 4;
+    int s;
+
+    if (bin_tx_count == BIN_WINDOW)
+        return false;
+
+    s = (uint8_t)(bin_tx_seq + bin_tx_count) % BIN_WINDOW;
+    f = (uint8_t *)input_buffer + s * BIN_SLOT;
+    f[0] = type;
+    f[1] = bin_tx_seq + bin_tx_count;
+    f[3] = link;
+    for (size_t v = len; ; v >>= 7) {
+        f[n++] = (v > 0x7F ? 0x80 : 0) | (v & 0x7F);
+        if (v <= 0x7F)
+            break;
+    }
+    memcpy(f + n, data, len);
+    bin_tx_len[s] = n + len;
+
+    if (bin_tx_count++ == 0)
+        bin_tx_time = millis();
+    bin_tx_data += len;
+    bin_write(f, n + len);
+    return true;
+}
+
+
+// send pending CLOSE and CONNECT of link before its data
+static void bin_flush(int i)
+{
+    if ((bin_close & (1U << i)) && bin_send(BIN_CLOSE, i, nullptr, 0))
+        bin_close &= ~(1U << i);
+
+    if (!(bin_close & (1U << i)) && (bin_connect & (1U << i)) && bin_send(BIN_CONNECT, i, nullptr, 0))
+        bin_connect &= ~(1U << i);
+}
+
+
+// window has room for link data, HTTP link may need CONNECT first
+static bool bin_ready(int i)
+{
+    bin_flush(i);
+    return !bin_exit && BIN_WINDOW - bin_tx_count >= (http_link(i) ? 2 : 1);
+}
+
+
+// hand received link data to MCU
+static void link_ipd(int i, const char *data, int len)
+{
+    mirror(i, "IPD", data, len);
+
+    if (bin_mode) {
+        bin_flush(i);
+        bin_send(BIN_DATA, i, data, len);
+        return;
+    }
+
+    urc_ipd(i, len);
+    Serial.write(data, len);
+    Serial.print(F("\r\nOK\r\n"));
+}
+
+
+// parse <interval ms>[,"<path>"...] into w,
+// returns number of paths or -1 on error
+static int warm_paths(char *src, int *interval, struct warm *w, int max)
+{
+    int n = 0;
+
+    *interval = strtol(src, &src, 10);
+    if (*interval < 0)
+        return -1;
+
+    while (*src == ',') {
+        char *end;
+
+        if (n == max || src[1] != '"')
+            return -1;
+
+        src += 2;
+        end = strchr(src, '"');
+        if (end == nullptr || end == src || end - src >= (int)sizeof(w[n].path))
+            return -1;
+
+        memcpy(w[n].path, src, end - src);
+        w[n].path[end - src] = '\0';
+        w[n].hash = path_hash(w[n].path);
+        w[n].time = millis() - *interval;
+        n++;
+        src = end + 1;
+    }
+
+    return *src == '\0' ? n : -1;
+}
+
+
+// start ESP request for warmed path on internal link
+static void warm_request(struct warm *w)
+{
+    int i, l;
+
+    // CONNECT and request need binary window
+    if (bin_mode && (bin_exit || BIN_WINDOW - bin_tx_count < 2))
+        return;
+
+    i = link_alloc(LINK_INTERNAL);
+    if (i < 0)
+        return;
+
+    client[i] = new InternalClient();
+    link_server[i] = LINK_INTERNAL;
+    link_used |= 1U << i;
+    connected++;
+    warm_link = i;
+    w->time = millis();
+
+    l = snprintf(buffer, sizeof(buffer), "GET %s HTTP/1.1\r\nHost: %s\r\nConnection: close\r\n\r\n",
+        w->path, WiFi.localIP().toString().c_str());
+
+    // response goes to cache only
+    http_begin(i);
+    http_request(i, buffer, l);
+    http[i].since = millis();
+    http[i].announced = true;
+    http[i].detached = true;
+
+    urc_link(i, "CONNECT");
+    mirror(i, "CONNECT", nullptr, 0);
+    link_ipd(i, buffer, l);
+}
+
+
+// parse quoted AT argument with backslash escapes into dst,
+// src is left after closing quote
+static bool at_string(char **src, char *dst, size_t size)
+{
+    char *s = *src;
+    size_t n = 0;
+
+    if (*s++ != '"')
+        return false;
+
+    while (*s != '"' && *s != '\0') {
+        if (*s == '\\' && s[1] != '\0')
+            s++;
+        if (n == size - 1)
+            return false;
+        dst[n++] = *s++;
+    }
+
+    if (*s++ != '"')
+        return false;
+
+    dst[n] = '\0';
+    *src = s;
+
+    return true;
+}
+
+
+// MQTT remaining length
+static uint8_t *mqtt_varint(uint8_t *out, uint32_t len)
+{
+    do {
+        *out = len & 0x7F;
+        len >>= 7;
+        if (len > 0)
+            *out |= 0x80;
+        out++;
+    } while (len > 0);
+
+    return out;
+}
+
+
+// MQTT length prefixed string
+static uint8_t *mqtt_string(uint8_t *out, const char *str, int len)
+{
+    *out++ = len >> 8;
+    *out++ = len;
+    memcpy(out, str, len);
+    return out + len;
+}
+
+
+// write packet to broker
+static void mqtt_write(const uint8_t *packet, int len)
+{
+    mqtt_client->write(packet, len);
+    mqtt_tx_time = millis();
+}
+
+
+// next packet id, never 0
+static uint16_t mqtt_next_id()
+{
+    if (++mqtt_id == 0)
+        mqtt_id = 1;
+
+    return mqtt_id;
+}
+
+
+// send SUBSCRIBE for one topic
+static void mqtt_subscribe(const struct mqtt_sub *sub)
+{
+    uint8_t *packet = (uint8_t *)buffer;
+    uint8_t *out = packet;
+    uint16_t id = mqtt_next_id();
+    int len = strlen(sub->topic);
+
+    *out++ = 0x82;
+    out = mqtt_varint(out, 2 + 2 + len + 1);
+    *out++ = id >> 8;
+    *out++ = id;
+    out = mqtt_string(out, sub->topic, len);
+    *out++ = sub->qos;
+
+    mqtt_write(packet, out - packet);
+}
+
+
+// drop connect in progress, the address is resolved again next time
+static void mqtt_abort()
+{
+    if (mqtt_pcb != nullptr) {
+        tcp_err(mqtt_pcb, nullptr);
+        tcp_abort(mqtt_pcb);
+        mqtt_pcb = nullptr;
+    }
+
+    if (mqtt_ctx != nullptr) {
+        MqttClient(mqtt_ctx).stop();
+        mqtt_ctx = nullptr;
+    }
+
+    mqtt_tcp = MQTT_TCP_IDLE;
+    mqtt_addr_ok = false;
+    mqtt_since = millis();
+}
+
+
+// close broker connection, unacknowledged messages are sent again
+// with DUP flag after reconnect
+static void mqtt_close()
+{
+    if (mqtt_tcp != MQTT_TCP_IDLE)
+        mqtt_abort();
+
+    if (mqtt_client == nullptr)
+        return;
+
+    mqtt_client->stop();
+    delete mqtt_client;
+    mqtt_client = nullptr;
+    mqtt_since = millis();
+    mqtt_rx_len = 0;
+    mqtt_rx_skip = 0;
+
+    for (int n = 0; n < mqtt_count; n++) {
+        struct mqtt_msg *m = &mqtt_queue[(mqtt_head + n) % MQTT_QUEUE];
+
+        if (m->packet != nullptr && m->id != 0 && m->sent != 0) {
+            m->packet[0] |= 0x08;
+            m->sent = 0;
+        }
+    }
+
+    if (mqtt_state == MQTT_CONNECTED && !bin_mode)
+        Serial.print(F("+MQTTDISCONNECTED:0\r\n"));
+    mqtt_state = MQTT_DISCONNECTED;
+}
+
+
+// broker address from dns_gethostbyname(), lookups which outlived
+// their connect attempt are ignored
+static void mqtt_dns_found(const char *name, const ip_addr_t *addr, void *arg)
+{
+    if (mqtt_tcp != MQTT_TCP_DNS || strcmp(name, mqtt_cfg.host))
+        return;
+
+    if (addr == nullptr) {
+        mqtt_tcp = MQTT_TCP_FAILED;
+        return;
+    }
+
+    mqtt_addr = *addr;
+    mqtt_addr_ok = true;
+    mqtt_tcp = MQTT_TCP_RESOLVED;
+}
+
+
+// tcp_connect() finished, ClientContext takes over pcb callbacks
+// as in WiFiServer
+static err_t mqtt_tcp_connected(void *arg, struct tcp_pcb *pcb, err_t err)
+{
+    mqtt_pcb = nullptr;
+    mqtt_ctx = new ClientContext(pcb, nullptr, nullptr);
+    mqtt_tcp = MQTT_TCP_CONNECTED;
+    return ERR_OK;
+}
+
+
+// connect refused or reset, lwIP has freed the pcb
+static void mqtt_tcp_error(void *arg, err_t err)
+{
+    mqtt_pcb = nullptr;
+    mqtt_tcp = MQTT_TCP_FAILED;
+}
+
+
+// start broker connection, mqtt_poll() finishes it from task_mqtt()
+static bool mqtt_connect()
+{
+    mqtt_since = millis();
+
+    if (mqtt_addr_ok) {
+        mqtt_tcp = MQTT_TCP_RESOLVED;
+        return true;
+    }
+
+    // numeric and cached names resolve at once
+    mqtt_tcp = MQTT_TCP_DNS;
+    switch (dns_gethostbyname(mqtt_cfg.host, &mqtt_addr, mqtt_dns_found, nullptr)) {
+    case ERR_OK:
+        mqtt_addr_ok = true;
+        mqtt_tcp = MQTT_TCP_RESOLVED;
+        return true;
+    case ERR_INPROGRESS:
+        return true;
+    default:
+        mqtt_abort();
+        return false;
+    }
+}
+
+
+// send CONNECT on a new broker connection
+static void mqtt_hello()
+{
+    uint8_t *packet = (uint8_t *)buffer;
+    uint8_t *out = packet;
+    int id = strlen(mqtt_cfg.client_id);
+    int user = strlen(mqtt_cfg.username);
+    int pass = strlen(mqtt_cfg.password);
+    uint8_t flags = 0x02;  // clean session
+
+    if (user > 0)
+        flags |= 0x80;
+    if (pass > 0)
+        flags |= 0x40;
+
+    *out++ = 0x10;
+    out = mqtt_varint(out, 10 + 2 + id + (user > 0 ? 2 + user : 0) + (pass > 0 ? 2 + pass : 0));
+    out = mqtt_string(out, "MQTT", 4);
+    *out++ = 4;  // protocol level 3.1.1
+    *out++ = flags;
+    *out++ = MQTT_KEEPALIVE >> 8;
+    *out++ = MQTT_KEEPALIVE & 0xFF;
+    out = mqtt_string(out, mqtt_cfg.client_id, id);
+    if (user > 0)
+        out = mqtt_string(out, mqtt_cfg.username, user);
+    if (pass > 0)
+        out = mqtt_string(out, mqtt_cfg.password, pass);
+
+    mqtt_rx_time = millis();
+    mqtt_write(packet, out - packet);
+}
+
+
+// advance connect started by mqtt_connect(), gives up after
+// MQTT_CONNECT
+static void mqtt_poll()
+{
+    switch (mqtt_tcp) {
+    case MQTT_TCP_RESOLVED:
+        mqtt_pcb = tcp_new();
+        if (mqtt_pcb == nullptr)
+            break;
+
+        tcp_err(mqtt_pcb, mqtt_tcp_error);
+        if (tcp_connect(mqtt_pcb, &mqtt_addr, mqtt_cfg.port, mqtt_tcp_connected) != ERR_OK)
+            break;
+        mqtt_tcp = MQTT_TCP_CONNECTING;
+        return;
+
+    case MQTT_TCP_CONNECTED:
+        mqtt_client = new MqttClient(mqtt_ctx);
+        mqtt_ctx = nullptr;
+        mqtt_tcp = MQTT_TCP_IDLE;
+        mqtt_since = millis();  // CONNACK wait
+        mqtt_hello();
+        return;
+
+    case MQTT_TCP_FAILED:
+        break;
+
+    default:
+        if (millis() - mqtt_since < MQTT_CONNECT)
+            return;
+        break;
+    }
+
+    mqtt_abort();
+}
+
+
+// queue PUBLISH, returns false if queue is full
+static bool mqtt_publish(const char *topic, const char *data, int len, int qos, bool retain)
+{
+    int topic_len = strlen(topic);
+    uint32_t body = 2 + topic_len + (qos > 0 ? 2 : 0) + len;
+    uint8_t hdr[5];
+    int size = mqtt_varint(hdr + 1, body) - hdr + body;
+    struct mqtt_msg *m;
+    uint8_t *out;
+
+    if (mqtt_count == MQTT_QUEUE || mqtt_bytes + size > MQTT_QUEUE_BYTES || size > (int)sizeof(buffer))
+        return false;
+
+    m = &mqtt_queue[(mqtt_head + mqtt_count) % MQTT_QUEUE];
+    m->packet = (uint8_t *)malloc(size);
+    if (m->packet == nullptr)
+        return false;
+
+    m->len = size;
+    m->id = qos > 0 ? mqtt_next_id() : 0;
+    m->sent = 0;
+
+    out = m->packet;
+    *out++ = 0x30 | qos << 1 | (retain ? 1 : 0);
+    out = mqtt_varint(out, body);
+    out = mqtt_string(out, topic, topic_len);
+    if (qos > 0) {
+        *out++ = m->id >> 8;
+        *out++ = m->id;
+    }
+    memcpy(out, data, len);
+
+    mqtt_count++;
+    mqtt_bytes += size;
+
+    return true;
+}
+
+
+// drop done messages from queue head
+static void mqtt_pop()
+{
+    while (mqtt_count > 0 && mqtt_queue[mqtt_head].packet == nullptr) {
+        mqtt_head = (mqtt_head + 1) % MQTT_QUEUE;
+        mqtt_count--;
+    }
+}
+
+
+// message is done: QoS 0 written or QoS 1 acknowledged
+static void mqtt_done(struct mqtt_msg *m)
+{
+    free(m->packet);
+    m->packet = nullptr;
+    mqtt_bytes -= m->len;
+}
+
+
+// write pending messages in one batch
+static void mqtt_flush()
+{
+    uint32_t now = millis();
+    int room = mqtt_client->availableForWrite();
+    int len = 0;
+
+    if (room > (int)sizeof(buffer))
+        room = sizeof(buffer);
+
+    for (int n = 0; n < mqtt_count; n++) {
+        struct mqtt_msg *m = &mqtt_queue[(mqtt_head + n) % MQTT_QUEUE];
+
+        if (m->packet == nullptr)
+            continue;
+
+        // written and waiting for PUBACK
+        if (m->sent != 0) {
+            if (now - m->sent < MQTT_RETRY)
+                continue;
+            m->packet[0] |= 0x08;
+            mqtt_retries++;
+        }
+
+        if (len + m->len > room)
+            break;
+
+        memcpy(buffer + len, m->packet, m->len);
+        len += m->len;
+
+        if (m->sent == 0)
+            mqtt_published++;
+        m->sent = now;
+        if (m->id == 0)
+            mqtt_done(m);
+    }
+
+    if (len == 0)
+        return;
+
+    mqtt_write((uint8_t *)buffer, len);
+    mqtt_batches++;
+    mqtt_pop();
+}
+
+
+// incoming packet from broker
+static void mqtt_packet(const uint8_t *p, int hdr, int len)
+{
+    const uint8_t *body = p + hdr;
+
+    switch (p[0] & 0xF0) {
+    case 0x20:  // CONNACK
+        if (len < 2 || body[1] != 0) {
+            mqtt_close();
+            break;
+        }
+
+        mqtt_state = MQTT_CONNECTED;
+        mqtt_backoff = MQTT_RECONNECT;
+        if (!bin_mode) {
+            char line[32];
+            char *out = put_str(line, "\",\"");
+
+            out = put_uint(out, mqtt_cfg.port);
+            out = put_str(out, "\",\"\",");
+            out = put_uint(out, mqtt_cfg.reconnect);
+            out = put_str(out, "\r\n");
+            Serial.print(F("+MQTTCONNECTED:0,1,\""));
+            Serial.print(mqtt_cfg.host);
+            Serial.write(line, out - line);
+        }
+        for (int n = 0; n < mqtt_sub_count; n++)
+            mqtt_subscribe(&mqtt_subs[n]);
+        break;
+
+    case 0x30: {  // PUBLISH
+        int qos = (p[0] >> 1) & 3;
+        int topic = len >= 2 ? body[0] << 8 | body[1] : len;
+        int off = 2 + topic + (qos > 0 ? 2 : 0);
+        char line[16], *out;
+
+        if (off > len)
+            break;
+
+        // PUBACK, or PUBREC and PUBCOMP below for QoS 2
+        if (qos > 0) {
+            uint8_t ack[4] = { (uint8_t)(qos == 1 ? 0x40 : 0x50), 2, body[off - 2], body[off - 1] };
+            mqtt_write(ack, sizeof(ack));
+        }
+
+        mqtt_received++;
+        if (bin_mode)
+            break;
+        Serial.print(F("+MQTTSUBRECV:0,\""));
+        Serial.write(body + 2, topic);
+        out = put_str(line, "\",");
+        out = put_uint(out, len - off);
+        *out++ = ',';
+        Serial.write(line, out - line);
+        Serial.write(body + off, len - off);
+        Serial.print(F("\r\n"));
+        break;
+    }
+
+    case 0x60: {  // PUBREL
+        uint8_t comp[4] = { 0x70, 2, body[0], body[1] };
+
+        if (len >= 2)
+            mqtt_write(comp, sizeof(comp));
+        break;
+    }
+
+    case 0x40:  // PUBACK
+        if (len < 2)
+            break;
+
+        for (int n = 0; n < mqtt_count; n++) {
+            struct mqtt_msg *m = &mqtt_queue[(mqtt_head + n) % MQTT_QUEUE];
+
+            if (m->packet != nullptr && m->id == (body[0] << 8 | body[1])) {
+                mqtt_done(m);
+                break;
+            }
+        }
+        mqtt_pop();
+        break;
+    }
+}
+
+
+// read packets from broker
+static void mqtt_read()
+{
+    int available = mqtt_client->available();
+
+    while (available > 0) {
+        int k;
+
+        // rest of packet too large for MQTT_RX
+        if (mqtt_rx_skip > 0) {
+            k = available < (int)sizeof(buffer) ? available : sizeof(buffer);
+            if ((uint32_t)k > mqtt_rx_skip)
+                k = mqtt_rx_skip;
+            k = mqtt_client->read((uint8_t *)buffer, k);
+            if (k <= 0)
+                return;
+            mqtt_rx_skip -= k;
+            available -= k;
+            continue;
+        }
+
+        k = mqtt_client->read(mqtt_rx + mqtt_rx_len, MQTT_RX - mqtt_rx_len);
+        if (k <= 0)
+            return;
+        mqtt_rx_len += k;
+        available -= k;
+        mqtt_rx_time = millis();
+
+        // handle complete packets
+        while (mqtt_rx_len >= 2) {
+            uint32_t rem = 0;
+            int hdr = 0;
+
+            for (k = 1; k < mqtt_rx_len && k <= 4 && hdr == 0; k++) {
+                rem |= (uint32_t)(mqtt_rx[k] & 0x7F) << (7 * (k - 1));
+                if (!(mqtt_rx[k] & 0x80))
+                    hdr = k + 1;
+            }
+
+            // malformed or incomplete remaining length
+            if (hdr == 0) {
+                if (k > 4)
+                    mqtt_close();
+                return;
+            }
+
+            if (hdr + rem > MQTT_RX) {
+                mqtt_rx_skip = hdr + rem - mqtt_rx_len;
+                mqtt_rx_len = 0;
+                break;
+            }
+
+            if ((uint32_t)mqtt_rx_len < hdr + rem)
+                break;
+
+            mqtt_packet(mqtt_rx, hdr, rem);
+            if (mqtt_client == nullptr)
+                return;
+
+            mqtt_rx_len -= hdr + rem;
+            memmove(mqtt_rx, mqtt_rx + hdr + rem, mqtt_rx_len);
+        }
+    }
+}
+
+
+// drop queued messages and subscriptions
+static void mqtt_clean()
+{
+    if (mqtt_client != nullptr && mqtt_state == MQTT_CONNECTED) {
+        uint8_t disconnect[2] = { 0xE0, 0 };
+        mqtt_write(disconnect, sizeof(disconnect));
+    }
+
+    mqtt_close();
+
+    for (int n = 0; n < mqtt_count; n++) {
+        struct mqtt_msg *m = &mqtt_queue[(mqtt_head + n) % MQTT_QUEUE];
+
+        if (m->packet != nullptr)
+            mqtt_done(m);
+    }
+
+    mqtt_head = 0;
+    mqtt_count = 0;
+    mqtt_sub_count = 0;
+    mqtt_state = MQTT_UNINIT;
+}
+
+
+// AT+CIPSEND payload is in send_buffer, prepare it for send_mask
+// links and write it from busy_poll()
+static void send_start()
+{
+    send_data = send_buffer;
+    send_size = send_pos;
+
+    for (uint32_t m = send_mask; m != 0; m &= m - 1) {
+        int i = __builtin_ctz(m);
+
+        mirror(i, "SEND", send_buffer, send_pos);
+
+        // WebSocket data goes out as one frame
+        if (ws_link(i)) {
+            ws_header(i, send_pos);
+            continue;
+        }
+
+        if (!http_link(i))
+            continue;
+
+        if (!http[i].responded)
+            latency_record(i);
+
+        cache_capture(i, send_buffer, send_pos);
+
+        // stale copy was served, nothing goes to this client
+        if (http[i].detached) {
+            send_mask &= ~(1U << i);
+            continue;
+        }
+
+        // single HTTP target gets keep-alive framing,
+        // raw data sent to many links ends keep-alive
+        if (send_mask == 1U << i) {
+            send_data = http_buffer;
+            send_size = http_response(i, send_buffer, send_pos, http_buffer);
+        } else {
+            http[i].keepalive = false;
+        }
+    }
+
+    busy = BUSY_SEND;
+    busy_since = millis();
+    memset(send_off, 0, sizeof(send_off));
+}
+
+
+// MCU closes link, keep-alive socket stays open for the next request
+static void link_close(int n)
+{
+    if (http_link(n))
+        cache_commit(n);
+
+    if (!http_link(n) || !http_close(n)) {
+        link_free(n);
+    } else if (client[n]->available() > 0) {
+        // pipelined request is next, start scan from this link
+        http_pipelined++;
+        ipd_next = n;
+    }
+    urc_link(n, "CLOSED");
+}
+
+
+// standalone binary ACK frame
+static void bin_ack()
+{
+    uint8_t f[7] = { BIN_ACK, 0, 0, 0, 0 };
+
+    bin_write(f, 5);
+}
+
+
+// host frame decoded into send_buffer
+static void bin_frame(size_t len)
+{
+    uint8_t *f = (uint8_t *)send_buffer;
+    uint32_t size = 0;
+    size_t n = 4;
+    int shift = 0;
+    int i;
+
+    if (len < 7 || bin_crc(f, len - 2) != (f[len - 2] | f[len - 1] << 8)) {
+        bin_errors++;
+        return;
+    }
+    len -= 2;
+
+    do {
+        if (n == len || shift > 21) {
+            bin_errors++;
+            return;
+        }
+        size |= (uint32_t)(f[n] & 0x7F) << shift;
+        shift += 7;
+    } while (f[n++] & 0x80);
+
+    i = f[3];
+    if (n + size != len || i >= config::links) {
+        bin_errors++;
+        return;
+    }
+
+    // release acked frames
+    n = (uint8_t)(f[2] - bin_tx_seq);
+    if (n > 0 && n <= bin_tx_count) {
+        bin_tx_seq = f[2];
+        bin_tx_count -= n;
+        bin_tx_time = millis();
+    }
+
+    if (f[0] == BIN_ACK)
+        return;
+
+    // duplicate or frame after lost one, ack tells host where to resume
+    bin_ack_due = true;
+    if (f[1] != bin_rx_seq)
+        return;
+
+    // previous DATA is still written from send_buffer, host resends
+    if (busy != BUSY_NONE)
+        return;
+
+    // AT mode would lose unacked frames and queued link events
+    if (f[0] == BIN_EXIT && (bin_tx_count > 0 || (bin_connect | bin_close) != 0)) {
+        bin_exit = true;
+        return;
+    }
+    bin_rx_seq++;
+    bin_rx_data += size;
+
+    switch (f[0]) {
+    case BIN_DATA:
+    case BIN_CLOSE:
+        if (f[0] == BIN_CLOSE)
+            link_linger &= ~(1U << i);
+
+        // unknown link is reported closed
+        if (client[i] == nullptr || (http_link(i) && !http[i].announced)) {
+            if (!(bin_connect & (1U << i)))
+                bin_close |= 1U << i;
+            break;
+        }
+
+        if (f[0] == BIN_CLOSE) {
+            link_close(i);
+            break;
+        }
+
+        // written from busy_poll() like AT+CIPSEND payload
+        memmove(send_buffer, f + len - size, size);
+        send_pos = size;
+        send_mask = 1U << i;
+        send_fail = false;
+        send_start();
+        break;
+
+    case BIN_EXIT:
+        bin_ack();
+        bin_mode = false;
+        bin_exit = false;
+        uart_rx_delim = '\n';
+        break;
+    }
+}
+
+
+// COBS decoder, frames end with 0x00
+static void bin_rx_byte(uint8_t c)
+{
+    if (c == 0) {
+        if (!bin_rx_drop && bin_rx_left == 0 && bin_rx_code != 0)
+            bin_frame(bin_rx_pos);
+        else if (bin_rx_pos > 0 || bin_rx_drop)
+            bin_errors++;
+
+        bin_rx_pos = 0;
+        bin_rx_left = 0;
+        bin_rx_code = 0;
+        bin_rx_drop = false;
+        return;
+    }
+
+    if (bin_rx_drop)
+        return;
+
+    if (bin_rx_left > 0) {
+        bin_rx_left--;
+    } else {
+        // block shorter than 254 bytes is followed by zero
+        bool zero = bin_rx_code != 0 && bin_rx_code != 0xFF;
+
+        bin_rx_code = c;
+        bin_rx_left = c - 1;
+        if (!zero)
+            return;
+        c = 0;
+    }
+
+    if (bin_rx_pos == sizeof(send_buffer)) {
+        bin_rx_drop = true;
+        return;
+    }
+    send_buffer[bin_rx_pos++] = c;
+}
+
+
+// resend unacked window, send link events and ack
+static void bin_poll()
+{
+    if (bin_tx_count > 0 && millis() - bin_tx_time >= BIN_RETRY) {
+        for (int n = 0; n < bin_tx_count; n++) {
+            int s = (uint8_t)(bin_tx_seq + n) % BIN_WINDOW;
+
+            bin_write((uint8_t *)input_buffer + s * BIN_SLOT, bin_tx_len[s]);
+        }
+        bin_tx_time = millis();
+        bin_retries++;
+    }
+
+    // closes first, link may be reused after it
+    while ((bin_close | bin_connect) != 0 && bin_tx_count < BIN_WINDOW) {
+        if (bin_close != 0) {
+            int i = __builtin_ctz(bin_close);
+
+            bin_send(BIN_CLOSE, i, nullptr, 0);
+            bin_close &= ~(1U << i);
+        } else {
+            int i = __builtin_ctz(bin_connect);
+
+            bin_send(BIN_CONNECT, i, nullptr, 0);
+            bin_connect &= ~(1U << i);
+        }
+    }
+
+    if (bin_ack_due)
+        bin_ack();
+}
+
+
+// switch UART to binary frames, AT input is dropped
+static void bin_start()
+{
+    bin_mode = true;
+    bin_tx_seq = 0;
+    bin_tx_count = 0;
+    bin_rx_seq = 0;
+    bin_ack_due = false;
+    bin_exit = false;
+    bin_connect = 0;
+    bin_close = 0;
+    bin_rx_pos = 0;
+    bin_rx_left = 0;
+    bin_rx_code = 0;
+    bin_rx_drop = false;
+    input_pos = 0;
+    input_len = sizeof(input_buffer);
+    uart_rx_delim = 0;
+}
+
+
+// close all client connections and stop servers
+static void server_stop()
+{
+    // close all client connections...
+    for (uint32_t m = link_used; m != 0; m &= m - 1)
+        link_free(__builtin_ctz(m));
+
+    // stop servers
+    for (int i = 0; i < MAX_SERVERS; i++) {
+        if (servers[i].server == nullptr)
+            continue;
+
+        servers[i].server->stop();
+        delete servers[i].server;
+        servers[i].server = nullptr;
+        memset(&servers[i].cfg, 0, sizeof(servers[i].cfg));
+    }
+
+    // update ports in rtc user memory
+    server_save();
+}
+
+
+// process AT command
+static void process_command(char *command, size_t len)
+{
+    if (len == 0)
+        return;
+
+    history = history->next;
+
+    if (len < sizeof(history->buffer)) {
+        memcpy(history->buffer, command, len);
+        history->buffer[len] = '\0';
+    } else {
+        memcpy(history->buffer, command, sizeof(history->buffer) - 1);
+        history->buffer[sizeof(history->buffer) - 1] = '\0';
+    }
+
+    // test
+    if (!strcmp(command, "AT"))
+        goto ok;
+
+    // reset
+    if (!strcmp(command, "AT+RST")) {
+        server_stop();
+        Serial.print(F("\r\nOK\r\n...bla-bla-bla...\r\nready\r\n"));
+        return;
+    }
+
+    // station mode
+    if (!strcmp(command, "AT+CWMODE=1"))
+        goto ok;
+
+    // enable multiple connections
+    if (!strcmp(command, "AT+CIPMUX=1"))
+        goto ok;
+
+    // check AP
+    if (!strcmp(command, "AT+CWJAP?")) {
+        if (WiFi.isConnected()) {
+            char *dst, *src;
+            char buf[80];
+
+            strcpy_P(buf, PSTR("+CWJAP:\""));
+
+            src = creds.ssid;
+            dst = buf + 8;
+
+            while (*src != '\0') {
+                if (*src == '"' || *src == ',' || *src == '\\')
+                    *dst++ = '\\';
+                *dst++ = *src++;
+            }
+
+            *dst = '\0';
+            strcat_P(dst, PSTR("\"\r\n"));
+
+            Serial.print(buf);
+            goto ok;
+        } else {
+            Serial.print(F("No AP\r\n"));
+            goto error;
+        }
+    }
+
+    // connect to AP
+    if (len > 9 && (!strncmp(command, "AT+CWJAP=", 9))) {
+        char *src = command + 9;
+        char *dst;
+        char ssid[33];
+        char pass[64];
+
+        // check start double quote
+        if (*src != '"')
+            goto error;
+
+        // parse ssid
+        src++;
+        dst = ssid;
+        while (*src != '"' && *src != '\0' && dst - ssid < (int)sizeof(ssid) - 1) {
+            if (*src == '\\')
+                src++;
+            *dst++ = *src++;
+        }
+
+        // check delimiter
+        if (*src++ != '"' || *src++ != ',' || *src++ != '"')
+            goto error;
+
+        *dst = '\0';
+
+        // hide password in history
+        strcpy_P(history->buffer + (src - command), PSTR("*\""));
+
+        // parse password
+        dst = pass;
+        while (*src != '"' && *src != '\0' && dst - pass < (int)sizeof(pass) - 1) {
+            if (*src == '\\')
+                src++;
+            *dst++ = *src++;
+        }
+
+        // check end double quote
+        if (*src != '"')
+            goto error;
+
+        *dst = '\0';
+
+        // check if ssid and pass was changed
+        if (strcmp(ssid, creds.ssid) || strcmp(pass, creds.pass)) {
+            // copy new creds
+            memset(creds.ssid, 0, sizeof(creds.ssid));
+            memset(creds.pass, 0, sizeof(creds.pass));
+            strcpy(creds.ssid, ssid);
+            strcpy(creds.pass, pass);
+            creds.crc = creds_crc(&creds);
+
+            // save creds to eeprom
+            EEPROM.put(0, creds);
+            EEPROM.commit();
+
+            // connect to wifi
+            WiFi.disconnect();
+            WiFi.begin(creds.ssid, creds.pass);
+        }
+
+        // result is reported from busy_poll()
+        busy = BUSY_CONNECT;
+        busy_since = millis();
+        return;
+    }
+
+    // query uart settings
+    if (!strcmp(command, "AT+UART_CUR?") || !strcmp(command, "AT+UART_DEF?")) {
+        if (command[8] == 'C')
+            Serial.printf("+UART_CUR:%u,8,1,0,%u\r\n", Serial.baudRate(), uart_flow);
+        else
+            Serial.printf("+UART_DEF:%u,8,1,0,%u\r\n", uart_cfg.baud, uart_cfg.flow);
+        goto ok;
+    }
+
+    // set uart settings: <baud>,<databits>,<stopbits>,<parity>,<flow control>
+    //  * only 8N1 is supported
+    //  * AT+UART_DEF also saves settings to eeprom
+    if (len > 12 && (!strncmp(command, "AT+UART_CUR=", 12) || !strncmp(command, "AT+UART_DEF=", 12))) {
+        unsigned baud;
+        int bits, stop, parity, flow;
+
+        if (sscanf(command + 12, "%u,%d,%d,%d,%d", &baud, &bits, &stop, &parity, &flow) != 5)
+            goto error;
+
+        if (baud < 300 || baud > 4608000 || bits != 8 || stop != 1 || parity != 0)
+            goto error;
+
+        if (flow < 0 || flow > (UART_FLOW_RTS | UART_FLOW_CTS))
+            goto error;
+
+        if (command[8] == 'D') {
+            uart_cfg.baud = baud;
+            uart_cfg.flow = flow;
+            uart_cfg.crc = uart_cfg_crc(&uart_cfg);
+            EEPROM.put(sizeof(creds), uart_cfg);
+            EEPROM.commit();
+        }
+
+        // reply at the old baud rate before switching
+        Serial.print(F("\r\nOK\r\n"));
+        uart_setup(baud, flow);
+        return;
+    }
+
+    // query serial rx buffer size
+    if (!strcmp(command, "AT+UART_RXBUF?")) {
+        Serial.printf("+UART_RXBUF:%u\r\n", uart_rx_buffer);
+        goto ok;
+    }
+
+    // set serial rx buffer size and save it to eeprom
+    if (len > 14 && (!strncmp(command, "AT+UART_RXBUF=", 14))) {
+        int n;
+        size_t r;
+
+        if (sscanf(command + 14, "%d", &n) != 1)
+            goto error;
+
+        if (n < 256 || n > 16384)
+            goto error;
+
+        r = uart_rx_resize(n);
+        if (r == 0)
+            goto error;
+
+        uart_rx_buffer = r;
+        uart_cfg.rx_buffer = r;
+        uart_cfg.crc = uart_cfg_crc(&uart_cfg);
+        EEPROM.put(sizeof(creds), uart_cfg);
+        EEPROM.commit();
+        goto ok;
+    }
+
+    // set ip
+    //  * WiFi connects only to DHCP-enabled networks
+    //  * there is no any sense to set static ip
+    if (len > 10 && (!strncmp(command, "AT+CIPSTA=", 10)))
+        goto ok;
+
+    // query servers
+    if (!strcmp(command, "AT+CIPSERVER?")) {
+        for (int i = 0; i < MAX_SERVERS; i++) {
+            if (servers[i].server == nullptr)
+                continue;
+            Serial.printf("+CIPSERVER:%d,\"%s\",%d,%d,%d\r\n", servers[i].cfg.port,
+                server_type(&servers[i].cfg),
+                servers[i].cfg.quota, servers[i].cfg.reserved, servers[i].links);
+        }
+        goto ok;
+    }
+
+    // start/stop server
+    //  * AT+CIPSERVER=1,<port>[,"TCP"|"HTTP"|"SSL"|"HTTPS"] adds listening port,
+    //    "SSL" and "HTTPS" need RTS flow control
+    //  * AT+CIPSERVER=0 closes all connections and stops all ports
+    if (len > 13 && (!strncmp(command, "AT+CIPSERVER=", 13))) {
+        struct server_cfg cfg = { 0 };
+        char type[8] = "TCP";
+        int cmd, port, r;
+
+        r = sscanf(command + 13, "%d,%d,\"%7[^\"]\"", &cmd, &port, type);
+
+        if (!strcmp(type, "HTTP"))
+            cfg.flags |= SERVER_HTTP;
+        else if (!strcmp(type, "SSL"))
+            cfg.flags |= SERVER_TLS;
+        else if (!strcmp(type, "HTTPS"))
+            cfg.flags |= SERVER_HTTP | SERVER_TLS;
+        else if (strcmp(type, "TCP"))
+            goto error;
+
+        if (cfg.flags & SERVER_TLS)
+            cfg.quota = TLS_MAX_LINKS;
+
+        if (r > 0 && cmd == 0) {
+            server_stop();
+            goto ok;
+        }
+
+        // TLS handshake would overrun UART input without RTS
+        if ((cfg.flags & SERVER_TLS) && !tls_uart_ok())
+            goto error;
+
+        if (r >= 2 && cmd == 1 && port > 0 && port < 65536 && port != 8080 &&
+            port != MIRROR_PORT && server_find(port) == nullptr) {
+            cfg.port = port;
+            if (server_start(&cfg) == nullptr)
+                goto error;
+            server_save();
+            goto ok;
+        }
+
+        goto error;
+    }
+
+    // set port link quota and reservation: <port>,<quota>,<reserved>
+    if (len > 16 && (!strncmp(command, "AT+CIPSERVERCFG=", 16))) {
+        struct server *s;
+        int port, quota, reserved;
+        int reserved_all = 0;
+
+        if (sscanf(command + 16, "%d,%d,%d", &port, &quota, &reserved) != 3)
+            goto error;
+
+        s = server_find(port);
+        if (s == nullptr)
+            goto error;
+
+        if (quota < 0 || quota > config::links || reserved < 0 || reserved > config::links)
+            goto error;
+
+        if (quota > 0 && reserved > quota)
+            goto error;
+
+        // reservations of all ports must fit the link table
+        for (int n = 0; n < MAX_SERVERS; n++)
+            if (servers[n].server != nullptr && &servers[n] != s)
+                reserved_all += servers[n].cfg.reserved;
+        if (reserved_all + reserved > config::links)
+            goto error;
+
+        // TLS links are too large to leave unlimited
+        if ((quota == 0 || quota > TLS_MAX_TOTAL) && (s->cfg.flags & SERVER_TLS))
+            goto error;
+
+        s->cfg.quota = quota;
+        s->cfg.reserved = reserved;
+        server_save();
+        goto ok;
+    }
+
+    // close client connection
+    if (len > 12 && (!strncmp(command, "AT+CIPCLOSE=", 12))) {
+        int n;
+
+        if (sscanf(command + 12, "%d", &n) != 1)
+            goto error;
+
+        if (n < 0 || n >= config::links)
+            goto error;
+
+        // MCU saw CLOSED, the id can be reused
+        link_linger &= ~(1U << n);
+
+        if (client[n] == nullptr || (http_link(n) && !http[n].announced)) {
+            Serial.print(F("link is not\r\n"));
+            goto error;
+        }
+
+        link_close(n);
+        goto ok;
+    }
+
+    // query +IPD coalescing window
+    if (!strcmp(command, "AT+CIPCOALESCE?")) {
+        Serial.printf("+CIPCOALESCE:%u,%d\r\n", coalesce_us, coalesce_bytes);
+        goto ok;
+    }
+
+    // set +IPD coalescing window: <us>,<bytes>
+    if (len > 15 && (!strncmp(command, "AT+CIPCOALESCE=", 15))) {
+        int us, bytes;
+
+        if (sscanf(command + 15, "%d,%d", &us, &bytes) != 2)
+            goto error;
+
+        if (us < 0 || bytes < 0 || bytes > (int)sizeof(buffer))
+            goto error;
+
+        coalesce_us = us;
+        coalesce_bytes = bytes;
+        goto ok;
+    }
 
-    // init history
-    for (i = 0; i < HISTSIZE; i++) {
-        h[i].buffer[0] = '\0';
-        if (i > 0)
-            h[i].next = &h[i - 1];
+    // query max +IPD frame length
+    if (!strcmp(command, "AT+CIPIPDMAX?")) {
+        Serial.printf("+CIPIPDMAX:%d\r\n", ipd_max);
+        goto ok;
+    }
+
+    // set max +IPD frame length
+    if (len > 13 && (!strncmp(command, "AT+CIPIPDMAX=", 13))) {
+        int n;
+
+        if (sscanf(command + 13, "%d", &n) != 1)
+            goto error;
+
+        if (n <= 0 || n > (int)sizeof(buffer))
+            goto error;
+
+        ipd_max = n;
+        goto ok;
+    }
+
+    // query stale response deadline
+    if (!strcmp(command, "AT+CIPCACHE?")) {
+        Serial.printf("+CIPCACHE:%u\r\n", cache_deadline);
+        goto ok;
+    }
+
+    // set stale response deadline in ms, 0 - disabled
+    if (len > 12 && (!strncmp(command, "AT+CIPCACHE=", 12))) {
+        int deadline;
+
+        if (sscanf(command + 12, "%d", &deadline) != 1 || deadline < 0)
+            goto error;
+
+        cache_deadline = deadline;
+        goto ok;
+    }
+
+    // query WebSocket bridge
+    if (!strcmp(command, "AT+CIPWS?")) {
+        Serial.printf("+CIPWS:\"%s\",\"%s\"\r\n", ws_path, ws_opcode == 2 ? "BINARY" : "TEXT");
+        goto ok;
+    }
+
+    // set WebSocket bridge: "<path>"[,"TEXT"|"BINARY"], "" - disabled
+    if (len > 9 && (!strncmp(command, "AT+CIPWS=", 9))) {
+        char *src = command + 9;
+        char path[sizeof(ws_path)];
+        char type[8] = "TEXT";
+
+        if (!at_string(&src, path, sizeof(path)))
+            goto error;
+
+        if (*src == ',' && (++src, !at_string(&src, type, sizeof(type))))
+            goto error;
+
+        if (*src != '\0' || (strcmp(type, "TEXT") && strcmp(type, "BINARY")))
+            goto error;
+
+        strcpy(ws_path, path);
+        ws_hash = path[0] != '\0' ? path_hash(path) : 0;
+        ws_opcode = strcmp(type, "BINARY") ? 1 : 2;
+        goto ok;
+    }
+
+    // switch UART to binary frames after OK, EXIT frame switches back
+    if (!strcmp(command, "AT+CIPBINARY=1")) {
+        if (send_len > 0 || cmdq_count > 0)
+            goto error;
+
+        bin_start();
+        goto ok;
+    }
+
+    // query gzip compression and per link stats:
+    // <link>,<bytes in>,<bytes out>,<us>
+    if (!strcmp(command, "AT+CIPGZIP?")) {
+        Serial.printf("+CIPGZIP:%d\r\n", gzip_enabled);
+        for (int i = 0; i < config::links; i++) {
+            if (client[i] == nullptr || gzip_stats[i].in == 0)
+                continue;
+            Serial.printf("+CIPGZIP:%d,%u,%u,%u\r\n", i,
+                gzip_stats[i].in, gzip_stats[i].out, gzip_stats[i].us);
+        }
+        goto ok;
+    }
+
+    // enable gzip compression of HTTP responses: 0|1
+    if (len > 11 && (!strncmp(command, "AT+CIPGZIP=", 11))) {
+        int enable;
+
+        if (sscanf(command + 11, "%d", &enable) != 1 || enable < 0 || enable > 1)
+            goto error;
+
+        gzip_enabled = enable;
+        goto ok;
+    }
+
+    // MQTT user config:
+    // 0,1,"<client id>","<username>","<password>",<cert>,<ca>,"<path>"
+    if (len > 15 && (!strncmp(command, "AT+MQTTUSERCFG=", 15))) {
+        struct mqtt_cfg cfg = mqtt_cfg;
+        char *src = command + 15;
+
+        if (strncmp(src, "0,1,", 4) || mqtt_client != nullptr || mqtt_tcp != MQTT_TCP_IDLE)
+            goto error;
+        src += 4;
+
+        if (!at_string(&src, cfg.client_id, sizeof(cfg.client_id)) || *src++ != ',' ||
+            !at_string(&src, cfg.username, sizeof(cfg.username)) || *src++ != ',')
+            goto error;
+
+        // hide password in history
+        if (src - command < (int)sizeof(history->buffer) - 3)
+            strcpy_P(history->buffer + (src - command), PSTR("*\""));
+
+        // certificates and path are not used
+        if (!at_string(&src, cfg.password, sizeof(cfg.password)))
+            goto error;
+
+        mqtt_cfg = cfg;
+        if (mqtt_state == MQTT_UNINIT)
+            mqtt_state = MQTT_USERCFG;
+        goto ok;
+    }
+
+    // query MQTT connection
+    if (!strcmp(command, "AT+MQTTCONN?")) {
+        int state = mqtt_state == MQTT_CONNECTED && mqtt_sub_count > 0 ? 6 : mqtt_state;
+
+        Serial.printf("+MQTTCONN:0,%d,1,\"%s\",\"%u\",\"\",%d\r\n",
+            state, mqtt_cfg.host, mqtt_cfg.port, mqtt_cfg.reconnect);
+        goto ok;
+    }
+
+    // connect to broker: 0,"<host>",<port>,<reconnect>
+    if (len > 12 && (!strncmp(command, "AT+MQTTCONN=", 12))) {
+        char *src = command + 12;
+        char host[sizeof(mqtt_cfg.host)];
+        int port, reconnect;
+
+        if (mqtt_state == MQTT_UNINIT || mqtt_client != nullptr || mqtt_tcp != MQTT_TCP_IDLE ||
+            strncmp(src, "0,", 2))
+            goto error;
+        src += 2;
+
+        if (!at_string(&src, host, sizeof(host)) ||
+            sscanf(src, ",%d,%d", &port, &reconnect) != 2 || port <= 0 || port > 65535)
+            goto error;
+
+        strcpy(mqtt_cfg.host, host);
+        mqtt_cfg.port = port;
+        mqtt_cfg.reconnect = reconnect != 0;
+        mqtt_state = MQTT_DISCONNECTED;
+        mqtt_backoff = MQTT_RECONNECT;
+        mqtt_addr_ok = false;
+
+        if (!mqtt_connect())
+            goto error;
+
+        // reply when CONNACK arrives
+        busy = BUSY_MQTT;
+        busy_since = millis();
+        return;
+    }
+
+    // publish: 0,"<topic>","<data>",<qos>,<retain>, message is queued
+    // and sent with other pending messages
+    if (len > 11 && (!strncmp(command, "AT+MQTTPUB=", 11))) {
+        char *src = command + 11;
+        char topic[128];
+        int qos, retain;
+        char *data;
+
+        if (mqtt_state < MQTT_DISCONNECTED || strncmp(src, "0,", 2))
+            goto error;
+        src += 2;
+
+        if (!at_string(&src, topic, sizeof(topic)) || *src++ != ',')
+            goto error;
+
+        // data is unescaped in place
+        data = src + 1;
+        if (!at_string(&src, data, len - (data - command) + 1))
+            goto error;
+
+        if (sscanf(src, ",%d,%d", &qos, &retain) != 2 || qos < 0 || qos > 1)
+            goto error;
+
+        if (!mqtt_publish(topic, data, strlen(data), qos, retain != 0))
+            goto error;
+        goto ok;
+    }
+
+    // query subscriptions
+    if (!strcmp(command, "AT+MQTTSUB?")) {
+        for (int n = 0; n < mqtt_sub_count; n++)
+            Serial.printf("+MQTTSUB:0,%d,\"%s\",%d\r\n", mqtt_state, mqtt_subs[n].topic, mqtt_subs[n].qos);
+        goto ok;
+    }
+
+    // subscribe: 0,"<topic>",<qos>
+    if (len > 11 && (!strncmp(command, "AT+MQTTSUB=", 11))) {
+        char *src = command + 11;
+        struct mqtt_sub sub;
+        int qos, n;
+
+        if (mqtt_state < MQTT_DISCONNECTED || strncmp(src, "0,", 2))
+            goto error;
+        src += 2;
+
+        if (!at_string(&src, sub.topic, sizeof(sub.topic)) ||
+            sscanf(src, ",%d", &qos) != 1 || qos < 0 || qos > 1)
+            goto error;
+        sub.qos = qos;
+
+        for (n = 0; n < mqtt_sub_count; n++)
+            if (!strcmp(mqtt_subs[n].topic, sub.topic))
+                break;
+
+        if (n == MQTT_SUBS)
+            goto error;
+
+        mqtt_subs[n] = sub;
+        if (n == mqtt_sub_count)
+            mqtt_sub_count++;
+
+        if (mqtt_state == MQTT_CONNECTED)
+            mqtt_subscribe(&sub);
+        goto ok;
+    }
+
+    // disconnect and drop queue and subscriptions
+    if (!strcmp(command, "AT+MQTTCLEAN=0")) {
+        mqtt_clean();
+        goto ok;
+    }
+
+    // query cache warming
+    if (!strcmp(command, "AT+CIPWARM?")) {
+        Serial.printf("+CIPWARM:%u", warm_interval);
+        for (int i = 0; i < warm_count; i++)
+            Serial.printf(",\"%s\"", warm[i].path);
+        Serial.print(F("\r\n"));
+        goto ok;
+    }
+
+    // set cache warming: <interval ms>[,"<path>"...], 0 - disabled
+    if (len > 11 && (!strncmp(command, "AT+CIPWARM=", 11))) {
+        struct warm w[WARM_PATHS];
+        int interval, n;
+
+        n = warm_paths(command + 11, &interval, w, WARM_PATHS);
+        if (n < 0)
+            goto error;
+
+        memcpy(warm, w, sizeof(w));
+        warm_count = n;
+        warm_interval = interval;
+        goto ok;
+    }
+
+    // query JSON snapshot
+    if (!strcmp(command, "AT+CIPSNAP?")) {
+        Serial.printf("+CIPSNAP:%u", snap_interval);
+        for (int i = 0; i < snap_count; i++)
+            Serial.printf(",\"%s\"", snap[i].path);
+        Serial.print(F("\r\n"));
+        goto ok;
+    }
+
+    // set JSON snapshot: <interval ms>[,"<path>"...], 0 - disabled
+    if (len > 11 && (!strncmp(command, "AT+CIPSNAP=", 11))) {
+        struct warm w[SNAP_PATHS];
+        int interval, n;
+
+        n = warm_paths(command + 11, &interval, w, SNAP_PATHS);
+        if (n < 0)
+            goto error;
+
+        // values of old paths are dropped, response to request in
+        // progress is discarded
+        for (int i = 0; i < SNAP_PATHS; i++)
+            free(snap_values[i].body);
+        memset(snap_values, 0, sizeof(snap_values));
+        memcpy(snap, w, sizeof(w));
+        snap_count = n;
+        snap_interval = interval;
+        if (snap_pending >= 0)
+            snap_pending = SNAP_DISCARD;
+        snap_build();
+        goto ok;
+    }
+
+    // query circuit breaker settings
+    if (!strcmp(command, "AT+CIPBREAKER?")) {
+        Serial.printf("+CIPBREAKER:%u,%d,%u\r\n", breaker_latency, breaker_backlog, breaker_cooldown);
+        goto ok;
+    }
+
+    // set circuit breaker: <latency ms>,<backlog>,<cooldown ms>
+    if (len > 14 && (!strncmp(command, "AT+CIPBREAKER=", 14))) {
+        int latency, backlog, cooldown;
+
+        if (sscanf(command + 14, "%d,%d,%d", &latency, &backlog, &cooldown) != 3)
+            goto error;
+
+        if (latency < 0 || backlog <= 0 || cooldown < 0)
+            goto error;
+
+        breaker_latency = latency;
+        breaker_backlog = backlog;
+        breaker_cooldown = cooldown;
+        breaker = BREAKER_CLOSED;
+        goto ok;
+    }
+
+    // send data
+    //  * AT+CIPSEND=<link>,<len>
+    //  * AT+CIPSEND=-1,<len> sends to all connected links
+    //  * AT+CIPSENDM=<mask>,<len> sends to links in bit mask
+    if ((len > 11 && (!strncmp(command, "AT+CIPSEND=", 11))) ||
+        (len > 12 && (!strncmp(command, "AT+CIPSENDM=", 12)))) {
+        uint32_t mask = 0;
+        bool all = false;
+        int i, l;
+
+        if (command[10] == 'M') {
+            const char *p = command + 12;
+            char *end;
+            int base = 10;
+
+            // mask is decimal or hex after 0x, a leading 0 is not octal
+            if (p[0] == '0' && (p[1] == 'x' || p[1] == 'X')) {
+                p += 2;
+                base = 16;
+            }
+            if (!isxdigit((uint8_t)*p))
+                goto error;
+
+            unsigned long long m = strtoull(p, &end, base);
+
+            // empty mask and links beyond profile are rejected
+            if (end == p || sscanf(end, ",%d", &l) != 1)
+                goto error;
+            if (m == 0 || (m & ~(unsigned long long)config::link_mask))
+                goto error;
+            mask = m;
+        } else {
+            if (sscanf(command + 11, "%d,%d", &i, &l) != 2)
+                goto error;
+            if (i < -1 || i >= config::links)
+                goto error;
+            all = i < 0;
+            mask = all ? 0xFFFFFFFF : 1U << i;
+        }
+
+        // all links in mask must be connected, -1 takes connected only
+        for (int n = 0; n < 32; n++) {
+            if (!(mask & (1U << n)))
+                continue;
+
+            if (n >= config::links || !link_open(n)) {
+                if (!all) {
+                    Serial.print(F("link is not\r\n"));
+                    return;
+                }
+                mask &= ~(1U << n);
+            }
+        }
+
+        if (mask == 0) {
+            Serial.print(F("link is not\r\n"));
+            return;
+        }
+
+        if (l > (int)sizeof(send_buffer)) {
+            Serial.print(F("too long\r\n"));
+            return;
+        }
+
+        send_mask = mask;
+        send_pos = 0;
+        send_len = l;
+        Serial.print(F("> "));
+        return;
+    }
+
+error:
+    Serial.print(F("\r\nERROR\r\n"));
+    return;
+ok:
+    Serial.print(F("\r\nOK\r\n"));
+}
+
+
+// queue AT command while busy, reply busy when queue is full
+//  * a line longer than a slot can't be queued on retry either,
+//    it is answered ERROR
+static void cmdq_push(char *command, size_t len)
+{
+    struct cmdq *q;
+
+    if (len >= sizeof(q->buffer)) {
+        Serial.print(F("\r\nERROR\r\n"));
+        return;
+    }
+
+    if (cmdq_count == CMDQ_SIZE) {
+        if (busy == BUSY_SEND)
+            Serial.print(F("busy s...\r\n"));
+        else
+            Serial.print(F("busy p...\r\n"));
+        return;
+    }
+
+    q = &cmdq[(cmdq_head + cmdq_count) % CMDQ_SIZE];
+    memcpy(q->buffer, command, len + 1);
+    q->len = len;
+    cmdq_count++;
+}
+
+
+// check long running operation and finish it
+static void busy_poll()
+{
+    wl_status_t status;
+    int i, n;
+
+    switch (busy) {
+    case BUSY_CONNECT:
+        status = WiFi.status();
+
+        if (status == WL_DISCONNECTED && millis() - busy_since < CWJAP_TIMEOUT)
+            return;
+
+        if (status == WL_CONNECTED)
+            Serial.print(F("\r\nOK\r\n"));
+        else
+            Serial.print(F("+CWJAP:1\r\n\r\nFAIL\r\n"));
+        break;
+
+    case BUSY_MQTT:
+        if ((mqtt_client != nullptr || mqtt_tcp != MQTT_TCP_IDLE) && mqtt_state != MQTT_CONNECTED)
+            return;
+
+        if (mqtt_state == MQTT_CONNECTED)
+            Serial.print(F("\r\nOK\r\n"));
+        else
+            Serial.print(F("\r\nERROR\r\n"));
+        break;
+
+    case BUSY_SEND:
+        // write as much as tcp send buffers allow
+        for (uint32_t m = send_mask; m != 0; m &= m - 1) {
+            i = __builtin_ctz(m);
+            n = client[i]->availableForWrite();
+            if (n > send_size - send_off[i])
+                n = send_size - send_off[i];
+
+            if (n > 0) {
+                uint32_t t = micros();
+
+                n = client[i]->write((uint8_t *)send_data + send_off[i], n);
+                if (tls_link(i)) {
+                    tls_us += micros() - t;
+                    tls_bytes += n;
+                }
+                send_off[i] += n;
+                busy_since = millis();
+            }
+
+            if (send_off[i] == send_size)
+                send_mask &= ~(1U << i);
+        }
+
+        if (send_mask != 0) {
+            if (millis() - busy_since < SEND_TIMEOUT)
+                return;
+            send_fail = true;
+
+            // binary DATA was acked on receipt, host learns from CLOSE
+            for (uint32_t m = bin_mode ? send_mask : 0; m != 0; m &= m - 1) {
+                i = __builtin_ctz(m);
+                link_lost(i);
+            }
+            send_mask = 0;
+        }
+
+        if (bin_mode)
+            bin_send_fails += send_fail;
+        else
+            Serial.print(send_fail ? F("\r\nSEND FAIL\r\n") : F("\r\nSEND OK\r\n"));
+
+        send_pos = 0;
+        send_fail = false;
+        break;
+
+    default:
+        return;
+    }
+
+    busy = BUSY_NONE;
+}
+
+
+// append to status page, output is cut at the end of buffer
+static size_t page_add(size_t i, const char *fmt, ...)
+{
+    va_list args;
+
+    if (i >= sizeof(buffer) - 1)
+        return i;
+
+    va_start(args, fmt);
+    i += vsnprintf(buffer + i, sizeof(buffer) - i, fmt, args);
+    va_end(args);
+
+    return i < sizeof(buffer) ? i : sizeof(buffer) - 1;
+}
+
+
+// handle / page
+void handle_root()
+{
+    size_t i;
+
+    // page is cut at the end of buffer, keep the basics first
+    i = page_add(0,
+        "MSR23 WiFi modem\n\nRSSI: %d\nUptime: %llu sec\nReset reason: %s\n",
+        WiFi.RSSI(), millis64() / 1000, ESP.getResetReason().c_str()
+    );
+
+    i = page_add(i,
+        "Loop: avg %u us, max %u us\nHeap: free %u, max block %u\nLinks: %d, tables %u bytes\n",
+        loop_avg, loop_max, ESP.getFreeHeap(), ESP.getMaxFreeBlockSize(), config::links,
+        sizeof(client) + sizeof(link_server) + sizeof(http) + sizeof(gzip_stats) +
+        sizeof(ipd_since) + sizeof(ipd_wait) + sizeof(send_off)
+    );
+
+    i = page_add(i, "\nAT history:\n");
+
+    for (int n = 0; n < config::history; n++) {
+        history = history->next;
+        i = page_add(i, "> %s\n", history->buffer);
+    }
+
+    i = page_add(i,
+        "\nConnected: %d\nHTTP requests: %u, keep-alive reuses %u, pipelined %u\nIPD coalescing: %u us, %d bytes\nIPD max: %d\n",
+        connected, http_requests, http_reused, http_pipelined, coalesce_us, coalesce_bytes, ipd_max
+    );
+
+    for (int n = 0; n < MAX_SERVERS; n++) {
+        if (servers[n].server == nullptr)
+            continue;
+        i = page_add(i,
+            "Server port: %d (%s), links %d, quota %d, reserved %d\n",
+            servers[n].cfg.port, server_type(&servers[n].cfg),
+            servers[n].links, servers[n].cfg.quota, servers[n].cfg.reserved
+        );
+    }
+
+    if (tls_handshakes > 0 || tls_failed > 0 || tls_refused > 0) {
+        i = page_add(i,
+            "TLS handshakes: %u, failed %u, refused %u, avg %u ms, min %u ms, max %u ms\n"
+            "TLS records: %u bytes in %u ms\n",
+            tls_handshakes, tls_failed, tls_refused, tls_handshake_avg / 1000, tls_handshake_min / 1000,
+            tls_handshake_max / 1000, tls_bytes, tls_us / 1000
+        );
+    }
+
+    for (int n = 0; n < MAX_OBSERVERS; n++) {
+        if (observers[n].client == nullptr)
+            continue;
+        i = page_add(i,
+            "Observer %d: links 0x%08x, drops %u\n", n, observers[n].mask, observers[n].drops
+        );
+    }
+
+    i = page_add(i,
+        "\nMCU latency: avg %u ms\nBreaker: %s, trips %u, rejected %u\nLatency histogram:",
+        latency_avg, breaker == BREAKER_CLOSED ? "closed" : breaker == BREAKER_OPEN ? "open" : "half-open",
+        breaker_trips, breaker_rejected
+    );
+
+    for (int n = 0; n < LATENCY_BUCKETS; n++) {
+        i = page_add(i, " %s%u:%u",
+            n < LATENCY_BUCKETS - 1 ? "<" : ">=", 1U << (n < LATENCY_BUCKETS - 1 ? n : n - 1),
+            latency_hist[0][n] + latency_hist[1][n]);
+    }
+
+    i = page_add(i,
+        "\nMQTT: state %d, queued %d (%u bytes), published %u in %u batches, retries %u, received %u\n",
+        mqtt_state, mqtt_count, mqtt_bytes, mqtt_published, mqtt_batches, mqtt_retries, mqtt_received
+    );
+
+    i = page_add(i, "\nWebSocket: \"%s\", upgrades %u\n", ws_path, ws_upgrades);
+
+    i = page_add(i,
+        "\nBinary UART: %s, tx %u bytes for %u data, rx %u bytes for %u data, retries %u, errors %u, send fails %u\n",
+        bin_mode ? "on" : "off", bin_tx_bytes, bin_tx_data, bin_rx_bytes, bin_rx_data, bin_retries, bin_errors,
+        bin_send_fails
+    );
+
+    i = page_add(i, "\nGzip: %s\n", gzip_enabled ? "on" : "off");
+    for (int n = 0; n < config::links; n++) {
+        if (client[n] == nullptr || gzip_stats[n].in == 0)
+            continue;
+        i = page_add(i, "Gzip link %d: %u -> %u bytes, saved %d, %u ms\n",
+            n, gzip_stats[n].in, gzip_stats[n].out, (int)(gzip_stats[n].in - gzip_stats[n].out),
+            gzip_stats[n].us / 1000);
     }
 
-    h[0].next = &h[HISTSIZE - 1];
-    history = &h[0];
+    i = page_add(i, "\nCached responses served: %u\nWarm cache hits: %u\n",
+        cache_served, warm_hits);
+    i = page_add(i, "Snapshot: %d paths every %u ms, %d bytes, served %u\n",
+        snap_count, snap_interval, snap_len, snap_served);
+    for (int n = 0; n < CACHE_ENTRIES; n++) {
+        if (cache[n].data == nullptr)
+            continue;
+        i = page_add(i, "Cache %08x: %d bytes, age %u sec\n",
+            cache[n].path, cache[n].len, (millis() - cache[n].time) / 1000);
+    }
 
-    // init wifi station mode
-    WiFi.mode(WIFI_STA);
+    i = page_add(i,
+        "\nSerial RX buffer: %u\nSerial overruns: %u\nSerial RX errors: %u\n",
+        uart_rx_buffer, uart_overruns, uart_rx_errors
+    );
 
-    // init creds and connect to wifi
-    EEPROM.begin(512);
-    memset(&creds, 0, sizeof(creds));
-    EEPROM.get(0, creds);
-    if (creds.crc == creds_crc(&creds)) {
-        WiFi.begin(creds.ssid, creds.pass);
-    } else {
-        creds.ssid[0] = '\0';
-        creds.pass[0] = '\0';
+    i = page_add(i, "\nSerial max gap: %u us\n", serial_gap_max);
+    for (int n = 0; n < TASKS; n++) {
+        i = page_add(i,
+            "Task %s: budget %u us, runs %u, overruns %u, max %u us\n",
+            tasks[n].name, tasks[n].budget, tasks[n].runs, tasks[n].overruns, tasks[n].max_us
+        );
     }
 
-    // init http server
-    httpUpdater.setup(&httpServer, "/firmware", "admin", fwpw);
-    httpServer.on("/", handle_root);
-    httpServer.begin();
+    httpServer.send(200, "text/plain", buffer, i);
+}
 
-    // init server
-    if (rtc_usermem_get(&port) && port > 0) {
-        // spurious reset?
-        server = new WiFiServer(port);
-        server_port = port;
-        server->begin();
+
+// handle /snapshot, JSON document of MCU values
+void handle_snapshot()
+{
+    if (snap_doc == nullptr) {
+        httpServer.send(503, "text/plain", "no snapshot\n");
+        return;
     }
 
-    // init serial
-    Serial.begin(115200);
-    Serial.println(F("\r\nready"));
+    snap_served++;
+    httpServer.send(200, "application/json", snap_doc, snap_len);
 }
 
 
-// loop
-void loop()
+// serial input task: AT commands and AT+CIPSEND payload,
+// or binary frames
+static void task_serial(uint32_t budget)
 {
-    // check serial input
-    int available = Serial.available();
-    if (available > 0) {
+    uint32_t start = micros();
+    int available;
+
+    uart_rx_ready = false;
+
+    while (!bin_mode && (available = uart_rx_count()) > 0) {
         size_t r, l;
 
         if (send_len > 0) {
@@ -473,20 +4927,16 @@ void loop()
             else
                 l = available;
 
-            r = Serial.read(send_buffer + send_pos, l);
+            r = uart_rx_read(send_buffer + send_pos, l, -1);
 
             if (r > 0) {
                 send_pos += r;
                 send_len -= r;
             }
 
-            // entire buffer was read
-            if (send_len == 0) {
-                client[send_to]->write((uint8_t *)send_buffer, send_pos);
-                Serial.print(F("\r\nSEND OK\r\n"));
-                send_pos = 0;
-                send_to = -1;
-            }
+            // entire buffer was read, write it from busy_poll()
+            if (send_len == 0)
+                send_start();
         } else {
             // handle AT command buffer
             if (available > input_len)
@@ -494,7 +4944,7 @@ void loop()
             else
                 l = available;
 
-            r = Serial.read(input_buffer + input_pos, l);
+            r = uart_rx_read(input_buffer + input_pos, l, '\n');
 
             if (r > 0) {
                 Serial.write(input_buffer + input_pos, r);
@@ -510,7 +4960,10 @@ void loop()
                     l--;
 
                 input_buffer[l] = '\0';
-                process_command(input_buffer, l);
+                if (busy == BUSY_NONE && cmdq_count == 0)
+                    process_command(input_buffer, l);
+                else if (l > 0)
+                    cmdq_push(input_buffer, l);
                 input_len = sizeof(input_buffer);
                 input_pos = 0;
             }
@@ -521,71 +4974,598 @@ void loop()
                 input_pos = 0;
             }
         }
+
+        // leave the rest for the next slice
+        if (micros() - start >= budget) {
+            uart_rx_ready = true;
+            break;
+        }
+    }
+
+    // binary frames, UART is not read while DATA is written,
+    // read stops after a delimiter so nothing follows a DATA frame
+    while (bin_mode && busy == BUSY_NONE && (available = uart_rx_count()) > 0) {
+        uint8_t c[64];
+        size_t r = uart_rx_read((char *)c, available < (int)sizeof(c) ? available : sizeof(c), 0);
+
+        bin_rx_bytes += r;
+        for (size_t n = 0; n < r && busy == BUSY_NONE; n++)
+            bin_rx_byte(c[n]);
+
+        if (micros() - start >= budget) {
+            uart_rx_ready = true;
+            break;
+        }
+    }
+
+    // wake up when the rest of AT+CIPSEND payload is received
+    uart_rx_want = send_len < (int)uart_rx_mask / 2 ? send_len : uart_rx_mask / 2;
+
+    // finish long running operation and run queued commands
+    busy_poll();
+    if (bin_mode)
+        bin_poll();
+    if (busy == BUSY_NONE && cmdq_count > 0) {
+        struct cmdq *q = &cmdq[cmdq_head];
+
+        cmdq_head = (cmdq_head + 1) % CMDQ_SIZE;
+        cmdq_count--;
+        process_command(q->buffer, q->len);
     }
+}
 
-    // handle stat server requests
+
+// stat server task
+static void task_http(uint32_t budget)
+{
     httpServer.handleClient();
+}
+
 
-    // check new connection
-    if (server != nullptr) {
-        WiFiClient newClient = server->available();
+// new connection task
+static void task_accept(uint32_t budget)
+{
+    for (int n = 0; n < MAX_SERVERS; n++) {
+        WiFiClient *c;
+        int i;
 
-        if (newClient) {
-            int i;
+        if (servers[n].server == nullptr || !servers[n].server->hasClient())
+            continue;
 
-            // search first free client slot
-            for (i = 0 ; i < MAX_CLIENTS; i++) {
-                if (nullptr == client[i]) {
-                    client[i] = new WiFiClient(newClient);
-                    Serial.printf("%d,CONNECT\r\n", i);
-                    connected++;
-                    break;
-                }
+        // client waits until binary EXIT is taken, then gets AT CONNECT
+        if (bin_exit)
+            continue;
+
+        // idle keep-alive sockets give way to new connections
+        i = link_alloc(n);
+        if (i < 0 && http_evict(n))
+            i = link_alloc(n);
+
+        // no free link, close before TLS handshake
+        if (i < 0) {
+            servers[n].server->available().stop();
+            continue;
+        }
+
+        // BearSSL buffers would not fit, refuse rather than run out,
+        // or UART input would be lost during the handshake
+        if ((servers[n].cfg.flags & SERVER_TLS) &&
+            (tls_count() >= TLS_MAX_TOTAL || ESP.getFreeHeap() < TLS_HEAP_MIN || !tls_uart_ok())) {
+            servers[n].server->available().stop();
+            tls_refused++;
+            continue;
+        }
+
+        if (servers[n].cfg.flags & SERVER_TLS)
+            c = tls_accept(&servers[n]);
+        else
+            c = new WiFiClient(servers[n].server->available());
+
+        if (c == nullptr)
+            continue;
+
+        client[i] = c;
+        link_used |= 1U << i;
+        link_server[i] = n;
+        servers[n].links++;
+        connected++;
+
+        // HTTP link is connected for MCU when request arrives
+        if (http_link(i)) {
+            memset(&http[i], 0, sizeof(http[i]));
+            memset(&gzip_stats[i], 0, sizeof(gzip_stats[i]));
+            http[i].state = HTTP_IDLE;
+            http[i].since = millis();
+            continue;
+        }
+
+        urc_link(i, "CONNECT");
+        mirror(i, "CONNECT", nullptr, 0);
+    }
+}
+
+
+// observer mirror task: accept observers and read subscriptions
+static void task_mirror(uint32_t budget)
+{
+    struct observer *o;
+    int i;
+
+    if (mirror_server == nullptr)
+        return;
+
+    WiFiClient newClient = mirror_server->available();
+    if (newClient) {
+        for (i = 0; i < MAX_OBSERVERS; i++) {
+            if (observers[i].client == nullptr) {
+                o = &observers[i];
+                o->client = new WiFiClient(newClient);
+                o->mask = 0;
+                o->line_len = 0;
+                break;
+            }
+        }
+
+        if (i == MAX_OBSERVERS)
+            newClient.stop();
+    }
+
+    for (i = 0; i < MAX_OBSERVERS; i++) {
+        o = &observers[i];
+
+        if (o->client == nullptr)
+            continue;
+
+        if (!o->client->connected()) {
+            o->client->stop();
+            delete o->client;
+            o->client = nullptr;
+            continue;
+        }
+
+        while (o->client->available() > 0) {
+            int c = o->client->read();
+
+            if (c == '\n' || o->line_len == sizeof(o->line) - 1) {
+                if (o->line_len > 0 && o->line[o->line_len - 1] == '\r')
+                    o->line_len--;
+                o->line[o->line_len] = '\0';
+                mirror_subscribe(o);
+                o->line_len = 0;
+            } else {
+                o->line[o->line_len++] = c;
             }
+        }
+    }
+}
+
+
+// cache warming task, one request at a time while UART is idle
+static void task_warm(uint32_t budget)
+{
+    struct warm *w = nullptr;
+    uint32_t now = millis();
+    int k = 0;
+
+    // request in progress, task_clients() closes it on timeout
+    if (warm_link >= 0)
+        return;
+
+    if ((warm_interval == 0 || warm_count == 0) && (snap_interval == 0 || snap_count == 0))
+        return;
+
+    // UART is busy
+    if (uart_rx_count() > 0 || busy != BUSY_NONE || send_len > 0 || cmdq_count > 0)
+        return;
+
+    // MCU is busy with other requests
+    for (uint32_t m = link_used; m != 0; m &= m - 1)
+        if (http_link(__builtin_ctz(m)) && http[__builtin_ctz(m)].announced && !ws_link(__builtin_ctz(m)))
+            return;
+
+    // keep a link free for clients besides those reserved for ports
+    if (link_avail(LINK_INTERNAL) < 2)
+        return;
+
+    // oldest path due for refresh
+    for (int j = 0; j < warm_count && warm_interval > 0; j++)
+        if (now - warm[j].time >= warm_interval && (w == nullptr || (int32_t)(warm[j].time - w->time) < 0))
+            w = &warm[j];
+
+    for (int j = 0; j < snap_count && snap_interval > 0; j++) {
+        if (now - snap[j].time >= snap_interval && (w == nullptr || (int32_t)(snap[j].time - w->time) < 0)) {
+            w = &snap[j];
+            k = j;
+        }
+    }
+
+    if (w != nullptr) {
+        snap_pending = w == &snap[k] ? k : -1;
+        warm_request(w);
+    }
+}
+
+
+// MQTT task: reconnect, receive, keep-alive and queued publishes
+static void task_mqtt(uint32_t budget)
+{
+    uint32_t now = millis();
+
+    if (mqtt_state < MQTT_DISCONNECTED)
+        return;
+
+    if (mqtt_client == nullptr) {
+        if (mqtt_tcp != MQTT_TCP_IDLE) {
+            mqtt_poll();
+            return;
+        }
 
-            if (i == MAX_CLIENTS)
-                newClient.stop();
+        // broker is unreachable, wait longer before each attempt
+        if (mqtt_cfg.reconnect && busy != BUSY_MQTT && now - mqtt_since >= mqtt_backoff) {
+            mqtt_connect();
+            if (mqtt_backoff < MQTT_RECONNECT_MAX / 2)
+                mqtt_backoff *= 2;
+            else
+                mqtt_backoff = MQTT_RECONNECT_MAX;
         }
+        return;
+    }
+
+    if (!mqtt_client->connected()) {
+        mqtt_close();
+        return;
+    }
+
+    mqtt_read();
+    if (mqtt_client == nullptr)
+        return;
+
+    // no CONNACK or broker is silent
+    if (mqtt_state != MQTT_CONNECTED) {
+        if (now - mqtt_since >= MQTT_TIMEOUT)
+            mqtt_close();
+        return;
+    }
+
+    if (now - mqtt_rx_time >= MQTT_KEEPALIVE * 1500U) {
+        mqtt_close();
+        return;
+    }
+
+    mqtt_flush();
+
+    if (now - mqtt_tx_time >= MQTT_KEEPALIVE * 500U) {
+        uint8_t ping[2] = { 0xC0, 0 };
+        mqtt_write(ping, sizeof(ping));
     }
+}
+
+
+// connected clients task, visits occupied links only and resumes
+// from the first link not visited when the budget runs out
+static void task_clients(uint32_t budget)
+{
+    uint32_t start = micros();
+    uint32_t order;
+    bool visited = false;
+    int available;
+    int n = -1;  // first link not visited, relative to ipd_next
+
+    if (link_used == 0)
+        return;
 
-    // check connected clients
-    for (int i = 0 ; i < MAX_CLIENTS; i++) {
+    // occupied links rotated so bit 0 is ipd_next
+    order = link_used;
+    if (ipd_next > 0)
+        order = ((order >> ipd_next) | (order << (config::links - ipd_next))) & config::link_mask;
+
+    for (; order != 0; order &= order - 1) {
+        int i = (ipd_next + __builtin_ctz(order)) % config::links;
+        uint32_t t;
         int l;
 
-        // empty slot
-        if (client[i] == nullptr)
-            continue;
+        // out of budget or serial input is waiting
+        if (visited && (uart_rx_ready || micros() - start >= budget)) {
+            n = __builtin_ctz(order);
+            break;
+        }
+        visited = true;
 
         // client disconnected
         if (!client[i]->connected()) {
-            client[i]->stop();
-            delete client[i];
-            client[i] = nullptr;
-            Serial.printf("%d,CLOSED\r\n", i);
-            if (send_len > 0 && send_to == i) {
-                send_pos = 0;
-                send_len = 0;
-                send_to = -1;
+            // idle keep-alive socket is already closed for MCU
+            if (http_link(i) && !http[i].announced) {
+                link_free(i);
+                continue;
+            }
+
+            link_lost(i);
+            // drop link from pending send, busy_poll() reports failure
+            if (send_mask & (1U << i)) {
+                send_mask &= ~(1U << i);
+                send_fail = true;
+
+                // nobody left to receive AT+CIPSEND payload
+                if (send_mask == 0 && send_len > 0) {
+                    send_pos = 0;
+                    send_len = 0;
+                    send_fail = false;
+                }
             }
-            connected--;
             continue;
         }
 
         // get available bytes
         available = client[i]->available();
 
+        // MCU is late, serve stale copy and let MCU refresh it, socket
+        // without keep-alive is closed at once and the link is kept
+        // for MCU response like an internal one
+        if (http_link(i) && http[i].state != HTTP_IDLE && http[i].state != HTTP_WS && !http[i].responded &&
+            !http[i].detached && http[i].announced && cache_deadline > 0 &&
+            millis() - http[i].since >= cache_deadline && cache_serve(i)) {
+            http[i].detached = true;
+
+            if (!http[i].keepalive) {
+                client[i]->stop();
+                delete client[i];
+                client[i] = new InternalClient();
+                http[i].state = HTTP_WAIT;
+                continue;
+            }
+        }
+
+        // HTTP link waits for MCU response or for the next request
+        if (http_link(i) && http[i].state != HTTP_REQUEST && http[i].state != HTTP_WS) {
+            // MCU didn't close link nobody waits on
+            if (http[i].state == HTTP_WAIT) {
+                if (http[i].detached && !http[i].keepalive && millis() - http[i].since >= WARM_TIMEOUT)
+                    client[i]->stop();
+                continue;
+            }
+
+            if (available <= 0) {
+                if (millis() - http[i].since >= HTTP_KEEPALIVE_TIMEOUT)
+                    link_free(i);
+                continue;
+            }
+
+            // MCU gets CONNECT once request line is parsed
+            http_begin(i);
+            http[i].since = millis();
+        }
+
         if (available <= 0)
             continue;
 
-        if (available > (int)sizeof(buffer))
-            available = sizeof(buffer);
+        // wait for more data within coalescing window
+        if (coalesce_us > 0 && available < (coalesce_bytes > 0 ? coalesce_bytes : ipd_max)) {
+            uint32_t now = micros();
 
-        l = client[i]->read((uint8_t *)buffer, available);
-        Serial.printf("+IPD,%d,%d:", i, l);
-        Serial.write(buffer, l);
-        Serial.print(F("\r\nOK\r\n"));
+            if (!ipd_wait[i]) {
+                ipd_wait[i] = true;
+                ipd_since[i] = now;
+                continue;
+            }
+
+            if (now - ipd_since[i] < coalesce_us)
+                continue;
+        }
+
+        ipd_wait[i] = false;
+
+        if (available > ipd_max)
+            available = ipd_max;
+
+        // binary frame must fit window slot, data stays in socket
+        // until host acks
+        if (bin_mode) {
+            if (!bin_ready(i))
+                continue;
+            if (available > BIN_MTU)
+                available = BIN_MTU;
+        }
+
+        t = micros();
+
+        // WebSocket frames are unwrapped
+        if (ws_link(i)) {
+            l = ws_read(i, available);
+            if (tls_link(i)) {
+                tls_us += micros() - t;
+                tls_bytes += l;
+            }
+            if (l <= 0)
+                continue;
+        } else if (http_link(i)) {
+            // request is routed once its request line is complete
+            if (!http[i].announced && !http[i].local && http[i].req == HTTP_LINE_START && !http_line(i)) {
+                if (millis() - http[i].since >= HTTP_KEEPALIVE_TIMEOUT)
+                    link_free(i);
+                continue;
+            }
+
+            // forward current request only, pipelined requests stay in socket
+            l = http_read(i, available);
+            if (tls_link(i)) {
+                tls_us += micros() - t;
+                tls_bytes += l;
+            }
+            if (l <= 0)
+                continue;
+
+            // WebSocket path is answered here once headers are complete
+            if (!http[i].announced && ws_request(i)) {
+                if (http[i].state == HTTP_WAIT)
+                    ws_accept(i);
+                continue;
+            }
+
+            // answer from warm cache, or here if MCU is slow
+            if (!http[i].announced && !http[i].local) {
+                if (warm_hit(i)) {
+                    http[i].local = true;
+                    warm_hits++;
+                } else if (!breaker_allow(i)) {
+                    http[i].local = true;
+                } else {
+                    http[i].announced = true;
+                    http_requests++;
+                    urc_link(i, "CONNECT");
+                    mirror(i, "CONNECT", nullptr, 0);
+                }
+            }
+
+            // drop request answered by ESP, reply when it is complete,
+            // a chunked body has no end here so reply and close at once
+            if (http[i].local) {
+                if (http[i].state == HTTP_WAIT || (http[i].req == HTTP_BODY && http[i].req_chunked))
+                    http_local(i);
+                continue;
+            }
+        } else {
+            l = client[i]->read((uint8_t *)buffer, available);
+            if (tls_link(i)) {
+                tls_us += micros() - t;
+                tls_bytes += l;
+            }
+        }
+
+        link_ipd(i, buffer, l);
+    }
+
+    // all links visited, rotate start link
+    if (n < 0)
+        n = 1;
+
+    ipd_next = (ipd_next + n) % config::links;
+}
+
+
+// run task and update its stats
+static void task_run(struct task *t)
+{
+    uint32_t start = micros();
+    uint32_t elapsed;
+
+    // track max interval between serial input checks
+    if (t->run == task_serial && serial_checked) {
+        elapsed = start - serial_checked;
+        if (elapsed > serial_gap_max)
+            serial_gap_max = elapsed;
+    }
+
+    t->run(t->budget);
+
+    elapsed = micros() - start;
+    t->runs++;
+    if (elapsed > t->budget)
+        t->overruns++;
+    if (elapsed > t->max_us)
+        t->max_us = elapsed;
+
+    if (t->run == task_serial)
+        serial_checked = micros();
+}
+
+
+// setup
+void setup()
+{
+    struct server_cfg cfg[MAX_SERVERS];
+    unsigned i;
+
+    // init history
+    for (i = 0; i < config::history; i++) {
+        h[i].buffer[0] = '\0';
+        if (i > 0)
+            h[i].next = &h[i - 1];
+    }
+
+    h[0].next = &h[config::history - 1];
+    history = &h[0];
+
+    // sort tasks by priority
+    for (i = 1; i < TASKS; i++) {
+        struct task t = tasks[i];
+        int j = i;
+
+        for (; j > 0 && tasks[j - 1].priority > t.priority; j--)
+            tasks[j] = tasks[j - 1];
+
+        tasks[j] = t;
+    }
+
+    // init wifi station mode
+    WiFi.mode(WIFI_STA);
+
+    // init creds and connect to wifi
+    EEPROM.begin(512);
+    memset(&creds, 0, sizeof(creds));
+    EEPROM.get(0, creds);
+    if (creds.crc == creds_crc(&creds)) {
+        WiFi.begin(creds.ssid, creds.pass);
+    } else {
+        creds.ssid[0] = '\0';
+        creds.pass[0] = '\0';
+    }
+
+    // init uart settings
+    memset(&uart_cfg, 0, sizeof(uart_cfg));
+    EEPROM.get(sizeof(creds), uart_cfg);
+    if (uart_cfg.crc != uart_cfg_crc(&uart_cfg)) {
+        uart_cfg.baud = UART_BAUD;
+        uart_cfg.flow = 0;
+        uart_cfg.rx_buffer = UART_RX_BUFFER;
+    }
+
+    // init http server
+    httpUpdater.setup(&httpServer, "/firmware", "admin", fwpw);
+    httpServer.on("/", handle_root);
+    httpServer.on("/snapshot", handle_snapshot);
+    httpServer.begin();
+
+    // init observer mirror
+    if (MIRROR_PORT > 0) {
+        mirror_server = new WiFiServer(MIRROR_PORT);
+        mirror_server->begin();
     }
 
-    // update high32
-    (void)millis64();
-}
\ No newline at end of file
+    // init servers
+    if (rtc_usermem_get(cfg)) {
+        // spurious reset?
+        for (i = 0; i < MAX_SERVERS; i++)
+            if (cfg[i].port > 0)
+                server_start(&cfg[i]);
+    }
+
+    // init serial
+    uart_rx_buffer = uart_rx_resize(uart_cfg.rx_buffer);
+    Serial.setRxBufferSize(UART_CORE_RX_BUFFER);
+    Serial.begin(uart_cfg.baud);
+    uart_rx_begin();
+    uart_setup(uart_cfg.baud, uart_cfg.flow);
+    Serial.println(F("\r\nready"));
+}
+
+
+// loop
+void loop()
+{
+    uint32_t start = micros();
+    uint32_t elapsed;
+    int i;
+
+    for (i = 0; i < TASKS; i++) {
+        // complete serial input is serviced before every other task
+        if (i > 0 && uart_rx_ready)
+            task_run(&tasks[0]);
+
+        task_run(&tasks[i]);
+    }
+
+    elapsed = micros() - start;
+    loop_avg = (loop_avg * 15 + elapsed) / 16;
+    if (elapsed > loop_max)
+        loop_max = elapsed;
+}